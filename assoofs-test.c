@@ -0,0 +1,674 @@
+/*
+ *  Pruebas KUnit y microbenchmarks del asignador, el almacén de inodos y los directorios.
+ *  No es un fichero aparte: assoofs.c lo incluye al final (make ko KUNIT=1) para poder
+ *  llamar a sus funciones estáticas. Cada caso formatea y monta una imagen sobre un disco
+ *  en memoria, así se ejecuta igual en UML que en QEMU sin ningún dispositivo real. Los
+ *  resultados salen en formato KTAP por el log del kernel al cargar el módulo.
+ */
+#include <kunit/test.h>
+#include <linux/genhd.h>
+#include <linux/vmalloc.h>
+#include <linux/highmem.h>
+
+#define ASSOOFS_TEST_BLOCKS 8192        /* 32 MiB */
+#define ASSOOFS_TEST_BPG 2048           /* cuatro grupos, el último algo más corto */
+#define ASSOOFS_TEST_IPG (ASSOOFS_TEST_BPG / 8)
+/* mapas, contadores de referencias y almacén de inodos al principio de cada grupo */
+#define ASSOOFS_TEST_META (2 + DIV_ROUND_UP(ASSOOFS_TEST_BPG, ASSOOFS_DEFAULT_BLOCK_SIZE) + ASSOOFS_TEST_IPG / ASSOOFS_INODES_PER_BLOCK)
+#define ASSOOFS_TEST_WELCOME_INO 2
+#define ASSOOFS_TEST_CALLS 256          /* llamadas cronometradas en cada nivel de llenado */
+
+struct assoofs_test_ctx {
+    void *image;
+    int major;
+    struct request_queue *queue;
+    struct gendisk *disk;
+    struct super_block *sb;
+    uint64_t *held;                     /* bloques o inodos reservados por la prueba */
+    unsigned int nheld;
+    unsigned long *used;                /* los mismos, para detectar repeticiones */
+};
+
+/*
+ *  Disco en memoria: los bios se copian directamente a y desde un vmalloc
+ */
+static blk_qc_t assoofs_test_submit_bio(struct bio *bio) {
+    struct assoofs_test_ctx *ctx = bio->bi_disk->private_data;
+    sector_t sector = bio->bi_iter.bi_sector;
+    struct bvec_iter iter;
+    struct bio_vec bv;
+    void *mem, *disk;
+
+    switch (bio_op(bio)) {
+    case REQ_OP_READ:
+    case REQ_OP_WRITE:
+        if (bio_end_sector(bio) > get_capacity(bio->bi_disk)) {
+            bio->bi_status = BLK_STS_IOERR;
+            break;
+        }
+        bio_for_each_segment(bv, bio, iter) {
+            mem = kmap_atomic(bv.bv_page) + bv.bv_offset;
+            disk = ctx->image + (sector << SECTOR_SHIFT);
+            if (bio_data_dir(bio) == WRITE)
+                memcpy(disk, mem, bv.bv_len);
+            else
+                memcpy(mem, disk, bv.bv_len);
+            kunmap_atomic(mem);
+            sector += bv.bv_len >> SECTOR_SHIFT;
+        }
+        break;
+    case REQ_OP_FLUSH:
+        break;
+    default:
+        bio->bi_status = BLK_STS_NOTSUPP;
+    }
+    bio_endio(bio);
+    return BLK_QC_T_NONE;
+}
+
+static const struct block_device_operations assoofs_test_bdops = {
+    .owner = THIS_MODULE,
+    .submit_bio = assoofs_test_submit_bio,
+};
+
+static int assoofs_test_add_disk(struct assoofs_test_ctx *ctx) {
+    ctx->major = register_blkdev(0, "assoofs_test");
+    if (ctx->major < 0)
+        return ctx->major;
+    ctx->queue = blk_alloc_queue(NUMA_NO_NODE);
+    ctx->disk = alloc_disk(1);
+    if (!ctx->queue || !ctx->disk)
+        return -ENOMEM;
+    blk_queue_logical_block_size(ctx->queue, ASSOOFS_DEFAULT_BLOCK_SIZE);
+    ctx->disk->major = ctx->major;
+    ctx->disk->first_minor = 0;
+    ctx->disk->fops = &assoofs_test_bdops;
+    ctx->disk->private_data = ctx;
+    ctx->disk->queue = ctx->queue;
+    snprintf(ctx->disk->disk_name, DISK_NAME_LEN, "assoofs_test");
+    set_capacity(ctx->disk, (sector_t)ASSOOFS_TEST_BLOCKS * ASSOOFS_DEFAULT_BLOCK_SIZE >> SECTOR_SHIFT);
+    add_disk(ctx->disk);
+    return 0;
+}
+
+static void assoofs_test_del_disk(struct assoofs_test_ctx *ctx) {
+    if (ctx->disk && (ctx->disk->flags & GENHD_FL_UP))
+        del_gendisk(ctx->disk);
+    if (ctx->queue)
+        blk_cleanup_queue(ctx->queue);
+    if (ctx->disk)
+        put_disk(ctx->disk);
+    if (ctx->major > 0)
+        unregister_blkdev(ctx->major, "assoofs_test");
+}
+
+/*
+ *  Formateo en memoria con la misma geometría que calcula mkassoofs: la raíz y README.txt
+ *  en los dos primeros inodos y bloques de datos del grupo 0
+ */
+static void assoofs_test_set_bits(uint64_t *map, unsigned int from, unsigned int to) {
+    for (; from < to; from++)
+        map[from / 64] |= 1ULL << (from % 64);
+}
+
+static void assoofs_test_mkfs(void *image) {
+    const unsigned int gdt_blocks = 1, first = ASSOOFS_GDT_BLOCK_NUMBER + gdt_blocks;
+    const unsigned int ngroups = DIV_ROUND_UP(ASSOOFS_TEST_BLOCKS - first, ASSOOFS_TEST_BPG);
+    const unsigned int meta = ASSOOFS_TEST_META;
+    static const char body[] = "Hola mundo, os saludo desde un sistema de ficheros ASSOOFS.\n";
+    struct assoofs_super_block_info *asb = image;
+    struct assoofs_group_desc *gd = image + ASSOOFS_GDT_BLOCK_NUMBER * ASSOOFS_DEFAULT_BLOCK_SIZE;
+    struct assoofs_dir_record_entry *record;
+    struct assoofs_inode_info *inodes;
+    unsigned int g, start, nblocks, used;
+
+    for (g = 0; g < ngroups; g++, gd++) {
+        start = first + g * ASSOOFS_TEST_BPG;
+        nblocks = min_t(unsigned int, ASSOOFS_TEST_BPG, ASSOOFS_TEST_BLOCKS - start);
+        used = g ? 0 : 2;
+        gd->block_bitmap = start;
+        gd->inode_bitmap = start + 1;
+        gd->refcount_table = start + 2;
+        gd->inode_table = gd->refcount_table + DIV_ROUND_UP(ASSOOFS_TEST_BPG, ASSOOFS_DEFAULT_BLOCK_SIZE);
+        gd->free_blocks_count = nblocks - meta - used;
+        gd->free_inodes_count = ASSOOFS_TEST_IPG - used;
+        gd->dirs_count = g ? 0 : 1;
+        assoofs_test_set_bits(image + gd->block_bitmap * ASSOOFS_DEFAULT_BLOCK_SIZE, meta + used, nblocks);
+        assoofs_test_set_bits(image + gd->inode_bitmap * ASSOOFS_DEFAULT_BLOCK_SIZE, used, ASSOOFS_TEST_IPG);
+        asb->free_blocks += gd->free_blocks_count;
+    }
+
+    gd = image + ASSOOFS_GDT_BLOCK_NUMBER * ASSOOFS_DEFAULT_BLOCK_SIZE;
+    inodes = image + gd->inode_table * ASSOOFS_DEFAULT_BLOCK_SIZE;
+    inodes[0].mode = S_IFDIR;
+    inodes[0].links_count = 1;
+    inodes[0].inode_no = ASSOOFS_ROOTDIR_INODE_NUMBER;
+    inodes[0].data_block_number = first + meta;
+    inodes[0].dir_children_count = 1;
+    inodes[1].mode = S_IFREG;
+    inodes[1].links_count = 1;
+    inodes[1].inode_no = ASSOOFS_TEST_WELCOME_INO;
+    inodes[1].file_size = sizeof(body);
+    inodes[1].extents_count = 1;
+    inodes[1].extents[0].len = 1;
+    inodes[1].extents[0].start = first + meta + 1;
+    record = image + (first + meta) * ASSOOFS_DEFAULT_BLOCK_SIZE;
+    strscpy(record->filename, "README.txt", sizeof(record->filename));
+    record->inode_no = ASSOOFS_TEST_WELCOME_INO;
+    memcpy(image + (first + meta + 1) * ASSOOFS_DEFAULT_BLOCK_SIZE, body, sizeof(body));
+
+    asb->version = ASSOOFS_VERSION;
+    asb->magic = ASSOOFS_MAGIC;
+    asb->block_size = ASSOOFS_DEFAULT_BLOCK_SIZE;
+    asb->inodes_count = 2;
+    asb->blocks_count = ASSOOFS_TEST_BLOCKS;
+    asb->groups_count = ngroups;
+    asb->blocks_per_group = ASSOOFS_TEST_BPG;
+    asb->inodes_per_group = ASSOOFS_TEST_IPG;
+    asb->first_group_block = first;
+    asb->flags = ASSOOFS_SB_CLEAN;
+}
+
+/*
+ *  Montaje sin ruta en /dev: lo mismo que mount_bdev con el dispositivo ya abierto
+ */
+
+static int assoofs_test_mount(struct assoofs_test_ctx *ctx) {
+    fmode_t mode = FMODE_READ | FMODE_WRITE | FMODE_EXCL;
+    struct block_device *bdev;
+    struct super_block *sb;
+    int ret;
+
+    bdev = blkdev_get_by_dev(disk_devt(ctx->disk), mode, &assoofs_type);
+    if (IS_ERR(bdev))
+        return PTR_ERR(bdev);
+    sb = sget(&assoofs_type, NULL, assoofs_set_bdev_super, 0, bdev);
+    if (IS_ERR(sb)) {
+        blkdev_put(bdev, mode);
+        return PTR_ERR(sb);
+    }
+    // A partir de aquí el dispositivo lo suelta kill_block_super
+    sb->s_mode = mode;
+    snprintf(sb->s_id, sizeof(sb->s_id), "%pg", bdev);
+    ret = assoofs_fill_super(sb, NULL, 0);
+    if (ret) {
+        deactivate_locked_super(sb);
+        return ret;
+    }
+    sb->s_flags |= SB_ACTIVE;
+    bdev->bd_super = sb;
+    up_write(&sb->s_umount);
+    ctx->sb = sb;
+    return 0;
+}
+
+static int assoofs_test_init(struct kunit *test) {
+    struct assoofs_test_ctx *ctx;
+    int ret;
+
+    ctx = kunit_kzalloc(test, sizeof(*ctx), GFP_KERNEL);
+    if (!ctx)
+        return -ENOMEM;
+    test->priv = ctx;
+    ctx->held = kvcalloc(ASSOOFS_TEST_BLOCKS, sizeof(*ctx->held), GFP_KERNEL);
+    ctx->used = bitmap_zalloc(ASSOOFS_TEST_BLOCKS, GFP_KERNEL);
+    ctx->image = vzalloc(ASSOOFS_TEST_BLOCKS * ASSOOFS_DEFAULT_BLOCK_SIZE);
+    if (!ctx->held || !ctx->used || !ctx->image)
+        return -ENOMEM;
+    assoofs_test_mkfs(ctx->image);
+    ret = assoofs_test_add_disk(ctx);
+    if (!ret)
+        ret = assoofs_test_mount(ctx);
+    return ret;
+}
+
+static void assoofs_test_exit(struct kunit *test) {
+    struct assoofs_test_ctx *ctx = test->priv;
+
+    // También se llama si assoofs_test_init falló a medias
+    if (!ctx)
+        return;
+    if (ctx->sb) {
+        down_write(&ctx->sb->s_umount);
+        deactivate_locked_super(ctx->sb);
+    }
+    assoofs_test_del_disk(ctx);
+    vfree(ctx->image);
+    bitmap_free(ctx->used);
+    kvfree(ctx->held);
+}
+
+static void assoofs_test_report(struct kunit *test, const char *what, const char *level, u64 ns, unsigned int calls) {
+    kunit_info(test, "%s, %s: %llu ns/call over %u calls\n", what, level, div_u64(ns, calls), calls);
+}
+
+/*
+ *  Asignador de bloques
+ */
+static uint64_t assoofs_test_free_blocks(struct super_block *sb) {
+    return percpu_counter_sum(&ASSOOFS_FS(sb)->free_blocks);
+}
+
+// Cronometra n reservas de un bloque y comprueba después cada una
+static void assoofs_test_time_alloc(struct kunit *test, const char *level, unsigned int n) {
+    struct assoofs_test_ctx *ctx = test->priv;
+    struct super_block *sb = ctx->sb;
+    uint64_t *blocks = ctx->held + ctx->nheld, free = assoofs_test_free_blocks(sb), offset;
+    unsigned int i;
+    u64 start;
+
+    start = ktime_get_ns();
+    for (i = 0; i < n; i++)
+        KUNIT_ASSERT_EQ(test, assoofs_sb_get_a_freeblock(sb, 0, &blocks[i]), 0);
+    assoofs_test_report(test, "assoofs_sb_get_a_freeblock", level, ktime_get_ns() - start, n);
+
+    for (i = 0; i < n; i++) {
+        KUNIT_ASSERT_GE(test, blocks[i], ASSOOFS_SB(sb)->first_group_block);
+        KUNIT_ASSERT_LT(test, blocks[i], ASSOOFS_SB(sb)->blocks_count);
+        // Nunca dentro de los metadatos del grupo
+        offset = blocks[i] - assoofs_group_first_block(sb, assoofs_block_group(sb, blocks[i]));
+        KUNIT_EXPECT_GE(test, offset, (uint64_t)ASSOOFS_TEST_META);
+        KUNIT_EXPECT_FALSE(test, test_and_set_bit(blocks[i], ctx->used));
+    }
+    ctx->nheld += n;
+    KUNIT_EXPECT_EQ(test, assoofs_test_free_blocks(sb), free - n);
+}
+
+// Reserva sin cronometrar hasta que solo queden left bloques libres
+static void assoofs_test_fill_blocks(struct kunit *test, uint64_t left) {
+    struct assoofs_test_ctx *ctx = test->priv;
+    uint64_t block;
+
+    while (assoofs_test_free_blocks(ctx->sb) > left) {
+        KUNIT_ASSERT_EQ(test, assoofs_sb_get_a_freeblock(ctx->sb, 0, &block), 0);
+        KUNIT_ASSERT_FALSE(test, test_and_set_bit(block, ctx->used));
+        ctx->held[ctx->nheld++] = block;
+    }
+}
+
+static void assoofs_test_alloc(struct kunit *test) {
+    struct assoofs_test_ctx *ctx = test->priv;
+    struct super_block *sb = ctx->sb;
+    uint64_t total = assoofs_test_free_blocks(sb), block;
+    unsigned int i, kept;
+
+    assoofs_test_time_alloc(test, "empty", ASSOOFS_TEST_CALLS);
+    // Lo liberado vuelve entero al índice de tramos libres
+    for (i = 0; i < ctx->nheld; i++) {
+        assoofs_sb_free_block(sb, ctx->held[i]);
+        clear_bit(ctx->held[i], ctx->used);
+    }
+    ctx->nheld = 0;
+    KUNIT_EXPECT_EQ(test, assoofs_test_free_blocks(sb), total);
+
+    assoofs_test_fill_blocks(test, total / 2);
+    assoofs_test_time_alloc(test, "half", ASSOOFS_TEST_CALLS);
+    assoofs_test_fill_blocks(test, ASSOOFS_TEST_CALLS);
+    assoofs_test_time_alloc(test, "full", ASSOOFS_TEST_CALLS);
+    KUNIT_EXPECT_EQ(test, assoofs_test_free_blocks(sb), (uint64_t)0);
+    KUNIT_EXPECT_EQ(test, assoofs_sb_get_a_freeblock(sb, 0, &block), -ENOSPC);
+
+    // Fragmentado: uno de cada dos bloques reservados vuelve libre, todos en huecos de uno
+    for (i = 0, kept = 0; i < ctx->nheld; i++) {
+        if (i % 2) {
+            assoofs_sb_free_block(sb, ctx->held[i]);
+            clear_bit(ctx->held[i], ctx->used);
+        } else {
+            ctx->held[kept++] = ctx->held[i];
+        }
+    }
+    ctx->nheld = kept;
+    assoofs_test_time_alloc(test, "fragmented", ASSOOFS_TEST_CALLS);
+}
+
+/*
+ *  Almacén de inodos
+ */
+static uint64_t assoofs_test_free_inodes(struct super_block *sb) {
+    return percpu_counter_sum(&ASSOOFS_FS(sb)->free_inodes);
+}
+
+static void assoofs_test_new_inode(struct assoofs_inode_info *info, uint64_t marker) {
+    memset(info, 0, sizeof(*info));
+    info->mode = S_IFREG | 0644;
+    info->links_count = 1;
+    info->file_size = marker;
+}
+
+static void assoofs_test_time_inodes(struct kunit *test, const char *level, unsigned int n) {
+    struct assoofs_test_ctx *ctx = test->priv;
+    struct super_block *sb = ctx->sb;
+    uint64_t *inos = ctx->held + ctx->nheld, free = assoofs_test_free_inodes(sb);
+    struct assoofs_inode_info info, *got;
+    unsigned int i;
+    u64 start, ns = 0;
+
+    for (i = 0; i < n; i++) {
+        assoofs_test_new_inode(&info, ctx->nheld + i);
+        start = ktime_get_ns();
+        KUNIT_ASSERT_EQ(test, assoofs_add_inode_info(sb, &info, 0), 0);
+        ns += ktime_get_ns() - start;
+        inos[i] = info.inode_no;
+        KUNIT_ASSERT_GE(test, info.inode_no, (uint64_t)1);
+        KUNIT_ASSERT_LE(test, info.inode_no, assoofs_inodes_total(sb));
+        KUNIT_EXPECT_FALSE(test, test_and_set_bit(info.inode_no, ctx->used));
+    }
+    assoofs_test_report(test, "assoofs_add_inode_info", level, ns, n);
+    KUNIT_EXPECT_EQ(test, assoofs_test_free_inodes(sb), free - n);
+
+    ns = 0;
+    for (i = 0; i < n; i++) {
+        start = ktime_get_ns();
+        got = assoofs_get_inode_info(sb, inos[i]);
+        ns += ktime_get_ns() - start;
+        KUNIT_ASSERT_NOT_ERR_OR_NULL(test, got);
+        KUNIT_EXPECT_EQ(test, got->inode_no, inos[i]);
+        KUNIT_EXPECT_EQ(test, got->mode, (mode_t)(S_IFREG | 0644));
+        KUNIT_EXPECT_EQ(test, got->file_size, (uint64_t)(ctx->nheld + i));
+        assoofs_free_inode_info(got);
+    }
+    assoofs_test_report(test, "assoofs_get_inode_info", level, ns, n);
+    ctx->nheld += n;
+}
+
+static void assoofs_test_fill_inodes(struct kunit *test, uint64_t left) {
+    struct assoofs_test_ctx *ctx = test->priv;
+    struct assoofs_inode_info info;
+
+    while (assoofs_test_free_inodes(ctx->sb) > left) {
+        assoofs_test_new_inode(&info, ctx->nheld);
+        KUNIT_ASSERT_EQ(test, assoofs_add_inode_info(ctx->sb, &info, 0), 0);
+        KUNIT_ASSERT_FALSE(test, test_and_set_bit(info.inode_no, ctx->used));
+        ctx->held[ctx->nheld++] = info.inode_no;
+    }
+}
+
+static void assoofs_test_inodes(struct kunit *test) {
+    struct assoofs_test_ctx *ctx = test->priv;
+    struct super_block *sb = ctx->sb;
+    const unsigned int n = ASSOOFS_TEST_IPG / 4;
+    uint64_t total = assoofs_test_free_inodes(sb);
+    struct assoofs_inode_info info, *got;
+    unsigned int i, kept;
+
+    KUNIT_EXPECT_PTR_EQ(test, assoofs_get_inode_info(sb, 0), (struct assoofs_inode_info *)NULL);
+    KUNIT_EXPECT_PTR_EQ(test, assoofs_get_inode_info(sb, assoofs_inodes_total(sb) + 1), (struct assoofs_inode_info *)NULL);
+    got = assoofs_get_inode_info(sb, ASSOOFS_ROOTDIR_INODE_NUMBER);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, got);
+    KUNIT_EXPECT_TRUE(test, S_ISDIR(got->mode));
+    assoofs_free_inode_info(got);
+    set_bit(ASSOOFS_ROOTDIR_INODE_NUMBER, ctx->used);
+    set_bit(ASSOOFS_TEST_WELCOME_INO, ctx->used);
+
+    assoofs_test_time_inodes(test, "empty", n);
+    assoofs_test_fill_inodes(test, total / 2);
+    assoofs_test_time_inodes(test, "half", n);
+    assoofs_test_fill_inodes(test, n);
+    assoofs_test_time_inodes(test, "full", n);
+    assoofs_test_new_inode(&info, 0);
+    KUNIT_EXPECT_EQ(test, assoofs_add_inode_info(sb, &info, 0), -ENOSPC);
+
+    // Fragmentado: se libera uno de cada dos huecos y los nuevos tienen que ir a parar a ellos
+    for (i = 0, kept = 0; i < ctx->nheld; i++) {
+        if (i % 2) {
+            assoofs_free_inode_slot(sb, ctx->held[i], S_IFREG);
+            clear_bit(ctx->held[i], ctx->used);
+        } else {
+            ctx->held[kept++] = ctx->held[i];
+        }
+    }
+    ctx->nheld = kept;
+    assoofs_test_time_inodes(test, "fragmented", n);
+}
+
+// Búsqueda dentro de un bloque del almacén ya leído: acierto en los huecos ocupados, fallo en el resto
+static void assoofs_test_search(struct kunit *test) {
+    static const struct {
+        const char *level;
+        unsigned int every;             /* se ocupa uno de cada every huecos; 0, ninguno */
+    } levels[] = { { "empty", 0 }, { "half", 2 }, { "full", 1 }, { "fragmented", 3 } };
+    struct assoofs_inode_info *block, search, *found;
+    const unsigned int calls = ASSOOFS_TEST_CALLS * ASSOOFS_INODES_PER_BLOCK;
+    const uint64_t base = ASSOOFS_INODES_PER_BLOCK * 5;
+    unsigned int l, i, hits, expected;
+    u64 start, ns;
+
+    block = kunit_kzalloc(test, ASSOOFS_DEFAULT_BLOCK_SIZE, GFP_KERNEL);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, block);
+    for (l = 0; l < ARRAY_SIZE(levels); l++) {
+        memset(block, 0, ASSOOFS_DEFAULT_BLOCK_SIZE);
+        for (i = 0, expected = 0; i < ASSOOFS_INODES_PER_BLOCK; i++) {
+            if (levels[l].every && i % levels[l].every == 0) {
+                block[i].inode_no = base + i + 1;
+                expected++;
+            }
+        }
+        hits = 0;
+        ns = 0;
+        for (i = 0; i < calls; i++) {
+            search.inode_no = base + i % ASSOOFS_INODES_PER_BLOCK + 1;
+            start = ktime_get_ns();
+            found = assoofs_search_inode_info(NULL, block, &search);
+            ns += ktime_get_ns() - start;
+            if (found) {
+                KUNIT_EXPECT_EQ(test, found->inode_no, search.inode_no);
+                KUNIT_EXPECT_PTR_EQ(test, found, &block[i % ASSOOFS_INODES_PER_BLOCK]);
+                hits++;
+            }
+        }
+        KUNIT_EXPECT_EQ(test, hits, expected * ASSOOFS_TEST_CALLS);
+        assoofs_test_report(test, "assoofs_search_inode_info", levels[l].level, ns, calls);
+    }
+}
+
+/*
+ *  Directorios: el camino de assoofs_lookup por el índice en memoria y su filtro
+ */
+static void assoofs_test_dirent_name(char *buf, unsigned int i, struct qstr *name) {
+    snprintf(buf, ASSOOFS_FILENAME_MAXLEN, "file%02u", i);
+    *name = (struct qstr)QSTR_INIT(buf, strlen(buf));
+}
+
+static void assoofs_test_time_lookup(struct kunit *test, struct inode *dir, const char *level, const bool *present) {
+    struct assoofs_dir_index *idx;
+    struct assoofs_dir_name *dn;
+    char buf[ASSOOFS_FILENAME_MAXLEN];
+    struct qstr name;
+    unsigned int i, r, nhit = 0;
+    u64 start, cold = 0, hit = 0, miss = 0;
+    u32 hash;
+
+    // En frío el índice se reconstruye leyendo el bloque del directorio
+    for (r = 0; r < ASSOOFS_TEST_CALLS; r++) {
+        assoofs_dir_index_drop(dir);
+        start = ktime_get_ns();
+        idx = assoofs_dir_index_get(dir);
+        cold += ktime_get_ns() - start;
+        KUNIT_ASSERT_NOT_ERR_OR_NULL(test, idx);
+    }
+    assoofs_test_report(test, "assoofs_dir_index_get (cold)", level, cold, ASSOOFS_TEST_CALLS);
+
+    for (r = 0; r < ASSOOFS_TEST_CALLS; r++) {
+        for (i = 0; i < ASSOOFS_MAX_DIR_ENTRIES; i++) {
+            assoofs_test_dirent_name(buf, i, &name);
+            start = ktime_get_ns();
+            idx = assoofs_dir_index_get(dir);
+            hash = assoofs_name_hash(name.name, name.len);
+            dn = assoofs_bloom_test(idx, hash) ? assoofs_dir_index_find(idx, name.name, name.len, hash) : NULL;
+            if (present[i])
+                hit += ktime_get_ns() - start;
+            else
+                miss += ktime_get_ns() - start;
+            if (r)
+                continue;
+            KUNIT_EXPECT_TRUE(test, (dn != NULL) == present[i]);
+            if (dn)
+                KUNIT_EXPECT_EQ(test, dn->inode_no, (uint64_t)(1000 + i));
+        }
+    }
+    for (i = 0; i < ASSOOFS_MAX_DIR_ENTRIES; i++)
+        nhit += present[i];
+    if (nhit)
+        assoofs_test_report(test, "lookup hit", level, hit, nhit * ASSOOFS_TEST_CALLS);
+    if (nhit < ASSOOFS_MAX_DIR_ENTRIES)
+        assoofs_test_report(test, "lookup miss", level, miss, (ASSOOFS_MAX_DIR_ENTRIES - nhit) * ASSOOFS_TEST_CALLS);
+}
+
+static void assoofs_test_add_names(struct kunit *test, struct inode *dir, bool *present, unsigned int upto) {
+    char buf[ASSOOFS_FILENAME_MAXLEN];
+    struct qstr name;
+    unsigned int i;
+    int ret;
+
+    // README.txt ya ocupa una entrada
+    for (i = 0; i < upto && ASSOOFS_I(dir)->info.dir_children_count < ASSOOFS_MAX_DIR_ENTRIES; i++) {
+        if (present[i])
+            continue;
+        assoofs_test_dirent_name(buf, i, &name);
+        // Ningún ASSERT con el directorio bloqueado: el desmontaje se quedaría esperando
+        inode_lock(dir);
+        ret = assoofs_add_dirent(dir, &name, 1000 + i);
+        inode_unlock(dir);
+        KUNIT_ASSERT_EQ(test, ret, 0);
+        present[i] = true;
+    }
+}
+
+// Un acierto y un fallo por assoofs_lookup de verdad, con dentries
+static void assoofs_test_lookup_dentry(struct kunit *test, struct dentry *root, const char *filename, bool found) {
+    struct inode *dir = d_inode(root);
+    struct dentry *dentry, *ret;
+
+    dentry = d_alloc_name(root, filename);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, dentry);
+    inode_lock_shared(dir);
+    ret = assoofs_lookup(dir, dentry, 0);
+    inode_unlock_shared(dir);
+    KUNIT_EXPECT_PTR_EQ(test, ret, (struct dentry *)NULL);
+    KUNIT_EXPECT_EQ(test, d_really_is_positive(dentry), found);
+    if (found && d_really_is_positive(dentry))
+        KUNIT_EXPECT_EQ(test, d_inode(dentry)->i_ino, (unsigned long)ASSOOFS_TEST_WELCOME_INO);
+    // Fuera del dcache: la siguiente búsqueda del mismo nombre vuelve a pasar por assoofs_lookup
+    d_drop(dentry);
+    dput(dentry);
+}
+
+static void assoofs_test_dirents(struct kunit *test) {
+    struct assoofs_test_ctx *ctx = test->priv;
+    struct inode *dir = d_inode(ctx->sb->s_root);
+    bool present[ASSOOFS_MAX_DIR_ENTRIES] = { false };
+    char buf[ASSOOFS_FILENAME_MAXLEN];
+    struct qstr name;
+    unsigned int i;
+    int ret;
+
+    assoofs_test_lookup_dentry(test, ctx->sb->s_root, "README.txt", true);
+    assoofs_test_lookup_dentry(test, ctx->sb->s_root, "missing", false);
+
+    assoofs_test_time_lookup(test, dir, "empty", present);
+    assoofs_test_add_names(test, dir, present, ASSOOFS_MAX_DIR_ENTRIES / 2);
+    assoofs_test_time_lookup(test, dir, "half", present);
+    assoofs_test_add_names(test, dir, present, ASSOOFS_MAX_DIR_ENTRIES);
+    assoofs_test_time_lookup(test, dir, "full", present);
+    KUNIT_EXPECT_EQ(test, ASSOOFS_I(dir)->info.dir_children_count, (uint64_t)ASSOOFS_MAX_DIR_ENTRIES);
+    assoofs_test_dirent_name(buf, ASSOOFS_MAX_DIR_ENTRIES, &name);
+    inode_lock(dir);
+    ret = assoofs_add_dirent(dir, &name, 1000);
+    inode_unlock(dir);
+    KUNIT_EXPECT_EQ(test, ret, -ENOSPC);
+
+    // Fragmentado: los borrados mueven la última entrada al hueco y dejan bits en el filtro
+    for (i = 0; i < ASSOOFS_MAX_DIR_ENTRIES; i += 2) {
+        if (!present[i])
+            continue;
+        assoofs_test_dirent_name(buf, i, &name);
+        inode_lock(dir);
+        ret = assoofs_remove_dirent(dir, &name);
+        inode_unlock(dir);
+        KUNIT_ASSERT_EQ(test, ret, 0);
+        present[i] = false;
+    }
+    assoofs_test_time_lookup(test, dir, "fragmented", present);
+    assoofs_test_lookup_dentry(test, ctx->sb->s_root, "README.txt", true);
+}
+
+/*
+ *  Montaje tras un corte: los grupos se cargan al usarlos y, sin ASSOOFS_SB_CLEAN, sus
+ *  contadores se comprueban entonces contra los mapas. Al desmontar se comprueban todos.
+ */
+static void assoofs_test_unmount(struct assoofs_test_ctx *ctx) {
+    down_write(&ctx->sb->s_umount);
+    deactivate_locked_super(ctx->sb);
+    ctx->sb = NULL;
+}
+
+static void assoofs_test_unclean(struct kunit *test) {
+    struct assoofs_test_ctx *ctx = test->priv;
+    struct assoofs_super_block_info *asb = ctx->image;
+    struct assoofs_group_desc *gd = ctx->image + ASSOOFS_GDT_BLOCK_NUMBER * ASSOOFS_DEFAULT_BLOCK_SIZE;
+    uint64_t free_blocks = assoofs_test_free_blocks(ctx->sb), free_inodes = percpu_counter_sum(&ASSOOFS_FS(ctx->sb)->free_inodes);
+    uint64_t group_blocks, group_inodes;
+    struct assoofs_group_desc *mgd;
+    struct super_block *sb;
+    int ret;
+
+    // Desmontar bien deja la marca; el disco en memoria no guarda caché: se edita la imagen
+    assoofs_test_unmount(ctx);
+    KUNIT_ASSERT_TRUE(test, asb->flags & ASSOOFS_SB_CLEAN);
+    group_blocks = gd[2].free_blocks_count;
+    group_inodes = gd[2].free_inodes_count;
+    asb->flags &= ~ASSOOFS_SB_CLEAN;
+    gd[2].free_blocks_count -= 7;
+    gd[2].free_inodes_count -= 3;
+
+    ret = assoofs_test_mount(ctx);
+    KUNIT_ASSERT_EQ(test, ret, 0);
+    sb = ctx->sb;
+    KUNIT_EXPECT_FALSE(test, asb->flags & ASSOOFS_SB_CLEAN);
+    KUNIT_EXPECT_FALSE(test, ASSOOFS_FS(sb)->groups[2].loaded);
+    KUNIT_EXPECT_EQ(test, assoofs_test_free_blocks(sb), free_blocks - 7);
+
+    mutex_lock(&ASSOOFS_FS(sb)->groups[2].lock);
+    ret = assoofs_group_load(sb, 2);
+    mutex_unlock(&ASSOOFS_FS(sb)->groups[2].lock);
+    KUNIT_ASSERT_EQ(test, ret, 0);
+    mgd = assoofs_group_desc(sb, 2, NULL);
+    KUNIT_EXPECT_EQ(test, mgd->free_blocks_count, group_blocks);
+    KUNIT_EXPECT_EQ(test, mgd->free_inodes_count, group_inodes);
+    KUNIT_EXPECT_EQ(test, assoofs_test_free_blocks(sb), free_blocks);
+    KUNIT_EXPECT_EQ(test, (uint64_t)percpu_counter_sum(&ASSOOFS_FS(sb)->free_inodes), free_inodes);
+
+    // Al desmontar el arreglo llega al disco y la marca vuelve
+    assoofs_test_unmount(ctx);
+    KUNIT_EXPECT_TRUE(test, asb->flags & ASSOOFS_SB_CLEAN);
+    KUNIT_EXPECT_EQ(test, gd[2].free_blocks_count, group_blocks);
+    KUNIT_EXPECT_EQ(test, gd[2].free_inodes_count, group_inodes);
+    KUNIT_EXPECT_EQ(test, asb->free_blocks, free_blocks);
+}
+
+static struct kunit_case assoofs_test_cases[] = {
+    KUNIT_CASE(assoofs_test_alloc),
+    KUNIT_CASE(assoofs_test_inodes),
+    KUNIT_CASE(assoofs_test_search),
+    KUNIT_CASE(assoofs_test_dirents),
+    KUNIT_CASE(assoofs_test_unclean),
+    {}
+};
+
+static struct kunit_suite assoofs_test_suite = {
+    .name = "assoofs",
+    .init = assoofs_test_init,
+    .exit = assoofs_test_exit,
+    .test_cases = assoofs_test_cases,
+};
+
+static struct kunit_suite *assoofs_test_suites[] = { &assoofs_test_suite, NULL };
+
+// kunit_test_suites() en un módulo usa su propio module_init: la suite se lanza desde assoofs_init
+static void assoofs_test_run(void) {
+    __kunit_test_suites_init(assoofs_test_suites);
+}
+
+static void assoofs_test_done(void) {
+    __kunit_test_suites_exit(assoofs_test_suites);
+}
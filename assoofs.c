@@ -4,360 +4,5304 @@
 #include <linux/fs.h>           /* libfs stuff           */
 #include <linux/buffer_head.h>  /* buffer_head           */
 #include <linux/slab.h>         /* kmem_cache            */
+#include <linux/percpu.h>       /* contadores por CPU    */
+#include <linux/kobject.h>      /* /sys/fs/assoofs       */
+#include <linux/sysfs.h>
+#include <linux/ktime.h>
+#include <linux/iomap.h>       /* E/S directa           */
+#include <linux/uio.h>
+#include <linux/blkdev.h>       /* blk_plug              */
+#include <linux/workqueue.h>    /* liberación diferida   */
+#include <linux/hash.h>
+#include <linux/stringhash.h>   /* full_name_hash        */
+#include <linux/percpu_counter.h>
+#include <linux/pagemap.h>
+#include <linux/mpage.h>        /* writeback en lote     */
+#include <linux/mount.h>        /* mnt_want_write_file   */
+#include <linux/uaccess.h>
+#include <linux/parser.h>       /* opciones de montaje   */
+#include <linux/seq_file.h>
+#include <linux/list_sort.h>
+#include <linux/rbtree.h>       /* índice de tramos libres */
+#include <linux/list_lru.h>     /* shrinker de las cachés */
+#include <linux/xarray.h>       /* bloques de paquetes   */
+#include <linux/genhd.h>        /* volúmenes de varios dispositivos */
+#include <linux/highmem.h>      /* invalidate_kernel_vmap_range */
 #include "assoofs.h"
 
+/*
+ *  Información en memoria de cada montaje
+ */
+struct assoofs_stats {
+    u64 block_reads;        /* bloques leídos con sb_bread */
+    u64 block_writes;       /* bloques de metadatos escritos con sync_dirty_buffer */
+    u64 readahead_blocks;   /* lecturas anticipadas de metadatos lanzadas */
+    u64 sync_write_ns;      /* tiempo total esperando escrituras síncronas */
+    u64 lookup_hits;
+    u64 lookup_misses;
+    u64 lookup_bloom_rejects; /* fallos descartados por el filtro sin mirar la tabla */
+    u64 alloc_calls;        /* reservas de tramos de bloques */
+    u64 alloc_scan_bits;    /* bits recorridos en los mapas de inodos libres */
+    u64 bytes_read;
+    u64 bytes_written;
+    u64 writeback_pages;    /* páginas enviadas por assoofs_writepages */
+    u64 defrag_blocks;      /* bloques movidos por ASSOOFS_IOC_DEFRAG */
+    u64 discard_blocks;     /* bloques descartados, con -o discard o con FITRIM */
+    u64 cache_shrunk;       /* mapas de extents e índices de directorio soltados por el shrinker */
+    u64 pack_stores;        /* ficheros pequeños guardados en un bloque de paquetes */
+    u64 pack_unpacks;       /* ficheros que crecieron y pasaron a un bloque propio */
+};
+
+struct assoofs_fs_info {
+    struct assoofs_super_block_info *asb;   /* apunta a sb_bh->b_data */
+    struct buffer_head *sb_bh;              /* bloque 0, retenido mientras dure el montaje */
+    struct assoofs_stats __percpu *stats;
+    struct kobject kobj;                    /* /sys/fs/assoofs/<dev> */
+    struct completion kobj_unregister;
+    struct super_block *sb;
+    struct mutex lock;                      /* lista de huérfanos */
+    unsigned int __percpu *inode_hint;      /* cursor de grupos de cada CPU para directorios nuevos */
+    struct buffer_head **gdt_bh;            /* tabla de descriptores de grupo, retenida como sb_bh */
+    unsigned int gdt_blocks;
+    struct assoofs_group_info *groups;
+    struct percpu_counter free_blocks;      /* resumen en memoria de los descriptores */
+    struct percpu_counter free_inodes;
+    spinlock_t reclaim_lock;
+    struct list_head reclaim_list;          /* inodos sin enlaces pendientes de liberar */
+    struct work_struct reclaim_work;
+    unsigned int mount_opt;                 /* ASSOOFS_MOUNT_* */
+    spinlock_t discard_lock;
+    struct list_head discard_list;          /* tramos liberados pendientes de descartar */
+    atomic_long_t discard_pending;          /* bloques en discard_list */
+    struct delayed_work discard_work;
+    struct list_lru cache_lru;              /* inodos con memoria que el shrinker puede soltar */
+    struct mutex pack_lock;                 /* cabeceras de los bloques de paquetes */
+    struct xarray packs;                    /* bloques de paquetes con sitio conocidos: su mapa de trozos */
+    void *sealed;                           /* imagen sellada: su zona de metadatos entera */
+    size_t sealed_size;
+    bool unclean;                           /* sin ASSOOFS_SB_CLEAN al montar: se recuenta cada grupo al cargarlo */
+};
+
+#define ASSOOFS_MOUNT_DISCARD 0x1           /* -o discard: descarta lo que se libera */
+
+struct assoofs_group_info {
+    struct mutex lock;                      /* mapas y contadores del grupo */
+    unsigned int inode_hint;                /* siguiente bit a mirar en el mapa de inodos */
+    bool loaded;                            /* índice de tramos construido, al primer uso del grupo */
+    struct rb_root free_by_start;           /* tramos libres asignables, por posición */
+    struct rb_root free_by_len;             /* los mismos, por longitud */
+};
+
+// Lo que cuelga de inode->i_private: la copia persistente va primero para poder usarla directamente
+struct assoofs_inode {
+    struct assoofs_inode_info info;
+    struct assoofs_dir_index *dir_index;    /* solo directorios, NULL hasta la primera lectura */
+    struct rw_semaphore map_sem;            /* mapa de extents */
+    struct assoofs_extent *extents;         /* info.extents o, si no caben, una copia completa */
+    uint32_t write_end;                     /* último bloque de la escritura en curso, 0 si no hay */
+    struct list_head lru;                   /* en fs->cache_lru mientras tenga mapa propio o índice */
+    struct inode *inode;                    /* para llegar al inodo desde el shrinker */
+    bool referenced;                        /* usado desde la última pasada del shrinker */
+};
+
+static inline struct assoofs_inode *ASSOOFS_I(struct inode *inode) {
+    return inode->i_private;
+}
+
+static inline struct assoofs_fs_info *ASSOOFS_FS(struct super_block *sb) {
+    return sb->s_fs_info;
+}
+
+static inline struct assoofs_super_block_info *ASSOOFS_SB(struct super_block *sb) {
+    return ASSOOFS_FS(sb)->asb;
+}
+
+/*
+ *  Memoria que el shrinker del superbloque puede soltar: mapas de extents que no caben en
+ *  el inodo e índices de directorio. Los inodos que la tienen van a fs->cache_lru.
+ */
+static inline void assoofs_cache_add(struct inode *inode) {
+    struct assoofs_inode *ai = inode->i_private;
+
+    ai->inode = inode;
+    list_lru_add(&ASSOOFS_FS(inode->i_sb)->cache_lru, &ai->lru);
+}
+
+static inline void assoofs_cache_del(struct inode *inode) {
+    list_lru_del(&ASSOOFS_FS(inode->i_sb)->cache_lru, &((struct assoofs_inode *)inode->i_private)->lru);
+}
+
+// Se marca sin reordenar la lista: el shrinker da una segunda vuelta a lo marcado
+static inline void assoofs_cache_touch(struct assoofs_inode *ai) {
+    if (!READ_ONCE(ai->referenced))
+        WRITE_ONCE(ai->referenced, true);
+}
+
+#define assoofs_stat_add(sb, field, n) this_cpu_add(ASSOOFS_FS(sb)->stats->field, (n))
+#define assoofs_stat_inc(sb, field) assoofs_stat_add(sb, field, 1)
+
+/*
+ *  Acceso a bloques: todas las lecturas y escrituras de metadatos pasan por aquí
+ */
+static struct buffer_head *assoofs_bread(struct super_block *sb, sector_t block) {
+    assoofs_stat_inc(sb, block_reads);
+    return sb_bread(sb, block);
+}
+
+static int assoofs_sync_bh(struct super_block *sb, struct buffer_head *bh) {
+    u64 start = ktime_get_ns();
+    int ret;
+
+    mark_buffer_dirty(bh);
+    ret = sync_dirty_buffer(bh);
+    assoofs_stat_inc(sb, block_writes);
+    assoofs_stat_add(sb, sync_write_ns, ktime_get_ns() - start);
+    return ret;
+}
+
+// Escritura diferida: el bloque sale con la writeback del dispositivo, salvo en montajes síncronos
+static int assoofs_dirty_bh(struct super_block *sb, struct buffer_head *bh) {
+    if (sb->s_flags & SB_SYNCHRONOUS)
+        return assoofs_sync_bh(sb, bh);
+    mark_buffer_dirty(bh);
+    return 0;
+}
+
+/*
+ *  Escribe el bloque, si está sucio, con PREFLUSH|FUA: lo ya completado antes y él mismo quedan
+ *  en el medio con una sola orden. Devuelve 1 si no había nada que escribir.
+ */
+static int assoofs_fua_bh(struct super_block *sb, struct buffer_head *bh) {
+    u64 start = ktime_get_ns();
+
+    if (!bh)
+        return 1;
+    lock_buffer(bh);
+    if (!test_clear_buffer_dirty(bh)) {
+        unlock_buffer(bh);
+        return 1;
+    }
+    get_bh(bh);
+    bh->b_end_io = end_buffer_write_sync;
+    submit_bh(REQ_OP_WRITE, REQ_SYNC | REQ_PREFLUSH | REQ_FUA, bh);
+    wait_on_buffer(bh);
+    assoofs_stat_inc(sb, block_writes);
+    assoofs_stat_add(sb, sync_write_ns, ktime_get_ns() - start);
+    return buffer_uptodate(bh) ? 0 : -EIO;
+}
+
+// Lectura anticipada asíncrona: no espera, solo deja el bloque en camino hacia la caché de buffers
+static void assoofs_breadahead(struct super_block *sb, sector_t block) {
+    assoofs_stat_inc(sb, readahead_blocks);
+    sb_breadahead(sb, block);
+}
+
+#define ASSOOFS_INODES_PER_BLOCK (ASSOOFS_DEFAULT_BLOCK_SIZE / sizeof(struct assoofs_inode_info))
+#define ASSOOFS_DESCS_PER_BLOCK (ASSOOFS_DEFAULT_BLOCK_SIZE / sizeof(struct assoofs_group_desc))
+
+/*
+ *  Geometría de los grupos
+ */
+static inline uint64_t assoofs_group_first_block(struct super_block *sb, unsigned int g) {
+    return ASSOOFS_SB(sb)->first_group_block + (uint64_t)g * ASSOOFS_SB(sb)->blocks_per_group;
+}
+
+static inline unsigned int assoofs_block_group(struct super_block *sb, uint64_t block) {
+    return (block - ASSOOFS_SB(sb)->first_group_block) / ASSOOFS_SB(sb)->blocks_per_group;
+}
+
+// El último grupo puede ser más corto que el resto
+static inline unsigned int assoofs_group_nblocks(struct super_block *sb, unsigned int g) {
+    return min_t(uint64_t, ASSOOFS_SB(sb)->blocks_per_group, ASSOOFS_SB(sb)->blocks_count - assoofs_group_first_block(sb, g));
+}
+
+static inline unsigned int assoofs_ino_group(struct super_block *sb, uint64_t ino) {
+    return (ino - 1) / ASSOOFS_SB(sb)->inodes_per_group;
+}
+
+static inline uint64_t assoofs_inodes_total(struct super_block *sb) {
+    return ASSOOFS_SB(sb)->groups_count * ASSOOFS_SB(sb)->inodes_per_group;
+}
+
+static struct assoofs_group_desc *assoofs_group_desc(struct super_block *sb, unsigned int g, struct buffer_head **bhp) {
+    struct buffer_head *bh = ASSOOFS_FS(sb)->gdt_bh[g / ASSOOFS_DESCS_PER_BLOCK];
+
+    if (bhp)
+        *bhp = bh;
+    return (struct assoofs_group_desc *)bh->b_data + g % ASSOOFS_DESCS_PER_BLOCK;
+}
+
+// El inodo ino ocupa el hueco (ino - 1) % inodes_per_group del almacén de su grupo: su posición se calcula, no se busca
+static sector_t assoofs_inode_table_block(struct super_block *sb, uint64_t ino) {
+    uint64_t idx = (ino - 1) % ASSOOFS_SB(sb)->inodes_per_group;
+
+    return assoofs_group_desc(sb, assoofs_ino_group(sb, ino), NULL)->inode_table + idx / ASSOOFS_INODES_PER_BLOCK;
+}
+
+/*
+ *  Al montar solo se piden los mapas y el almacén de inodos del grupo raíz, lo primero que se
+ *  va a usar; los demás grupos se leen cuando hacen falta, así montar no crece con el volumen.
+ */
+static void assoofs_readahead_metadata(struct super_block *sb) {
+    struct assoofs_group_desc *gd = assoofs_group_desc(sb, 0, NULL);
+    struct blk_plug plug;
+    uint64_t i;
+
+    blk_start_plug(&plug);
+    assoofs_breadahead(sb, gd->block_bitmap);
+    assoofs_breadahead(sb, gd->inode_bitmap);
+    for (i = 0; i < ASSOOFS_SB(sb)->inodes_per_group / ASSOOFS_INODES_PER_BLOCK; i++)
+        assoofs_breadahead(sb, gd->inode_table + i);
+    blk_finish_plug(&plug);
+}
+
 /*
  *  Operaciones sobre ficheros
  */
-ssize_t assoofs_read(struct file * filp, char __user * buf, size_t len, loff_t * ppos);
-ssize_t assoofs_write(struct file * filp, const char __user * buf, size_t len, loff_t * ppos);
+static ssize_t assoofs_read_iter(struct kiocb *iocb, struct iov_iter *to);
+static ssize_t assoofs_write_iter(struct kiocb *iocb, struct iov_iter *from);
 int assoofs_save_inode_info(struct super_block *sb, struct assoofs_inode_info *inode_info);
+static int assoofs_write_inode_info(struct super_block *sb, struct assoofs_inode_info *inode_info, bool sync);
+int assoofs_sb_get_a_freeblock(struct super_block *sb, uint64_t goal, uint64_t *block);
+static int assoofs_alloc_data_block(struct super_block *sb, uint64_t goal, uint64_t *block);
+static void assoofs_sb_free_block(struct super_block *sb, uint64_t block);
+static void assoofs_sb_free_blocks(struct super_block *sb, uint64_t block, unsigned int count);
+static bool assoofs_block_shared(struct super_block *sb, uint64_t block);
+static int assoofs_blocks_get(struct super_block *sb, uint64_t block, unsigned int count);
+static int assoofs_alloc_blocks(struct super_block *sb, uint64_t goal, unsigned int want, unsigned int hint, bool sync, uint64_t *block, unsigned int *count);
+static void assoofs_free_run(struct super_block *sb, unsigned int g, unsigned int b, unsigned int count);
+static int assoofs_pack_alloc(struct super_block *sb, uint64_t goal, unsigned int size, uint64_t *block, unsigned int *offset);
+static void assoofs_pack_free(struct super_block *sb, uint64_t block, unsigned int offset, unsigned int size);
+static int assoofs_pack_unpack(struct inode *inode);
+static long assoofs_ioc_trim(struct file *file, struct fstrim_range __user *arg);
+static loff_t assoofs_remap_file_range(struct file *file_in, loff_t pos_in, struct file *file_out, loff_t pos_out, loff_t len, unsigned int remap_flags);
+static ssize_t assoofs_copy_file_range(struct file *file_in, loff_t pos_in, struct file *file_out, loff_t pos_out, size_t len, unsigned int flags);
+static loff_t assoofs_llseek(struct file *file, loff_t offset, int whence);
+static long assoofs_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
+static int assoofs_fsync(struct file *file, loff_t start, loff_t end, int datasync);
+static struct assoofs_log *assoofs_log_of(struct block_device *bdev);
 static struct kmem_cache *assoofs_inode_cache;
 
 
 const struct file_operations assoofs_file_operations = {
-    .read = assoofs_read,
-    .write = assoofs_write,
+    .read_iter = assoofs_read_iter,
+    .write_iter = assoofs_write_iter,
+    .llseek = assoofs_llseek,
+    .fsync = assoofs_fsync,
+    .copy_file_range = assoofs_copy_file_range,
+    .remap_file_range = assoofs_remap_file_range,
+    .unlocked_ioctl = assoofs_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
 };
 
-ssize_t assoofs_read(struct file * filp, char __user * buf, size_t len, loff_t * ppos) {
-    printk(KERN_INFO "Read request\n");
-struct assoofs_inode_info *inode_info ;
-struct buffer_head *bh;
-char *buffer;
-int nbytes;
-inode_info= filp->f_path.dentry->d_inode->i_private;
+/*
+ *  Mapa de extents de los ficheros regulares. En memoria está entero en ai->extents, que
+ *  apunta a info.extents mientras quepa en el inodo y a un array propio cuando no.
+ *  Lo protege ai->map_sem; info.extents se mantiene siempre igual a los primeros.
+ *  El array propio de un inodo limpio lo puede soltar el shrinker (queda a NULL): quien
+ *  vaya a usar el mapa toma map_sem con assoofs_map_lock, que lo vuelve a leer.
+ */
+// Índice del último extent que empieza en iblock o antes, -1 si no hay ninguno
+static int assoofs_extent_search(struct assoofs_inode *ai, uint32_t iblock) {
+    int lo = 0, hi = (int)ai->info.extents_count - 1, mid;
+
+    while (lo <= hi) {
+        mid = (lo + hi) / 2;
+        if (ai->extents[mid].file_block <= iblock)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+    return hi;
+}
+
+/*
+ *  Traduce iblock a un bloque del dispositivo en *pblock y devuelve cuántos bloques
+ *  seguidos (hasta max) quedan en el mismo tramo. En un hueco *pblock vale 0 y lo
+ *  devuelto es lo que falta hasta el siguiente extent.
+ */
+static unsigned int assoofs_extent_lookup(struct assoofs_inode *ai, uint32_t iblock, unsigned int max, uint64_t *pblock) {
+    int i = assoofs_extent_search(ai, iblock);
+    struct assoofs_extent *ext;
+
+    if (i >= 0) {
+        ext = &ai->extents[i];
+        if ((uint64_t)iblock < (uint64_t)ext->file_block + ext->len) {
+            *pblock = ext->start + (iblock - ext->file_block);
+            return min_t(uint64_t, max, (uint64_t)ext->file_block + ext->len - iblock);
+        }
+    }
+    *pblock = 0;
+    if (i + 1 < (int)ai->info.extents_count)
+        return min_t(uint32_t, max, ai->extents[i + 1].file_block - iblock);
+    return max;
+}
 
-if (*ppos >= inode_info->file_size) return 0;
+// Objetivo para un bloque nuevo: donde tocaría según el tramo anterior, o el grupo del inodo
+static uint64_t assoofs_extent_goal(struct inode *inode, uint32_t iblock) {
+    struct assoofs_inode *ai = ASSOOFS_I(inode);
+    int i = assoofs_extent_search(ai, iblock);
 
-bh = sb_bread(filp->f_path.dentry->d_inode->i_sb, inode_info->data_block_number);
-buffer = (char *)bh->b_data;
-nbytes = min((size_t) inode_info->file_size, len); // Hay que comparar len con el tama~no del fichero por si llegamos alfinal del fichero
-copy_to_user(buf, buffer, nbytes);
-*ppos += nbytes;
-return nbytes;
+    if (i >= 0)
+        return ai->extents[i].start + (iblock - ai->extents[i].file_block);
+    return assoofs_group_first_block(inode->i_sb, assoofs_ino_group(inode->i_sb, inode->i_ino));
 }
 
-ssize_t assoofs_write(struct file * filp, const char __user * buf, size_t len, loff_t * ppos) {
-    printk(KERN_INFO "Write request\n");
-struct assoofs_inode_info *inode_info;
-inode_info= filp->f_path.dentry->d_inode->i_private;
-if (*ppos >= inode_info->file_size) return 0;
-struct buffer_head *bh;
-char *buffer;
-bh = sb_bread(filp->f_path.dentry->d_inode->i_sb, inode_info->data_block_number);
-buffer = (char *)bh->b_data;
-buffer += *ppos;
-copy_from_user(buffer, buf, len);
-inode_info->file_size = *ppos;
-assoofs_save_inode_info(filp->f_path.dentry->d_inode->i_sb, inode_info);
-return len;
+// El mapa deja de caber en el inodo: pasa a un array propio y se reserva su bloque
+static int assoofs_extent_spill(struct inode *inode) {
+    struct assoofs_inode *ai = ASSOOFS_I(inode);
+    struct assoofs_extent *ext;
+    int ret;
+
+    ext = kmalloc_array(ASSOOFS_MAX_EXTENTS, sizeof(*ext), GFP_NOFS);
+    if (!ext)
+        return -ENOMEM;
+    if (!ai->info.extent_block) {
+        ret = assoofs_alloc_data_block(inode->i_sb, assoofs_extent_goal(inode, 0), &ai->info.extent_block);
+        if (ret) {
+            kfree(ext);
+            return ret;
+        }
+    }
+    memcpy(ext, ai->info.extents, sizeof(ai->info.extents));
+    ai->extents = ext;
+    assoofs_cache_add(inode);
+    return 0;
+}
+
+// Asegura sitio para extra extents más, pasando el mapa a su bloque si hace falta
+static int assoofs_extent_reserve(struct inode *inode, unsigned int extra) {
+    struct assoofs_inode *ai = ASSOOFS_I(inode);
+    unsigned int count = ai->info.extents_count;
+
+    if (count + extra > ASSOOFS_MAX_EXTENTS)
+        return -EFBIG;
+    if (ai->extents == ai->info.extents && count + extra > ASSOOFS_INLINE_EXTENTS)
+        return assoofs_extent_spill(inode);
+    return 0;
+}
+
+static void assoofs_extent_changed(struct inode *inode) {
+    struct assoofs_inode *ai = ASSOOFS_I(inode);
+
+    if (ai->extents != ai->info.extents)
+        memcpy(ai->info.extents, ai->extents, sizeof(ai->info.extents));
+    mark_inode_dirty(inode);
+}
+
+// Añade el tramo iblock -> pblock de len bloques, fusionándolo con sus vecinos si son contiguos
+static int assoofs_extent_insert(struct inode *inode, uint32_t iblock, uint64_t pblock, uint32_t len) {
+    struct assoofs_inode *ai = ASSOOFS_I(inode);
+    unsigned int count = ai->info.extents_count;
+    int i = assoofs_extent_search(ai, iblock), ret;
+    struct assoofs_extent *prev = i >= 0 ? &ai->extents[i] : NULL;
+    struct assoofs_extent *next = i + 1 < (int)count ? &ai->extents[i + 1] : NULL;
+
+    if (prev && prev->file_block + prev->len == iblock && prev->start + prev->len == pblock) {
+        prev->len += len;
+        if (next && iblock + len == next->file_block && pblock + len == next->start) {
+            prev->len += next->len;
+            memmove(next, next + 1, (count - i - 2) * sizeof(*next));
+            ai->info.extents_count--;
+        }
+        goto out;
+    }
+    if (next && iblock + len == next->file_block && pblock + len == next->start) {
+        next->file_block = iblock;
+        next->start = pblock;
+        next->len += len;
+        goto out;
+    }
+    ret = assoofs_extent_reserve(inode, 1);
+    if (ret)
+        return ret;
+    memmove(&ai->extents[i + 2], &ai->extents[i + 1], (count - i - 1) * sizeof(*ai->extents));
+    ai->extents[i + 1].file_block = iblock;
+    ai->extents[i + 1].len = len;
+    ai->extents[i + 1].start = pblock;
+    ai->info.extents_count++;
+out:
+    assoofs_extent_changed(inode);
+    return 0;
+}
+
+// Quita del mapa los bloques [iblock, iblock + count) y suelta su referencia (los libera si eran solo suyos)
+static int assoofs_extent_remove(struct inode *inode, uint32_t iblock, uint32_t count) {
+    struct assoofs_inode *ai = ASSOOFS_I(inode);
+    uint64_t end = (uint64_t)iblock + count, ext_end, from, to;
+    int i = max(assoofs_extent_search(ai, iblock), 0), ret;
+    struct assoofs_extent *ext;
+
+    while (i < (int)ai->info.extents_count) {
+        ext = &ai->extents[i];
+        ext_end = (uint64_t)ext->file_block + ext->len;
+        if (ext->file_block >= end)
+            break;
+        if (ext_end <= iblock) {
+            i++;
+            continue;
+        }
+        from = max_t(uint64_t, ext->file_block, iblock);
+        to = min_t(uint64_t, ext_end, end);
+        if (from > ext->file_block && to < ext_end) {
+            // El rango cae en medio del extent: la cola pasa a uno nuevo
+            ret = assoofs_extent_reserve(inode, 1);
+            if (ret)
+                return ret;
+            ext = &ai->extents[i];
+            memmove(ext + 2, ext + 1, (ai->info.extents_count - i - 1) * sizeof(*ext));
+            ext[1].file_block = to;
+            ext[1].len = ext_end - to;
+            ext[1].start = ext->start + (to - ext->file_block);
+            ext->len = from - ext->file_block;
+            ai->info.extents_count++;
+            assoofs_sb_free_blocks(inode->i_sb, ext->start + ext->len, to - from);
+            break;
+        }
+        assoofs_sb_free_blocks(inode->i_sb, ext->start + (from - ext->file_block), to - from);
+        if (from == ext->file_block && to == ext_end) {
+            memmove(ext, ext + 1, (ai->info.extents_count - i - 1) * sizeof(*ext));
+            ai->info.extents_count--;
+            continue;
+        }
+        if (from == ext->file_block) {
+            ext->start += to - from;
+            ext->file_block = to;
+        }
+        ext->len -= to - from;
+        i++;
+    }
+    assoofs_extent_changed(inode);
+    return 0;
+}
+
+// Al leer el inodo: los extents que no caben en él vienen de su bloque
+static int assoofs_extent_load(struct super_block *sb, struct assoofs_inode *ai) {
+    unsigned int count = ai->info.extents_count;
+    struct assoofs_extent *ext;
+    struct buffer_head *bh;
+
+    if (count <= ASSOOFS_INLINE_EXTENTS)
+        return 0;
+    if (count > ASSOOFS_MAX_EXTENTS || !ai->info.extent_block)
+        return -EIO;
+    ext = kmalloc_array(ASSOOFS_MAX_EXTENTS, sizeof(*ext), GFP_NOFS);
+    if (!ext)
+        return -ENOMEM;
+    bh = assoofs_bread(sb, ai->info.extent_block);
+    if (!bh) {
+        kfree(ext);
+        return -EIO;
+    }
+    memcpy(ext, ai->info.extents, sizeof(ai->info.extents));
+    memcpy(ext + ASSOOFS_INLINE_EXTENTS, bh->b_data, (count - ASSOOFS_INLINE_EXTENTS) * sizeof(*ext));
+    brelse(bh);
+    ai->extents = ext;
+    return 0;
+}
+
+// Con map_sem cogido para escribir: vuelve a leer el mapa si el shrinker lo soltó
+static int assoofs_extent_ensure(struct inode *inode) {
+    int ret;
+
+    if (ASSOOFS_I(inode)->extents)
+        return 0;
+    // Si ya cabe en el inodo basta con info.extents, que siempre está al día
+    if (ASSOOFS_I(inode)->info.extents_count <= ASSOOFS_INLINE_EXTENTS) {
+        ASSOOFS_I(inode)->extents = ASSOOFS_I(inode)->info.extents;
+        return 0;
+    }
+    ret = assoofs_extent_load(inode->i_sb, ASSOOFS_I(inode));
+    if (!ret)
+        assoofs_cache_add(inode);
+    return ret;
+}
+
+static int assoofs_map_lock(struct inode *inode, bool write) {
+    struct assoofs_inode *ai = ASSOOFS_I(inode);
+    int ret;
+
+    if (write)
+        down_write(&ai->map_sem);
+    else
+        down_read(&ai->map_sem);
+    assoofs_cache_touch(ai);
+    if (likely(ai->extents))
+        return 0;
+    if (!write) {
+        up_read(&ai->map_sem);
+        down_write(&ai->map_sem);
+    }
+    ret = assoofs_extent_ensure(inode);
+    if (ret) {
+        up_write(&ai->map_sem);
+        return ret;
+    }
+    if (!write)
+        downgrade_write(&ai->map_sem);
+    return 0;
+}
+
+// Escribe la parte del mapa que no cabe en el inodo en su bloque
+static int assoofs_extent_write(struct super_block *sb, struct assoofs_inode *ai, bool sync) {
+    unsigned int count = ai->info.extents_count;
+    struct buffer_head *bh;
+
+    // Sin copia en memoria el bloque ya está al día: el shrinker solo suelta mapas limpios
+    if (ai->extents == ai->info.extents || !ai->extents)
+        return 0;
+    bh = sb_getblk(sb, ai->info.extent_block);
+    if (!bh)
+        return -EIO;
+    lock_buffer(bh);
+    memset(bh->b_data, 0, bh->b_size);
+    if (count > ASSOOFS_INLINE_EXTENTS)
+        memcpy(bh->b_data, ai->extents + ASSOOFS_INLINE_EXTENTS, (count - ASSOOFS_INLINE_EXTENTS) * sizeof(*ai->extents));
+    set_buffer_uptodate(bh);
+    unlock_buffer(bh);
+    if (sync)
+        assoofs_sync_bh(sb, bh);
+    else
+        assoofs_dirty_bh(sb, bh);
+    brelse(bh);
+    return 0;
+}
+
+// Fichero borrado: devuelve todos sus tramos y su bloque de extents (copia de disco)
+static void assoofs_extent_free_all(struct super_block *sb, struct assoofs_inode_info *raw) {
+    struct assoofs_extent *ext;
+    struct buffer_head *bh = NULL;
+    unsigned int i;
+
+    // Empaquetado no tiene extents, pero puede conservar el bloque de extents de cuando era grande
+    if (raw->flags & ASSOOFS_INODE_PACKED) {
+        assoofs_pack_free(sb, raw->pack_block, raw->pack_offset, raw->pack_size);
+        raw->extents_count = 0;
+    }
+    if (raw->extents_count > ASSOOFS_MAX_EXTENTS) {
+        printk(KERN_ERR "assoofs: inode %llu has a corrupt extent map, leaking its blocks\n", raw->inode_no);
+        return;
+    }
+    for (i = 0; i < raw->extents_count; i++) {
+        if (i == ASSOOFS_INLINE_EXTENTS) {
+            bh = assoofs_bread(sb, raw->extent_block);
+            if (!bh) {
+                printk(KERN_ERR "assoofs: cannot read extents of inode %llu, leaking its blocks\n", raw->inode_no);
+                break;
+            }
+        }
+        if (i < ASSOOFS_INLINE_EXTENTS)
+            ext = &raw->extents[i];
+        else
+            ext = (struct assoofs_extent *)bh->b_data + (i - ASSOOFS_INLINE_EXTENTS);
+        assoofs_sb_free_blocks(sb, ext->start, ext->len);
+    }
+    brelse(bh);
+    if (raw->extent_block)
+        assoofs_sb_free_block(sb, raw->extent_block);
+}
+
+// Bloques que le quedan desde iblock a la escritura en curso: el primero se coloca donde quepan todos
+static unsigned int assoofs_write_hint(struct assoofs_inode *ai, sector_t iblock) {
+    uint32_t end = READ_ONCE(ai->write_end);
+
+    return end > iblock ? end - iblock + 1 : 1;
+}
+
+/*
+ *  get_block para la caché de páginas: con create reserva lo más cerca posible del tramo
+ *  anterior, así una escritura secuencial acaba en un único extent. La E/S directa pide el
+ *  hueco entero y se le da en una sola reserva de bloques seguidos.
+ */
+static int assoofs_get_block(struct inode *inode, sector_t iblock, struct buffer_head *bh_result, int create) {
+    struct super_block *sb = inode->i_sb;
+    struct assoofs_inode *ai = ASSOOFS_I(inode);
+    unsigned int max = bh_result->b_size >> inode->i_blkbits, n;
+    uint64_t pblock;
+    int ret;
+
+    if (iblock >= U32_MAX)
+        return -EFBIG;
+    if (!max)
+        max = 1;
+    ret = assoofs_map_lock(inode, false);
+    if (ret)
+        return ret;
+    n = assoofs_extent_lookup(ai, iblock, max, &pblock);
+    up_read(&ai->map_sem);
+    if (pblock) {
+        map_bh(bh_result, sb, pblock);
+        bh_result->b_size = (size_t)n << inode->i_blkbits;
+        return 0;
+    }
+    if (!create) {
+        bh_result->b_size = (size_t)n << inode->i_blkbits;
+        return 0;
+    }
+
+    ret = assoofs_map_lock(inode, true);
+    if (ret)
+        return ret;
+    // Un fichero empaquetado que pasa a tener bloques lleva antes sus datos al bloque 0
+    ret = assoofs_pack_unpack(inode);
+    if (ret) {
+        up_write(&ai->map_sem);
+        return ret;
+    }
+    // Otro pudo rellenar el hueco mientras no teníamos el cerrojo
+    n = assoofs_extent_lookup(ai, iblock, max, &pblock);
+    if (!pblock) {
+        ret = assoofs_alloc_blocks(sb, assoofs_extent_goal(inode, iblock), n, assoofs_write_hint(ai, iblock), false, &pblock, &n);
+        if (!ret) {
+            ret = assoofs_extent_insert(inode, iblock, pblock, n);
+            if (ret)
+                assoofs_sb_free_blocks(sb, pblock, n);
+        }
+        if (ret) {
+            up_write(&ai->map_sem);
+            return ret;
+        }
+        set_buffer_new(bh_result);
+    }
+    up_write(&ai->map_sem);
+    map_bh(bh_result, sb, pblock);
+    bh_result->b_size = (size_t)n << inode->i_blkbits;
+    return 0;
+}
+
+/*
+ *  Copia en escritura. Antes de modificar un bloque compartido con otro fichero se pasa
+ *  a uno propio: la página se lee del bloque viejo, su buffer se apunta al nuevo y se
+ *  marca sucia, así la writeback escribe el contenido actual en el bloque nuevo.
+ */
+static int assoofs_unshare_block(struct inode *inode, uint32_t iblock) {
+    struct super_block *sb = inode->i_sb;
+    struct assoofs_inode *ai = ASSOOFS_I(inode);
+    unsigned int per_page = PAGE_SIZE >> inode->i_blkbits, i;
+    struct buffer_head *bh;
+    struct page *page;
+    uint64_t old, new;
+    int ret = 0;
+
+    ret = assoofs_map_lock(inode, false);
+    if (ret)
+        return ret;
+    assoofs_extent_lookup(ai, iblock, 1, &old);
+    up_read(&ai->map_sem);
+    if (!old || !assoofs_block_shared(sb, old))
+        return 0;
+
+    page = read_mapping_page(inode->i_mapping, iblock / per_page, NULL);
+    if (IS_ERR(page))
+        return PTR_ERR(page);
+    lock_page(page);
+    if (!page_has_buffers(page))
+        create_empty_buffers(page, sb->s_blocksize, 0);
+    ret = assoofs_map_lock(inode, true);
+    if (ret) {
+        unlock_page(page);
+        put_page(page);
+        return ret;
+    }
+    assoofs_extent_lookup(ai, iblock, 1, &old);
+    if (!old || !assoofs_block_shared(sb, old))
+        goto out;
+    // Sitio para partir el extent y para el tramo nuevo: después ya no puede fallar
+    ret = assoofs_extent_reserve(inode, 2);
+    if (ret)
+        goto out;
+    ret = assoofs_alloc_data_block(sb, old, &new);
+    if (ret)
+        goto out;
+    assoofs_extent_remove(inode, iblock, 1);
+    assoofs_extent_insert(inode, iblock, new, 1);
+    clean_bdev_aliases(sb->s_bdev, new, 1);
+    bh = page_buffers(page);
+    for (i = 0; i < iblock % per_page; i++)
+        bh = bh->b_this_page;
+    map_bh(bh, sb, new);
+    set_buffer_uptodate(bh);
+    mark_buffer_dirty(bh);
+out:
+    up_write(&ai->map_sem);
+    unlock_page(page);
+    put_page(page);
+    return ret;
+}
+
+static int assoofs_unshare_range(struct inode *inode, loff_t pos, size_t len) {
+    uint32_t iblock, last;
+    int ret;
+
+    if (!(ASSOOFS_I(inode)->info.flags & ASSOOFS_INODE_SHARED) || !len)
+        return 0;
+    last = (pos + len - 1) >> inode->i_blkbits;
+    for (iblock = pos >> inode->i_blkbits; iblock <= last; iblock++) {
+        ret = assoofs_unshare_block(inode, iblock);
+        if (ret)
+            return ret;
+    }
+    return 0;
+}
+
+/*
+ *  E/S directa: iomap traduce desplazamientos del fichero con el mismo mapa de extents
+ */
+static int assoofs_iomap_begin(struct inode *inode, loff_t pos, loff_t length, unsigned flags, struct iomap *iomap, struct iomap *srcmap) {
+    struct assoofs_inode *ai = ASSOOFS_I(inode);
+    unsigned int blkbits = inode->i_blkbits;
+    sector_t iblock = pos >> blkbits;
+    struct buffer_head map = {
+        .b_size = (size_t)min_t(u64, ((pos + length - 1) >> blkbits) - iblock + 1, U32_MAX) << blkbits,
+    };
+    bool packed;
+    int ret;
+
+    // FIEMAP y SEEK_DATA: lo empaquetado es un tramo en línea dentro de su bloque de paquetes
+    if ((flags & IOMAP_REPORT) && !iblock) {
+        down_read(&ai->map_sem);
+        packed = ai->info.flags & ASSOOFS_INODE_PACKED;
+        if (packed) {
+            iomap->bdev = inode->i_sb->s_bdev;
+            iomap->type = IOMAP_INLINE;
+            iomap->offset = 0;
+            iomap->length = i_blocksize(inode);
+            iomap->addr = ((u64)ai->info.pack_block << blkbits) + ai->info.pack_offset;
+        }
+        up_read(&ai->map_sem);
+        if (packed)
+            return 0;
+    }
+    ret = assoofs_get_block(inode, iblock, &map, flags & IOMAP_WRITE);
+    if (ret)
+        return ret;
+    iomap->bdev = inode->i_sb->s_bdev;
+    iomap->offset = (u64)iblock << blkbits;
+    iomap->length = map.b_size;
+    if (buffer_mapped(&map)) {
+        iomap->type = IOMAP_MAPPED;
+        iomap->addr = (u64)map.b_blocknr << blkbits;
+        if (buffer_new(&map))
+            iomap->flags |= IOMAP_F_NEW;
+        // Para FIEMAP basta con mirar el primer bloque del tramo
+        if ((flags & IOMAP_REPORT) && (ai->info.flags & ASSOOFS_INODE_SHARED) && assoofs_block_shared(inode->i_sb, map.b_blocknr))
+            iomap->flags |= IOMAP_F_SHARED;
+    } else {
+        iomap->type = IOMAP_HOLE;
+        iomap->addr = IOMAP_NULL_ADDR;
+    }
+    return 0;
+}
+
+static const struct iomap_ops assoofs_iomap_ops = {
+    .iomap_begin = assoofs_iomap_begin,
+};
+
+// Se ejecuta al terminar cada escritura directa, también las asíncronas (io_uring, libaio)
+static int assoofs_dio_write_end_io(struct kiocb *iocb, ssize_t size, int error, unsigned flags) {
+    struct inode *inode = file_inode(iocb->ki_filp);
+    loff_t end = iocb->ki_pos + size;
+
+    if (error)
+        return error;
+    assoofs_stat_add(inode->i_sb, bytes_written, size);
+    if (end > i_size_read(inode)) {
+        i_size_write(inode, end);
+        mark_inode_dirty(inode);
+    }
+    return 0;
+}
+
+static const struct iomap_dio_ops assoofs_dio_write_ops = {
+    .end_io = assoofs_dio_write_end_io,
+};
+
+static ssize_t assoofs_dio_read(struct kiocb *iocb, struct iov_iter *to) {
+    struct inode *inode = file_inode(iocb->ki_filp);
+    ssize_t ret = 0;
+
+    inode_lock_shared(inode);
+    // Un paquete no es un bloque propio que se pueda leer directamente: tras la writeback se lee por la caché
+    if (!ASSOOFS_I(inode)->info.extents_count)
+        ret = filemap_write_and_wait(inode->i_mapping);
+    if (!ret && (ASSOOFS_I(inode)->info.flags & ASSOOFS_INODE_PACKED)) {
+        iocb->ki_flags &= ~IOCB_DIRECT;
+        ret = generic_file_read_iter(iocb, to);
+    } else if (!ret) {
+        ret = iomap_dio_rw(iocb, to, &assoofs_iomap_ops, NULL, is_sync_kiocb(iocb));
+    }
+    inode_unlock_shared(inode);
+    if (ret > 0)
+        assoofs_stat_add(inode->i_sb, bytes_read, ret);
+    return ret;
+}
+
+static ssize_t assoofs_dio_write(struct kiocb *iocb, struct iov_iter *from) {
+    struct inode *inode = file_inode(iocb->ki_filp);
+    ssize_t ret;
+
+    inode_lock(inode);
+    ret = generic_write_checks(iocb, from);
+    if (ret > 0)
+        ret = assoofs_unshare_range(inode, iocb->ki_pos, iov_iter_count(from));
+    if (!ret)
+        ret = iomap_dio_rw(iocb, from, &assoofs_iomap_ops, &assoofs_dio_write_ops, is_sync_kiocb(iocb));
+    inode_unlock(inode);
+    return ret;
+}
+
+/*
+ *  Ficheros empaquetados en la caché de páginas. Mientras un fichero no tenga extents y
+ *  quepa en ASSOOFS_PACK_MAX, su página 0 no lleva buffers: se lee de su paquete y la
+ *  writeback la copia a él en vez de reservarle un bloque. Al crecer, assoofs_get_block
+ *  lo pasa a un bloque propio.
+ */
+static inline bool assoofs_pack_eligible(struct inode *inode) {
+    return !ASSOOFS_I(inode)->info.extents_count && i_size_read(inode) <= ASSOOFS_PACK_MAX;
+}
+
+// Rellena la página 0 con lo empaquetado o, sin datos en disco, con ceros; 1 si el fichero ya tiene bloques
+static int assoofs_pack_fill(struct inode *inode, struct page *page) {
+    struct assoofs_inode *ai = ASSOOFS_I(inode);
+    struct buffer_head *bh = NULL;
+    unsigned int len = 0;
+    void *kaddr;
+
+    down_read(&ai->map_sem);
+    if (ai->info.flags & ASSOOFS_INODE_PACKED) {
+        bh = assoofs_bread(inode->i_sb, ai->info.pack_block);
+        if (!bh) {
+            up_read(&ai->map_sem);
+            return -EIO;
+        }
+        len = min_t(unsigned int, ai->info.pack_len, ai->info.pack_size);
+    } else if (ai->info.extents_count) {
+        up_read(&ai->map_sem);
+        return 1;
+    }
+    kaddr = kmap_atomic(page);
+    if (len)
+        memcpy(kaddr, bh->b_data + ai->info.pack_offset, len);
+    memset(kaddr + len, 0, PAGE_SIZE - len);
+    kunmap_atomic(kaddr);
+    flush_dcache_page(page);
+    up_read(&ai->map_sem);
+    brelse(bh);
+    return 0;
+}
+
+// Con map_sem para escribir: el fichero deja su paquete sin llevarse los datos a ningún sitio
+static void assoofs_pack_drop(struct inode *inode) {
+    struct assoofs_inode *ai = ASSOOFS_I(inode);
+
+    if (!(ai->info.flags & ASSOOFS_INODE_PACKED))
+        return;
+    assoofs_pack_free(inode->i_sb, ai->info.pack_block, ai->info.pack_offset, ai->info.pack_size);
+    ai->info.flags &= ~ASSOOFS_INODE_PACKED;
+    memset(ai->info.extents, 0, sizeof(ai->info.extents));
+    mark_inode_dirty(inode);
+}
+
+// Con map_sem para escribir: guarda los len primeros bytes de la página en el paquete, que se cambia si no caben
+static int assoofs_pack_store(struct inode *inode, struct page *page, unsigned int len) {
+    struct super_block *sb = inode->i_sb;
+    struct assoofs_inode *ai = ASSOOFS_I(inode);
+    unsigned int size = round_up(len, ASSOOFS_PACK_SLOT), offset;
+    bool moved = false;
+    struct buffer_head *bh;
+    uint64_t block;
+    void *kaddr;
+    int ret;
+
+    if (!len) {
+        assoofs_pack_drop(inode);
+        return 0;
+    }
+    if ((ai->info.flags & ASSOOFS_INODE_PACKED) && ai->info.pack_size >= size) {
+        block = ai->info.pack_block;
+        offset = ai->info.pack_offset;
+        size = ai->info.pack_size;
+    } else {
+        ret = assoofs_pack_alloc(sb, assoofs_extent_goal(inode, 0), size, &block, &offset);
+        if (ret)
+            return ret;
+        moved = true;
+    }
+    bh = assoofs_bread(sb, block);
+    if (!bh) {
+        if (moved)
+            assoofs_pack_free(sb, block, offset, size);
+        return -EIO;
+    }
+    lock_buffer(bh);
+    kaddr = kmap_atomic(page);
+    memcpy(bh->b_data + offset, kaddr, len);
+    kunmap_atomic(kaddr);
+    memset(bh->b_data + offset + len, 0, size - len);
+    unlock_buffer(bh);
+    assoofs_dirty_bh(sb, bh);
+    brelse(bh);
+    if (moved) {
+        assoofs_pack_drop(inode);
+        // Sin extents no hace falta un mapa propio: la unión del inodo pasa a guardar el paquete
+        if (ai->extents != ai->info.extents) {
+            kfree(ai->extents);
+            ai->extents = ai->info.extents;
+            assoofs_cache_del(inode);
+        }
+        memset(ai->info.extents, 0, sizeof(ai->info.extents));
+        ai->info.flags |= ASSOOFS_INODE_PACKED;
+        ai->info.pack_block = block;
+        ai->info.pack_offset = offset;
+        ai->info.pack_size = size;
+    }
+    ai->info.pack_len = len;
+    assoofs_stat_inc(sb, pack_stores);
+    mark_inode_dirty(inode);
+    return 0;
+}
+
+/*
+ *  Caché de páginas
+ */
+static int assoofs_readpage(struct file *file, struct page *page) {
+    struct inode *inode = page->mapping->host;
+    int ret;
+
+    if (page->index || !(ASSOOFS_I(inode)->info.flags & ASSOOFS_INODE_PACKED))
+        return mpage_readpage(page, assoofs_get_block);
+    ret = assoofs_pack_fill(inode, page);
+    // Se pasó a bloques mientras tanto
+    if (ret > 0)
+        return mpage_readpage(page, assoofs_get_block);
+    if (ret)
+        SetPageError(page);
+    else
+        SetPageUptodate(page);
+    unlock_page(page);
+    return ret;
+}
+
+// Lo empaquetado se deja a assoofs_readpage: las páginas sin leer vuelven a pedirse una a una
+static void assoofs_readahead(struct readahead_control *rac) {
+    if (ASSOOFS_I(rac->mapping->host)->info.flags & ASSOOFS_INODE_PACKED)
+        return;
+    mpage_readahead(rac, assoofs_get_block);
+}
+
+// Como block_write_full_page pero sin bloque: la página se copia al paquete y queda limpia
+static int assoofs_pack_writepage(struct page *page, struct writeback_control *wbc) {
+    struct inode *inode = page->mapping->host;
+    struct assoofs_inode *ai = ASSOOFS_I(inode);
+    int ret;
+
+    down_write(&ai->map_sem);
+    if (!assoofs_pack_eligible(inode)) {
+        up_write(&ai->map_sem);
+        return block_write_full_page(page, assoofs_get_block, wbc);
+    }
+    ret = assoofs_pack_store(inode, page, i_size_read(inode));
+    up_write(&ai->map_sem);
+    if (ret) {
+        mapping_set_error(page->mapping, ret);
+        unlock_page(page);
+        return ret;
+    }
+    set_page_writeback(page);
+    unlock_page(page);
+    end_page_writeback(page);
+    return 0;
+}
+
+static int assoofs_writepage(struct page *page, struct writeback_control *wbc) {
+    if (!page->index && !page_has_buffers(page) && assoofs_pack_eligible(page->mapping->host))
+        return assoofs_pack_writepage(page, wbc);
+    return block_write_full_page(page, assoofs_get_block, wbc);
+}
+
+/*
+ *  Writeback en lote: mpage_writepages recorre las páginas sucias en orden y va juntando
+ *  en una misma bio las que caen en bloques contiguos del dispositivo, todo bajo un
+ *  blk_plug para que la cola fusione lo que aún quede suelto.
+ */
+static int assoofs_writepages(struct address_space *mapping, struct writeback_control *wbc) {
+    long nr_to_write = wbc->nr_to_write;
+    int ret;
+
+    // Un fichero que cabe en un paquete no tiene bloques que juntar: su página va por assoofs_writepage
+    if (assoofs_pack_eligible(mapping->host))
+        ret = generic_writepages(mapping, wbc);
+    else
+        ret = mpage_writepages(mapping, wbc, assoofs_get_block);
+    assoofs_stat_add(mapping->host->i_sb, writeback_pages, nr_to_write - wbc->nr_to_write);
+    return ret;
+}
+
+// Suelta los bloques que quedan enteros por detrás de size
+static int assoofs_truncate_blocks(struct inode *inode, loff_t size) {
+    struct assoofs_inode *ai = ASSOOFS_I(inode);
+    uint32_t first = DIV_ROUND_UP(size, inode->i_sb->s_blocksize);
+    int ret;
+
+    ret = assoofs_map_lock(inode, true);
+    if (ret)
+        return ret;
+    // Lo empaquetado se acorta sin moverse; un fichero vacío no ocupa sitio
+    if (!size)
+        assoofs_pack_drop(inode);
+    else if ((ai->info.flags & ASSOOFS_INODE_PACKED) && size < ai->info.pack_len)
+        ai->info.pack_len = size;
+    ret = assoofs_extent_remove(inode, first, U32_MAX - first);
+    up_write(&ai->map_sem);
+    return ret;
+}
+
+// Los bloques que llegaran a reservarse más allá del final se devuelven
+static void assoofs_write_failed(struct address_space *mapping, loff_t to) {
+    struct inode *inode = mapping->host;
+
+    if (to > inode->i_size) {
+        truncate_pagecache(inode, inode->i_size);
+        assoofs_truncate_blocks(inode, inode->i_size);
+    }
+}
+
+static int assoofs_write_begin(struct file *file, struct address_space *mapping, loff_t pos, unsigned len, unsigned flags, struct page **pagep, void **fsdata) {
+    struct page *page;
+    int ret;
+
+    // Lo que cabe en un paquete no reserva bloque: la página 0 se prepara sin buffers
+    if (pos + len <= ASSOOFS_PACK_MAX && !ASSOOFS_I(mapping->host)->info.extents_count) {
+        page = grab_cache_page_write_begin(mapping, 0, flags);
+        if (!page)
+            return -ENOMEM;
+        if (!page_has_buffers(page)) {
+            ret = PageUptodate(page) ? 0 : assoofs_pack_fill(mapping->host, page);
+            if (ret < 0) {
+                unlock_page(page);
+                put_page(page);
+                return ret;
+            }
+            SetPageUptodate(page);
+            *pagep = page;
+            return 0;
+        }
+        unlock_page(page);
+        put_page(page);
+    }
+    ret = block_write_begin(mapping, pos, len, flags, pagep, assoofs_get_block);
+    if (ret < 0)
+        assoofs_write_failed(mapping, pos + len);
+    return ret;
+}
+
+static int assoofs_write_end(struct file *file, struct address_space *mapping, loff_t pos, unsigned len, unsigned copied, struct page *page, void *fsdata) {
+    struct inode *inode = mapping->host;
+    loff_t old_size = inode->i_size;
+    int ret;
+
+    // Página preparada para un paquete: block_write_begin siempre deja buffers
+    if (!page_has_buffers(page)) {
+        ret = simple_write_end(file, mapping, pos, len, copied, page, fsdata);
+        if (inode->i_size != old_size)
+            mark_inode_dirty(inode);
+        return ret;
+    }
+    ret = generic_write_end(file, mapping, pos, len, copied, page, fsdata);
+    if (ret < len)
+        assoofs_write_failed(mapping, pos + len);
+    return ret;
+}
+
+static sector_t assoofs_bmap(struct address_space *mapping, sector_t block) {
+    return generic_block_bmap(mapping, block, assoofs_get_block);
+}
+
+// direct_IO solo hace falta para que el kernel deje abrir con O_DIRECT: la E/S directa va por iomap
+static const struct address_space_operations assoofs_aops = {
+    .readpage = assoofs_readpage,
+    .readahead = assoofs_readahead,
+    .writepage = assoofs_writepage,
+    .writepages = assoofs_writepages,
+    .write_begin = assoofs_write_begin,
+    .write_end = assoofs_write_end,
+    .bmap = assoofs_bmap,
+    .direct_IO = noop_direct_IO,
+};
+
+static ssize_t assoofs_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+    printk(KERN_INFO "Read request\n");
+    struct inode *inode = file_inode(iocb->ki_filp);
+    ssize_t ret;
+
+    if (iocb->ki_flags & IOCB_DIRECT)
+        return assoofs_dio_read(iocb, to);
+
+    ret = generic_file_read_iter(iocb, to);
+    if (ret > 0)
+        assoofs_stat_add(inode->i_sb, bytes_read, ret);
+    return ret;
+}
+
+static ssize_t assoofs_write_iter(struct kiocb *iocb, struct iov_iter *from) {
+    printk(KERN_INFO "Write request\n");
+    struct inode *inode = file_inode(iocb->ki_filp);
+    ssize_t ret;
+
+    if (iocb->ki_flags & IOCB_DIRECT)
+        return assoofs_dio_write(iocb, from);
+
+    // Solo copia a la caché de páginas; los bloques llegan al disco con assoofs_writepages
+    inode_lock(inode);
+    ret = generic_write_checks(iocb, from);
+    if (ret > 0)
+        ret = assoofs_unshare_range(inode, iocb->ki_pos, iov_iter_count(from));
+    if (!ret) {
+        WRITE_ONCE(ASSOOFS_I(inode)->write_end, (iocb->ki_pos + iov_iter_count(from) - 1) >> inode->i_blkbits);
+        ret = __generic_file_write_iter(iocb, from);
+        WRITE_ONCE(ASSOOFS_I(inode)->write_end, 0);
+    }
+    inode_unlock(inode);
+    if (ret > 0) {
+        assoofs_stat_add(inode->i_sb, bytes_written, ret);
+        ret = generic_write_sync(iocb, ret);
+    }
+    return ret;
+}
+
+/*
+ *  Ficheros dispersos: lo que no está en el mapa de extents es un hueco. Se lee como
+ *  ceros sin E/S (mpage rellena la página), y SEEK_HOLE/SEEK_DATA y FIEMAP lo saltan.
+ */
+static loff_t assoofs_llseek(struct file *file, loff_t offset, int whence) {
+    struct inode *inode = file_inode(file);
+    int ret;
+
+    // Una página que espera su paquete aún no tiene tramo que informar: se vuelca antes
+    if ((whence == SEEK_HOLE || whence == SEEK_DATA) && !ASSOOFS_I(inode)->info.extents_count) {
+        ret = filemap_write_and_wait_range(inode->i_mapping, 0, PAGE_SIZE - 1);
+        if (ret)
+            return ret;
+    }
+    switch (whence) {
+    case SEEK_HOLE:
+        inode_lock_shared(inode);
+        offset = iomap_seek_hole(inode, offset, &assoofs_iomap_ops);
+        inode_unlock_shared(inode);
+        break;
+    case SEEK_DATA:
+        inode_lock_shared(inode);
+        offset = iomap_seek_data(inode, offset, &assoofs_iomap_ops);
+        inode_unlock_shared(inode);
+        break;
+    default:
+        return generic_file_llseek(file, offset, whence);
+    }
+    if (offset < 0)
+        return offset;
+    return vfs_setpos(file, offset, inode->i_sb->s_maxbytes);
+}
+
+static int assoofs_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo, u64 start, u64 len) {
+    int ret;
+
+    inode_lock_shared(inode);
+    ret = iomap_fiemap(inode, fieinfo, start, len, &assoofs_iomap_ops);
+    inode_unlock_shared(inode);
+    return ret;
+}
+
+// Al encoger se sueltan los bloques de detrás; al crecer solo cambia i_size y el resto queda como hueco
+static int assoofs_truncate(struct inode *inode, loff_t size) {
+    int ret;
+
+    inode_dio_wait(inode);
+    // El trozo del último bloque que queda fuera se pone a cero, en una copia propia si estaba compartido.
+    // Sin extents no hay bloque: truncate_setsize basta para la página y el paquete se acorta después
+    if ((size & (inode->i_sb->s_blocksize - 1)) && ASSOOFS_I(inode)->info.extents_count) {
+        ret = assoofs_unshare_range(inode, size, 1);
+        if (!ret)
+            ret = block_truncate_page(inode->i_mapping, size, assoofs_get_block);
+        if (ret)
+            return ret;
+    }
+    truncate_setsize(inode, size);
+    ret = assoofs_truncate_blocks(inode, size);
+    inode->i_mtime = inode->i_ctime = current_time(inode);
+    mark_inode_dirty(inode);
+    return ret;
+}
+
+static int assoofs_setattr(struct dentry *dentry, struct iattr *attr) {
+    struct inode *inode = d_inode(dentry);
+    int ret;
+
+    ret = setattr_prepare(dentry, attr);
+    if (ret)
+        return ret;
+    if ((attr->ia_valid & ATTR_SIZE) && attr->ia_size != i_size_read(inode)) {
+        ret = assoofs_truncate(inode, attr->ia_size);
+        if (ret)
+            return ret;
+    }
+    setattr_copy(inode, attr);
+    mark_inode_dirty(inode);
+    return 0;
+}
+
+/*
+ *  Reflink (FICLONE, FICLONERANGE, FIDEDUPERANGE): el destino pasa a apuntar a los mismos
+ *  bloques que el origen y cada bloque gana una referencia. Solo se tocan metadatos. Se va
+ *  tramo a tramo del origen y cada tramo del destino solo se suelta cuando ya hay sitio en su
+ *  mapa y la referencia de más está puesta: si algo falla, lo que queda sin compartir sigue
+ *  como estaba y, con REMAP_FILE_CAN_SHORTEN, se devuelve lo hecho.
+ */
+static loff_t assoofs_remap_file_range(struct file *file_in, loff_t pos_in, struct file *file_out, loff_t pos_out, loff_t len, unsigned int remap_flags) {
+    struct inode *src = file_inode(file_in), *dst = file_inode(file_out);
+    struct assoofs_inode *sai = ASSOOFS_I(src), *dai = ASSOOFS_I(dst);
+    struct super_block *sb = src->i_sb;
+    uint32_t sblk, dblk, nblocks, i, n;
+    bool shared = false;
+    uint64_t pblock;
+    loff_t ret, done;
+
+    if (remap_flags & ~(REMAP_FILE_DEDUP | REMAP_FILE_CAN_SHORTEN | REMAP_FILE_ADVISORY))
+        return -EINVAL;
+    lock_two_nondirectories(src, dst);
+    // Comprueba alineación y límites, vuelca las páginas sucias de ambos rangos y, en dedupe, compara el contenido
+    ret = generic_remap_file_range_prep(file_in, pos_in, file_out, pos_out, &len, remap_flags);
+    if (ret < 0 || len == 0)
+        goto out;
+    sblk = pos_in >> sb->s_blocksize_bits;
+    dblk = pos_out >> sb->s_blocksize_bits;
+    nblocks = DIV_ROUND_UP(len, sb->s_blocksize);
+    truncate_inode_pages_range(&dst->i_data, pos_out, round_up(pos_out + len, PAGE_SIZE) - 1);
+
+    ret = assoofs_map_lock(dst, true);
+    if (ret)
+        goto out;
+    // El origen se bloquea también para escribir: así se puede volver a leer su mapa si no está
+    if (src != dst) {
+        down_write_nested(&sai->map_sem, SINGLE_DEPTH_NESTING);
+        ret = assoofs_extent_ensure(src);
+        if (ret) {
+            up_write(&sai->map_sem);
+            up_write(&dai->map_sem);
+            goto out;
+        }
+    }
+    // Se comparten bloques enteros: lo empaquetado pasa antes a un bloque propio
+    ret = assoofs_pack_unpack(dst);
+    if (!ret && src != dst)
+        ret = assoofs_pack_unpack(src);
+    if (ret) {
+        if (src != dst)
+            up_write(&sai->map_sem);
+        up_write(&dai->map_sem);
+        goto out;
+    }
+    for (i = 0; i < nblocks; i += n) {
+        n = assoofs_extent_lookup(sai, sblk + i, nblocks - i, &pblock);
+        // Quitar el tramo puede partir un extent e insertarlo añadir otro: con sitio para dos ya no falla
+        ret = assoofs_extent_reserve(dst, 2);
+        if (!ret && pblock)
+            ret = assoofs_blocks_get(sb, pblock, n);
+        if (ret)
+            break;
+        ret = assoofs_extent_remove(dst, dblk + i, n);
+        if (!ret && pblock)
+            ret = assoofs_extent_insert(dst, dblk + i, pblock, n);   // un hueco en el origen deja un hueco
+        if (ret) {
+            if (pblock)
+                assoofs_sb_free_blocks(sb, pblock, n);
+            break;
+        }
+        if (pblock)
+            shared = true;
+    }
+    // Si algo llegó a compartirse, las escrituras de los dos ficheros tendrán que copiarlo
+    if (shared) {
+        sai->info.flags |= ASSOOFS_INODE_SHARED;
+        dai->info.flags |= ASSOOFS_INODE_SHARED;
+    }
+    if (src != dst)
+        up_write(&sai->map_sem);
+    up_write(&dai->map_sem);
+    if (shared)
+        assoofs_save_inode_info(sb, &sai->info);
+    done = min_t(loff_t, len, (loff_t)i << sb->s_blocksize_bits);
+    if (done && !(remap_flags & REMAP_FILE_DEDUP) && pos_out + done > i_size_read(dst))
+        i_size_write(dst, pos_out + done);
+    mark_inode_dirty(dst);
+    if (!ret || (done && (remap_flags & REMAP_FILE_CAN_SHORTEN)))
+        ret = done;
+out:
+    unlock_two_nondirectories(src, dst);
+    return ret;
+}
+
+/*
+ *  copy_file_range: la parte alineada a bloque se comparte con reflink y solo el principio
+ *  y el final desalineados se copian dentro del kernel. Sin alineación posible, todo se copia.
+ */
+static ssize_t assoofs_copy_file_range(struct file *file_in, loff_t pos_in, struct file *file_out, loff_t pos_out, size_t len, unsigned int flags) {
+    loff_t bs = ASSOOFS_DEFAULT_BLOCK_SIZE, cloned;
+    size_t done = 0, head, body;
+    ssize_t ret;
+
+    if (file_inode(file_in)->i_sb == file_inode(file_out)->i_sb && (pos_in & (bs - 1)) == (pos_out & (bs - 1))) {
+        head = min_t(size_t, len, (bs - (pos_in & (bs - 1))) & (bs - 1));
+        if (head) {
+            ret = generic_copy_file_range(file_in, pos_in, file_out, pos_out, head, flags);
+            if (ret <= 0 || ret < head)
+                return ret;
+            done = ret;
+        }
+        body = (len - done) & ~(bs - 1);
+        if (body) {
+            cloned = assoofs_remap_file_range(file_in, pos_in + done, file_out, pos_out + done, body, REMAP_FILE_CAN_SHORTEN);
+            if (cloned > 0)
+                done += cloned;
+        }
+    }
+    if (done < len) {
+        ret = generic_copy_file_range(file_in, pos_in + done, file_out, pos_out + done, len - done, flags);
+        if (ret < 0)
+            return done ? done : ret;
+        done += ret;
+    }
+    return done;
+}
+
+/*
+ *  Desfragmentación en línea (ASSOOFS_IOC_DEFRAG). Con el inodo bloqueado ninguna página
+ *  puede ensuciarse (no hay mmap), así que tras volcarlas el disco y la caché coinciden.
+ *  Los bloques se copian a tramos libres contiguos mientras los lectores siguen con el mapa
+ *  viejo; después el mapa nuevo sustituye al viejo de una vez bajo map_sem y llega al disco
+ *  antes de soltar los bloques viejos.
+ */
+#define ASSOOFS_DEFRAG_WINDOW 256   /* bloques leídos por adelantado y mandados a escribir de cada vez */
+
+// Copia count bloques de from a to por la caché del dispositivo; la escritura queda en marcha
+static int assoofs_defrag_copy(struct super_block *sb, uint64_t from, uint64_t to, unsigned int count) {
+    struct address_space *bdev_mapping = sb->s_bdev->bd_inode->i_mapping;
+    unsigned int bits = sb->s_blocksize_bits, i, j, end;
+    struct buffer_head *src, *dst;
+    struct blk_plug plug;
+
+    for (i = 0; i < count; i = end) {
+        end = min(count, i + ASSOOFS_DEFRAG_WINDOW);
+        blk_start_plug(&plug);
+        for (j = i; j < end; j++)
+            assoofs_breadahead(sb, from + j);
+        blk_finish_plug(&plug);
+        for (j = i; j < end; j++) {
+            src = assoofs_bread(sb, from + j);
+            dst = sb_getblk(sb, to + j);
+            if (!src || !dst) {
+                brelse(src);
+                brelse(dst);
+                return -EIO;
+            }
+            lock_buffer(dst);
+            memcpy(dst->b_data, src->b_data, sb->s_blocksize);
+            set_buffer_uptodate(dst);
+            unlock_buffer(dst);
+            mark_buffer_dirty(dst);
+            brelse(src);
+            brelse(dst);
+        }
+        // Esta tanda se escribe mientras se lee la siguiente
+        filemap_fdatawrite_range(bdev_mapping, (loff_t)(to + i) << bits, ((loff_t)(to + end) << bits) - 1);
+    }
+    return 0;
+}
+
+// Son bloques de datos: con wait se espera a que estén en disco, y no deben quedar copias suyas en la caché del dispositivo
+static int assoofs_defrag_settle(struct super_block *sb, uint64_t block, unsigned int count, bool wait) {
+    struct address_space *bdev_mapping = sb->s_bdev->bd_inode->i_mapping;
+    loff_t start = (loff_t)block << sb->s_blocksize_bits;
+    loff_t end = ((loff_t)(block + count) << sb->s_blocksize_bits) - 1;
+    int ret = 0;
+
+    if (wait)
+        ret = filemap_write_and_wait_range(bdev_mapping, start, end);
+    invalidate_mapping_pages(bdev_mapping, start >> PAGE_SHIFT, end >> PAGE_SHIFT);
+    return ret;
+}
+
+/*
+ *  Reparte los bloques de old, en orden, por los tramos runs. Con new construye el mapa
+ *  resultante fusionando lo que quede contiguo; sin él copia los datos.
+ */
+static int assoofs_defrag_walk(struct super_block *sb, const struct assoofs_extent *old, unsigned int old_count, const struct assoofs_extent *runs, struct assoofs_extent *new, unsigned int *new_count) {
+    unsigned int i, r = 0, used = 0, off, n;
+    struct assoofs_extent *last;
+    int ret;
+
+    for (i = 0; i < old_count; i++) {
+        for (off = 0; off < old[i].len; off += n) {
+            n = min(old[i].len - off, runs[r].len - used);
+            if (new) {
+                last = *new_count ? &new[*new_count - 1] : NULL;
+                if (last && last->file_block + last->len == old[i].file_block + off && last->start + last->len == runs[r].start + used) {
+                    last->len += n;
+                } else {
+                    new[*new_count].file_block = old[i].file_block + off;
+                    new[*new_count].len = n;
+                    new[*new_count].start = runs[r].start + used;
+                    (*new_count)++;
+                }
+            } else {
+                ret = assoofs_defrag_copy(sb, old[i].start + off, runs[r].start + used, n);
+                if (ret)
+                    return ret;
+            }
+            used += n;
+            if (used == runs[r].len) {
+                r++;
+                used = 0;
+            }
+        }
+    }
+    return 0;
+}
+
+static long assoofs_ioc_defrag(struct file *file, struct assoofs_defrag_info __user *arg) {
+    struct inode *inode = file_inode(file);
+    struct super_block *sb = inode->i_sb;
+    struct assoofs_inode *ai = ASSOOFS_I(inode);
+    struct assoofs_extent *old = NULL, *runs = NULL, *new = NULL;
+    struct assoofs_defrag_info info = {};
+    unsigned int old_count, new_count = 0, nruns = 0, want, n, i, j;
+    uint64_t total = 0, done, goal, old_extent_block = 0;
+    int ret, err;
+
+    if (!S_ISREG(inode->i_mode))
+        return -EINVAL;
+    if (!(file->f_mode & FMODE_WRITE))
+        return -EBADF;
+    ret = mnt_want_write_file(file);
+    if (ret)
+        return ret;
+    inode_lock(inode);
+    inode_dio_wait(inode);
+    ret = filemap_write_and_wait(inode->i_mapping);
+    if (ret)
+        goto out;
+    ret = assoofs_map_lock(inode, false);
+    if (ret)
+        goto out;
+    old_count = info.extents_before = info.extents_after = ai->info.extents_count;
+    if (old_count > 1)
+        old = kmemdup(ai->extents, old_count * sizeof(*old), GFP_NOFS);
+    up_read(&ai->map_sem);
+    if (old_count <= 1)
+        goto out;
+    runs = kmalloc_array(old_count, sizeof(*runs), GFP_NOFS);
+    new = kmalloc_array(2 * old_count, sizeof(*new), GFP_NOFS);
+    if (!old || !runs || !new) {
+        ret = -ENOMEM;
+        goto out;
+    }
+    // Mover un bloque compartido lo duplicaría: los clones se dejan como están
+    for (i = 0; i < old_count; i++) {
+        total += old[i].len;
+        for (j = 0; (ai->info.flags & ASSOOFS_INODE_SHARED) && j < old[i].len; j++) {
+            if (assoofs_block_shared(sb, old[i].start + j)) {
+                ret = -EOPNOTSUPP;
+                goto out;
+            }
+        }
+    }
+
+    // El tramo libre más ajustado en el que quepa lo que falta o, si no cabe, el más largo
+    goal = assoofs_group_first_block(sb, assoofs_ino_group(sb, inode->i_ino));
+    for (done = 0; done < total; done += n) {
+        // Con tantos tramos como extents ya no se gana nada
+        if (nruns + 1 >= old_count)
+            goto free_runs;
+        want = min_t(uint64_t, total - done, ASSOOFS_SB(sb)->blocks_per_group);
+        ret = assoofs_alloc_blocks(sb, goal, want, want, true, &goal, &n);
+        if (ret)
+            goto free_runs;
+        runs[nruns].file_block = 0;
+        runs[nruns].len = n;
+        runs[nruns].start = goal;
+        nruns++;
+        goal += n;
+    }
+    assoofs_defrag_walk(sb, old, old_count, runs, new, &new_count);
+    // Un fichero disperso no baja de un extent por tramo con datos
+    if (new_count >= old_count)
+        goto free_runs;
+    ret = assoofs_defrag_walk(sb, old, old_count, runs, NULL, NULL);
+    for (i = 0; i < nruns; i++) {
+        err = assoofs_defrag_settle(sb, runs[i].start, runs[i].len, true);
+        if (!ret)
+            ret = err;
+    }
+    for (i = 0; i < old_count; i++)
+        assoofs_defrag_settle(sb, old[i].start, old[i].len, false);
+    if (ret)
+        goto free_runs;
+
+    // A partir de aquí los lectores que vayan al disco leen ya los bloques nuevos
+    ret = assoofs_map_lock(inode, true);
+    if (ret)
+        goto free_runs;
+    if (new_count <= ASSOOFS_INLINE_EXTENTS && ai->extents != ai->info.extents) {
+        kfree(ai->extents);
+        ai->extents = ai->info.extents;
+        old_extent_block = ai->info.extent_block;
+        ai->info.extent_block = 0;
+        assoofs_cache_del(inode);
+    }
+    memcpy(ai->extents, new, new_count * sizeof(*new));
+    ai->info.extents_count = new_count;
+    assoofs_extent_changed(inode);
+    ai->info.file_size = i_size_read(inode);
+    ret = assoofs_extent_write(sb, ai, true);
+    if (!ret)
+        ret = assoofs_write_inode_info(sb, &ai->info, true);
+    up_write(&ai->map_sem);
+    if (ret) {
+        // Sin saber qué mapa quedó en disco, los bloques viejos no se pueden soltar
+        printk(KERN_ERR "assoofs: cannot write the new map of inode %lu, leaking its old blocks\n", inode->i_ino);
+        goto out;
+    }
+    // Las páginas en caché pueden tener buffers apuntando a los bloques viejos; están limpias y se releen
+    truncate_inode_pages(inode->i_mapping, 0);
+    for (i = 0; i < old_count; i++)
+        assoofs_sb_free_blocks(sb, old[i].start, old[i].len);
+    if (old_extent_block)
+        assoofs_sb_free_block(sb, old_extent_block);
+    info.extents_after = new_count;
+    info.blocks_moved = total;
+    assoofs_stat_add(sb, defrag_blocks, total);
+    goto out;
+
+free_runs:
+    for (i = 0; i < nruns; i++)
+        assoofs_sb_free_blocks(sb, runs[i].start, runs[i].len);
+out:
+    inode_unlock(inode);
+    mnt_drop_write_file(file);
+    kfree(old);
+    kfree(runs);
+    kfree(new);
+    if (!ret && copy_to_user(arg, &info, sizeof(info)))
+        ret = -EFAULT;
+    return ret;
+}
+
+static long assoofs_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
+    switch (cmd) {
+    case ASSOOFS_IOC_DEFRAG:
+        return assoofs_ioc_defrag(file, (struct assoofs_defrag_info __user *)arg);
+    case FITRIM:
+        return assoofs_ioc_trim(file, (struct fstrim_range __user *)arg);
+    default:
+        return -ENOTTY;
+    }
+}
+
+/*
+ *  Índice de nombres en memoria por directorio: tabla hash más un filtro de Bloom.
+ *  Se construye la primera vez que se lee el directorio y cuelga de su inodo.
+ */
+#define ASSOOFS_DIR_HASH_BITS 4
+#define ASSOOFS_BLOOM_BITS 512
+
+struct assoofs_dir_name {
+    struct hlist_node node;
+    u32 hash;
+    uint64_t inode_no;
+    unsigned int len;
+    char name[];
+};
+
+struct assoofs_dir_index {
+    DECLARE_BITMAP(bloom, ASSOOFS_BLOOM_BITS);
+    struct hlist_head buckets[1 << ASSOOFS_DIR_HASH_BITS];
+};
+
+static inline u32 assoofs_name_hash(const char *name, unsigned int len) {
+    return full_name_hash(NULL, name, len);
+}
+
+// Dos posiciones del filtro sacadas del mismo hash
+static inline void assoofs_bloom_set(struct assoofs_dir_index *idx, u32 hash) {
+    __set_bit(hash % ASSOOFS_BLOOM_BITS, idx->bloom);
+    __set_bit((hash >> 16) % ASSOOFS_BLOOM_BITS, idx->bloom);
+}
+
+static inline bool assoofs_bloom_test(struct assoofs_dir_index *idx, u32 hash) {
+    return test_bit(hash % ASSOOFS_BLOOM_BITS, idx->bloom) &&
+           test_bit((hash >> 16) % ASSOOFS_BLOOM_BITS, idx->bloom);
+}
+
+static int assoofs_dir_index_insert(struct assoofs_dir_index *idx, const char *name, unsigned int len, uint64_t ino) {
+    struct assoofs_dir_name *dn;
+
+    dn = kmalloc(sizeof(*dn) + len + 1, GFP_NOFS);
+    if (!dn)
+        return -ENOMEM;
+    dn->hash = assoofs_name_hash(name, len);
+    dn->inode_no = ino;
+    dn->len = len;
+    memcpy(dn->name, name, len);
+    dn->name[len] = '\0';
+    hlist_add_head(&dn->node, &idx->buckets[hash_32(dn->hash, ASSOOFS_DIR_HASH_BITS)]);
+    assoofs_bloom_set(idx, dn->hash);
+    return 0;
+}
+
+static struct assoofs_dir_name *assoofs_dir_index_find(struct assoofs_dir_index *idx, const char *name, unsigned int len, u32 hash) {
+    struct assoofs_dir_name *dn;
+
+    hlist_for_each_entry(dn, &idx->buckets[hash_32(hash, ASSOOFS_DIR_HASH_BITS)], node)
+        if (dn->hash == hash && dn->len == len && !memcmp(dn->name, name, len))
+            return dn;
+    return NULL;
+}
+
+static void assoofs_dir_index_free(struct assoofs_dir_index *idx) {
+    struct assoofs_dir_name *dn;
+    struct hlist_node *tmp;
+    int i;
+
+    if (!idx)
+        return;
+    for (i = 0; i < (1 << ASSOOFS_DIR_HASH_BITS); i++)
+        hlist_for_each_entry_safe(dn, tmp, &idx->buckets[i], node)
+            kfree(dn);
+    kfree(idx);
+}
+
+// Construye el índice a partir del bloque del directorio ya leído
+static struct assoofs_dir_index *assoofs_dir_index_build(struct inode *dir, struct assoofs_dir_record_entry *record) {
+    struct assoofs_inode *ai = ASSOOFS_I(dir);
+    struct assoofs_dir_index *idx, *old;
+    uint64_t i;
+
+    idx = kzalloc(sizeof(*idx), GFP_NOFS);
+    if (!idx)
+        return NULL;
+    for (i = 0; i < ai->info.dir_children_count; i++, record++) {
+        if (assoofs_dir_index_insert(idx, record->filename, strnlen(record->filename, ASSOOFS_FILENAME_MAXLEN), record->inode_no)) {
+            assoofs_dir_index_free(idx);
+            return NULL;
+        }
+    }
+    // Las búsquedas van en paralelo con el directorio bloqueado en modo compartido: gana el primero
+    old = cmpxchg(&ai->dir_index, NULL, idx);
+    if (old) {
+        assoofs_dir_index_free(idx);
+        return old;
+    }
+    assoofs_cache_add(dir);
+    return idx;
+}
+
+static struct assoofs_dir_index *assoofs_dir_index_get(struct inode *dir) {
+    struct assoofs_inode *ai = ASSOOFS_I(dir);
+    struct assoofs_dir_index *idx = READ_ONCE(ai->dir_index);
+    struct buffer_head *bh;
+
+    if (idx) {
+        assoofs_cache_touch(ai);
+        return idx;
+    }
+    bh = assoofs_bread(dir->i_sb, ai->info.data_block_number);
+    if (!bh)
+        return ERR_PTR(-EIO);
+    idx = assoofs_dir_index_build(dir, (struct assoofs_dir_record_entry *)bh->b_data);
+    brelse(bh);
+    return idx ? idx : ERR_PTR(-ENOMEM);
+}
+
+// Si no hay memoria para mantenerlo al día se descarta y se reconstruye en la siguiente lectura
+static void assoofs_dir_index_drop(struct inode *dir) {
+    struct assoofs_inode *ai = ASSOOFS_I(dir);
+
+    assoofs_dir_index_free(xchg(&ai->dir_index, NULL));
+    assoofs_cache_del(dir);
+}
+
+/*
+ *  Operaciones sobre directorios
+ */
+static int assoofs_iterate(struct file *filp, struct dir_context *ctx);
+const struct file_operations assoofs_dir_operations = {
+    .owner = THIS_MODULE,
+    .iterate = assoofs_iterate,
+    .fsync = assoofs_fsync,
+    .unlocked_ioctl = assoofs_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
+};
+
+// Un ls -l o un stat tras el listado pedirá los inodos de los hijos: se adelanta su lectura
+static void assoofs_readahead_children(struct super_block *sb, struct assoofs_dir_record_entry *record, uint64_t count) {
+    struct blk_plug plug;
+    sector_t block, last = 0;
+    uint64_t i;
+
+    blk_start_plug(&plug);
+    for (i = 0; i < count; i++, record++) {
+        block = assoofs_inode_table_block(sb, record->inode_no);
+        if (block != last)
+            assoofs_breadahead(sb, block);
+        last = block;
+    }
+    blk_finish_plug(&plug);
+}
+
+static int assoofs_iterate(struct file *filp, struct dir_context *ctx) {
+    struct inode *inode;
+    struct super_block *sb;
+    struct assoofs_inode_info *inode_info;
+    struct buffer_head *bh;
+    int i = 0;
+    printk(KERN_INFO "Iterate request\n");
+    inode = filp->f_path.dentry->d_inode;
+    sb = inode->i_sb;
+    inode_info = inode->i_private;
+    if (ctx->pos) return 0;
+    if ((!S_ISDIR(inode_info->mode))) return -1;
+    bh = assoofs_bread(sb, inode_info->data_block_number);
+    if (!bh) return -EIO;
+    struct assoofs_dir_record_entry *record ;
+         record = (struct assoofs_dir_record_entry *) bh->b_data;
+    assoofs_readahead_children(sb, record, inode_info->dir_children_count);
+    if (!READ_ONCE(ASSOOFS_I(inode)->dir_index))
+        assoofs_dir_index_build(inode, record);
+    for (i = 0; i < inode_info->dir_children_count; i++) {
+        dir_emit(ctx, record->filename, strnlen(record->filename, ASSOOFS_FILENAME_MAXLEN), record->inode_no, DT_UNKNOWN);
+        ctx->pos += sizeof(struct assoofs_dir_record_entry);
+        record++;
+    }
+
+    brelse(bh);
+    return 0;
+}
+
+/*
+ *  Operaciones sobre inodos
+ */
+static int assoofs_create(struct inode *dir, struct dentry *dentry, umode_t mode, bool excl);
+struct dentry *assoofs_lookup(struct inode *parent_inode, struct dentry *child_dentry, unsigned int flags);
+static int assoofs_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode);
+static int assoofs_unlink(struct inode *dir, struct dentry *dentry);
+static int assoofs_rmdir(struct inode *dir, struct dentry *dentry);
+static int assoofs_link(struct dentry *old_dentry, struct inode *dir, struct dentry *dentry);
+static int assoofs_symlink(struct inode *dir, struct dentry *dentry, const char *symname);
+static struct assoofs_inode_info *assoofs_sealed_inode_info(struct super_block *sb, uint64_t inode_no);
+static void assoofs_sealed_set_ops(struct inode *inode, struct assoofs_inode_info *info);
+static struct inode_operations assoofs_inode_ops = {
+    .create = assoofs_create,
+    .lookup = assoofs_lookup,
+    .mkdir = assoofs_mkdir,
+    .unlink = assoofs_unlink,
+    .rmdir = assoofs_rmdir,
+    .link = assoofs_link,
+    .symlink = assoofs_symlink,
+};
+
+static const struct inode_operations assoofs_file_inode_ops = {
+    .setattr = assoofs_setattr,
+    .fiemap = assoofs_fiemap,
+};
+
+#define ASSOOFS_LINK_MAX 65000
+
+// Enlaces simbólicos cortos: el destino está en el propio inodo y resolverlos no lee ningún bloque
+static const struct inode_operations assoofs_fast_symlink_inode_ops = {
+    .get_link = simple_get_link,
+};
+
+static const char *assoofs_get_link(struct dentry *dentry, struct inode *inode, struct delayed_call *done);
+static const struct inode_operations assoofs_symlink_inode_ops = {
+    .get_link = assoofs_get_link,
+};
+
+static inline bool assoofs_inode_is_inline(struct assoofs_inode_info *inode_info) {
+    return S_ISLNK(inode_info->mode) && inode_info->file_size < ASSOOFS_INLINE_SYMLINK_LEN;
+}
+
+#define ASSOOFS_MAX_DIR_ENTRIES (ASSOOFS_DEFAULT_BLOCK_SIZE / sizeof(struct assoofs_dir_record_entry))
+
+struct assoofs_inode_info *assoofs_search_inode_info(struct super_block *sb, struct assoofs_inode_info *start, struct assoofs_inode_info *search);
+
+static struct assoofs_inode_info *assoofs_alloc_inode_info(void) {
+    struct assoofs_inode *ai = kmem_cache_zalloc(assoofs_inode_cache, GFP_NOFS);
+
+    if (!ai)
+        return NULL;
+    init_rwsem(&ai->map_sem);
+    ai->extents = ai->info.extents;
+    INIT_LIST_HEAD(&ai->lru);
+    return &ai->info;
+}
+
+static void assoofs_free_inode_info(struct assoofs_inode_info *inode_info) {
+    struct assoofs_inode *ai = container_of(inode_info, struct assoofs_inode, info);
+
+    if (ai->extents != ai->info.extents)
+        kfree(ai->extents);
+    kmem_cache_free(assoofs_inode_cache, ai);
+}
+
+// Ficheros regulares y enlaces cortos no tienen data_block_number
+static inline bool assoofs_inode_has_block(struct assoofs_inode_info *inode_info) {
+    return S_ISDIR(inode_info->mode) || (S_ISLNK(inode_info->mode) && !assoofs_inode_is_inline(inode_info));
+}
+
+struct assoofs_inode_info *assoofs_get_inode_info(struct super_block *sb, uint64_t inode_no) {
+    struct assoofs_inode_info *inode_info = NULL;
+    struct buffer_head *bh;
+    struct assoofs_inode_info search = { .inode_no = inode_no };
+    struct assoofs_inode_info *buffer = NULL;
+    if (ASSOOFS_FS(sb)->sealed)
+        return assoofs_sealed_inode_info(sb, inode_no);
+    if (!inode_no || inode_no > assoofs_inodes_total(sb))
+        return NULL;
+    bh = assoofs_bread(sb, assoofs_inode_table_block(sb, inode_no));
+    if (!bh)
+        return NULL;
+    inode_info = assoofs_search_inode_info(sb, (struct assoofs_inode_info *)bh->b_data, &search);
+    if (inode_info) {
+        buffer = assoofs_alloc_inode_info();
+        if (buffer)
+            memcpy(buffer, inode_info, sizeof(*buffer));
+    }
+    brelse(bh);
+    return buffer;
+};
+
+// Asigna operaciones según el tipo de inodo
+static void assoofs_set_inode_ops(struct inode *inod, struct assoofs_inode_info *inode_info) {
+    if (ASSOOFS_FS(inod->i_sb)->sealed) {
+        assoofs_sealed_set_ops(inod, inode_info);
+        return;
+    }
+    inod->i_op = &assoofs_inode_ops; // direcci ́on de una variable de tipo struct inode_operations previamente declarada
+    if (S_ISDIR(inode_info->mode))
+        inod->i_fop = &assoofs_dir_operations;
+    else if (S_ISREG(inode_info->mode)) {
+        inod->i_op = &assoofs_file_inode_ops;
+        inod->i_fop = &assoofs_file_operations;
+        inod->i_mapping->a_ops = &assoofs_aops;
+        inod->i_size = inode_info->file_size;
+    } else if (S_ISLNK(inode_info->mode)) {
+        inod->i_size = inode_info->file_size;
+        if (assoofs_inode_is_inline(inode_info)) {
+            inod->i_op = &assoofs_fast_symlink_inode_ops;
+            inod->i_link = inode_info->inline_symlink;
+        } else
+            inod->i_op = &assoofs_symlink_inode_ops;
+    } else
+        printk(KERN_ERR "Unknown inode type. Neither a directory nor a file."); // direccion de una variable de tipo struct file_operations previamente declarada
+}
+
+// El dueño no se guarda en el disco: lo pone el directorio desde el que se llega la primera vez
+static struct inode *assoofs_get_inode(struct super_block *sb, struct inode *dir, int ino){
+    struct inode *inod;
+    struct assoofs_inode_info *inode_info=NULL;
+   // uint64_t count;
+   // count=ASSOOFS_SB(sb)->inodes_count; // obtengo el n ́umero de inodos de lainformaci ́on persistente del superbloque;
+
+    // Con enlaces duros varios nombres llevan al mismo inodo: debe haber una sola copia en memoria
+    inod = iget_locked(sb, ino);
+    if (!inod)
+        return ERR_PTR(-ENOMEM);
+    if (!(inod->i_state & I_NEW))
+        return inod;
+    inode_info = assoofs_get_inode_info(sb, ino);
+    if (!inode_info) {
+        iget_failed(inod);
+        return ERR_PTR(-EIO);
+    }
+    if (S_ISREG(inode_info->mode) && assoofs_extent_load(sb, container_of(inode_info, struct assoofs_inode, info))) {
+        assoofs_free_inode_info(inode_info);
+        iget_failed(inod);
+        return ERR_PTR(-EIO);
+    }
+    inod->i_sb = sb; // puntero al superbloque
+    set_nlink(inod, inode_info->links_count ? inode_info->links_count : 1);
+    inode_init_owner(inod, dir, inode_info->mode);
+    assoofs_set_inode_ops(inod, inode_info);
+    inod->i_atime = inod->i_mtime = inod->i_ctime = current_time(inod);
+    inod->i_private = inode_info; // Informaci ́on persistente del inodo
+    if (ASSOOFS_I(inod)->extents != inode_info->extents)
+        assoofs_cache_add(inod);
+    unlock_new_inode(inod);
+    return inod;
+
+};
+
+struct dentry *assoofs_lookup(struct inode *parent_inode, struct dentry *child_dentry, unsigned int flags) {
+    printk(KERN_INFO"Lookup request\n");
+    struct super_block *sb;
+    struct assoofs_dir_index *idx;
+    struct assoofs_dir_name *dn;
+    struct inode *inod;
+    const struct qstr *name = &child_dentry->d_name;
+    u32 hash;
+    if (name->len >= ASSOOFS_FILENAME_MAXLEN)
+        return ERR_PTR(-ENAMETOOLONG);
+    sb=parent_inode->i_sb;
+    idx = assoofs_dir_index_get(parent_inode);
+    if (IS_ERR(idx))
+        return ERR_CAST(idx);
+    hash = assoofs_name_hash(name->name, name->len);
+    if (!assoofs_bloom_test(idx, hash)) {
+        assoofs_stat_inc(sb, lookup_bloom_rejects);
+        dn = NULL;
+    } else {
+        dn = assoofs_dir_index_find(idx, name->name, name->len, hash);
+    }
+    if (dn) {
+        inod= assoofs_get_inode(sb,parent_inode,dn->inode_no); // Funcion auxiliar que obtiene la informacion de un inodo a partir de su numero de inodo.
+        if (IS_ERR(inod))
+            return ERR_CAST(inod);
+        d_add(child_dentry, inod);
+        assoofs_stat_inc(sb, lookup_hits);
+        return NULL;
+    }
+    // Dentry negativa: el siguiente intento con el mismo nombre ni siquiera llega aquí
+    d_add(child_dentry, NULL);
+    assoofs_stat_inc(sb, lookup_misses);
+    return NULL;
+}
+
+// start es el comienzo del bloque del almacén que contiene a search (ver assoofs_inode_table_block)
+struct assoofs_inode_info *assoofs_search_inode_info(struct super_block *sb, struct assoofs_inode_info *start, struct assoofs_inode_info *search){
+    start += (search->inode_no - 1) % ASSOOFS_INODES_PER_BLOCK;
+    if (start->inode_no == search->inode_no)
+        return start;
+    else
+        return NULL;
+}
+
+/*
+ *  Imágenes selladas: solo lectura y con todos los metadatos en memoria desde el montaje,
+ *  leídos de una vez. Los directorios se buscan por bisección en sus entradas ordenadas y los
+ *  datos de cada fichero, seguidos en el dispositivo desde sealed_offset, se leen con mpage en
+ *  bloques de 512 bytes: en estos inodos i_blkbits es SECTOR_SHIFT.
+ */
+static int assoofs_sealed_load(struct super_block *sb) {
+    struct assoofs_fs_info *fs = ASSOOFS_FS(sb);
+    struct assoofs_super_block_info *asb = fs->asb;
+    uint64_t dev_blocks = i_size_read(sb->s_bdev->bd_inode) >> sb->s_blocksize_bits;
+    struct bio *bio = NULL, *prev;
+    struct blk_plug plug;
+    size_t off = 0;
+    char *p;
+    int ret;
+
+    if (!asb->inodes_count || !asb->meta_blocks || asb->blocks_count > dev_blocks ||
+        asb->meta_blocks >= asb->blocks_count ||
+        asb->inodes_count > asb->meta_blocks * ASSOOFS_INODES_PER_BLOCK) {
+        printk(KERN_ERR "assoofs_fill_super: bad sealed image geometry\n");
+        return -EINVAL;
+    }
+    fs->sealed_size = asb->meta_blocks << sb->s_blocksize_bits;
+    fs->sealed = kvmalloc(fs->sealed_size, GFP_KERNEL);
+    if (!fs->sealed)
+        return -ENOMEM;
+
+    // El buffer se lee por sus páginas: lo que la caché tenga por la dirección de vmalloc, fuera antes
+    if (is_vmalloc_addr(fs->sealed))
+        flush_kernel_vmap_range(fs->sealed, fs->sealed_size);
+    // Una sola lectura seguida, en bios encadenados que se esperan juntos
+    blk_start_plug(&plug);
+    while (off < fs->sealed_size) {
+        prev = bio;
+        bio = bio_alloc(GFP_KERNEL, min_t(size_t, DIV_ROUND_UP(fs->sealed_size - off, PAGE_SIZE), BIO_MAX_PAGES));
+        bio_set_dev(bio, sb->s_bdev);
+        bio->bi_iter.bi_sector = ((ASSOOFS_SEALED_META_BLOCK << sb->s_blocksize_bits) + off) >> SECTOR_SHIFT;
+        bio->bi_opf = REQ_OP_READ;
+        for (; off < fs->sealed_size; off += ASSOOFS_DEFAULT_BLOCK_SIZE) {
+            p = (char *)fs->sealed + off;
+            if (bio_add_page(bio, is_vmalloc_addr(p) ? vmalloc_to_page(p) : virt_to_page(p), ASSOOFS_DEFAULT_BLOCK_SIZE,
+                             offset_in_page(p)) != ASSOOFS_DEFAULT_BLOCK_SIZE)
+                break;
+        }
+        if (prev) {
+            bio_chain(prev, bio);
+            submit_bio(prev);
+        }
+    }
+    ret = submit_bio_wait(bio);
+    bio_put(bio);
+    blk_finish_plug(&plug);
+    // ...y después, para no leer por ella copias de antes de la lectura
+    if (is_vmalloc_addr(fs->sealed))
+        invalidate_kernel_vmap_range(fs->sealed, fs->sealed_size);
+    assoofs_stat_add(sb, block_reads, asb->meta_blocks);
+    if (ret)
+        printk(KERN_ERR "assoofs_fill_super: error reading the sealed metadata (%d)\n", ret);
+    return ret;
+}
+
+// Lo que apunta un inodo tiene que caer dentro de la zona de metadatos o del dispositivo
+static bool assoofs_sealed_valid(struct super_block *sb, const struct assoofs_inode_info *raw) {
+    struct assoofs_fs_info *fs = ASSOOFS_FS(sb);
+    uint64_t size = fs->sealed_size, dev_bytes = fs->asb->blocks_count << sb->s_blocksize_bits;
+
+    if (S_ISDIR(raw->mode))
+        return raw->dir_children_count <= size / sizeof(struct assoofs_dir_record_entry) &&
+               raw->data_block_number <= size - raw->dir_children_count * sizeof(struct assoofs_dir_record_entry);
+    if (S_ISLNK(raw->mode))
+        return assoofs_inode_is_inline((struct assoofs_inode_info *)raw) ||
+               (raw->file_size < size && raw->data_block_number < size - raw->file_size &&
+                !((char *)fs->sealed)[raw->data_block_number + raw->file_size]);
+    if (S_ISREG(raw->mode))
+        return !(raw->sealed_offset % ASSOOFS_SEALED_ALIGN) && !raw->extents_count && raw->file_size <= dev_bytes &&
+               raw->sealed_offset <= dev_bytes - raw->file_size;
+    return false;
+}
+
+static struct assoofs_inode_info *assoofs_sealed_inode_info(struct super_block *sb, uint64_t inode_no) {
+    struct assoofs_fs_info *fs = ASSOOFS_FS(sb);
+    struct assoofs_inode_info *raw, *info;
+
+    if (!inode_no || inode_no > fs->asb->inodes_count)
+        return NULL;
+    raw = (struct assoofs_inode_info *)fs->sealed + inode_no - 1;
+    if (raw->inode_no != inode_no || !assoofs_sealed_valid(sb, raw)) {
+        printk(KERN_ERR "assoofs: corrupt inode %llu in the sealed image\n", inode_no);
+        return NULL;
+    }
+    info = assoofs_alloc_inode_info();
+    if (info)
+        memcpy(info, raw, sizeof(*info));
+    return info;
+}
+
+static inline const struct assoofs_dir_record_entry *assoofs_sealed_entries(struct inode *dir) {
+    return (const void *)((char *)ASSOOFS_FS(dir->i_sb)->sealed + ASSOOFS_I(dir)->info.data_block_number);
+}
+
+static struct dentry *assoofs_sealed_lookup(struct inode *dir, struct dentry *dentry, unsigned int flags) {
+    const struct assoofs_dir_record_entry *rec = assoofs_sealed_entries(dir);
+    const struct qstr *name = &dentry->d_name;
+    uint64_t lo = 0, hi = ASSOOFS_I(dir)->info.dir_children_count, mid;
+    struct inode *inode = NULL;
+    int cmp;
+
+    if (name->len >= ASSOOFS_FILENAME_MAXLEN)
+        return ERR_PTR(-ENAMETOOLONG);
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        cmp = strncmp(name->name, rec[mid].filename, name->len);
+        // Con el mismo principio el nombre más corto va antes
+        if (!cmp && rec[mid].filename[name->len])
+            cmp = -1;
+        if (!cmp) {
+            inode = assoofs_get_inode(dir->i_sb, dir, rec[mid].inode_no);
+            if (IS_ERR(inode))
+                return ERR_CAST(inode);
+            break;
+        }
+        if (cmp < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    if (inode)
+        assoofs_stat_inc(dir->i_sb, lookup_hits);
+    else
+        assoofs_stat_inc(dir->i_sb, lookup_misses);
+    d_add(dentry, inode);
+    return NULL;
+}
+
+// ctx->pos es el número de entrada; el tipo sale del inodo, que ya está en memoria
+static int assoofs_sealed_iterate(struct file *file, struct dir_context *ctx) {
+    struct inode *dir = file_inode(file);
+    struct assoofs_fs_info *fs = ASSOOFS_FS(dir->i_sb);
+    const struct assoofs_dir_record_entry *rec;
+    const struct assoofs_inode_info *child;
+    unsigned char type;
+
+    for (; ctx->pos < ASSOOFS_I(dir)->info.dir_children_count; ctx->pos++) {
+        rec = assoofs_sealed_entries(dir) + ctx->pos;
+        type = DT_UNKNOWN;
+        if (rec->inode_no && rec->inode_no <= fs->asb->inodes_count) {
+            child = (struct assoofs_inode_info *)fs->sealed + rec->inode_no - 1;
+            type = fs_umode_to_dtype(child->mode);
+        }
+        if (!dir_emit(ctx, rec->filename, strnlen(rec->filename, ASSOOFS_FILENAME_MAXLEN), rec->inode_no, type))
+            break;
+    }
+    return 0;
+}
+
+static int assoofs_sealed_get_block(struct inode *inode, sector_t iblock, struct buffer_head *bh_result, int create) {
+    sector_t last = DIV_ROUND_UP(i_size_read(inode), ASSOOFS_SEALED_ALIGN);
+    size_t max = bh_result->b_size;
+
+    if (create)
+        return -EROFS;
+    if (iblock >= last)
+        return 0;
+    map_bh(bh_result, inode->i_sb, (ASSOOFS_I(inode)->info.sealed_offset >> SECTOR_SHIFT) + iblock);
+    bh_result->b_size = min_t(u64, max, (u64)(last - iblock) << SECTOR_SHIFT);
+    return 0;
+}
+
+static int assoofs_sealed_readpage(struct file *file, struct page *page) {
+    return mpage_readpage(page, assoofs_sealed_get_block);
+}
+
+static void assoofs_sealed_readahead(struct readahead_control *rac) {
+    mpage_readahead(rac, assoofs_sealed_get_block);
+}
+
+static ssize_t assoofs_sealed_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+    ssize_t ret = generic_file_read_iter(iocb, to);
+
+    if (ret > 0)
+        assoofs_stat_add(file_inode(iocb->ki_filp)->i_sb, bytes_read, ret);
+    return ret;
+}
+
+static const struct address_space_operations assoofs_sealed_aops = {
+    .readpage = assoofs_sealed_readpage,
+    .readahead = assoofs_sealed_readahead,
+};
+
+static const struct file_operations assoofs_sealed_file_operations = {
+    .llseek = generic_file_llseek,
+    .read_iter = assoofs_sealed_read_iter,
+    .mmap = generic_file_readonly_mmap,
+    .splice_read = generic_file_splice_read,
+};
+
+static const struct file_operations assoofs_sealed_dir_operations = {
+    .owner = THIS_MODULE,
+    .llseek = generic_file_llseek,
+    .read = generic_read_dir,
+    .iterate_shared = assoofs_sealed_iterate,
+};
+
+static const struct inode_operations assoofs_sealed_dir_inode_ops = {
+    .lookup = assoofs_sealed_lookup,
+};
+
+// Los enlaces largos también se resuelven sin leer nada: su destino está en la zona de metadatos
+static void assoofs_sealed_set_ops(struct inode *inode, struct assoofs_inode_info *info) {
+    if (S_ISDIR(info->mode)) {
+        inode->i_op = &assoofs_sealed_dir_inode_ops;
+        inode->i_fop = &assoofs_sealed_dir_operations;
+    } else if (S_ISREG(info->mode)) {
+        inode->i_fop = &assoofs_sealed_file_operations;
+        inode->i_mapping->a_ops = &assoofs_sealed_aops;
+        inode->i_blkbits = SECTOR_SHIFT;
+        inode->i_size = info->file_size;
+    } else if (S_ISLNK(info->mode)) {
+        inode->i_op = &assoofs_fast_symlink_inode_ops;
+        inode->i_link = assoofs_inode_is_inline(info) ? info->inline_symlink :
+                        (char *)ASSOOFS_FS(inode->i_sb)->sealed + info->data_block_number;
+        inode->i_size = info->file_size;
+    }
+}
+
+int assoofs_save_inode_info(struct super_block *sb, struct assoofs_inode_info *inode_info){
+    return assoofs_write_inode_info(sb, inode_info, true);
+}
+
+// Sin sync el bloque del almacén solo se marca sucio (writeback de ficheros regulares)
+static int assoofs_write_inode_info(struct super_block *sb, struct assoofs_inode_info *inode_info, bool sync){
+    struct buffer_head *bh;
+    struct assoofs_inode_info *inode_pos=NULL;
+    bh = assoofs_bread(sb, assoofs_inode_table_block(sb, inode_info->inode_no));
+    if (!bh)
+        return -EIO;
+    inode_pos = assoofs_search_inode_info(sb, (struct assoofs_inode_info *)bh->b_data, inode_info);
+    if (!inode_pos) {
+        brelse(bh);
+        return -EIO;
+    }
+    // El enlace de la lista de huérfanos solo se modifica en disco (assoofs_orphan_add/del)
+    inode_info->orphan_next = inode_pos->orphan_next;
+    memcpy(inode_pos, inode_info, sizeof(*inode_pos));
+    if (sync)
+        assoofs_sync_bh(sb, bh);
+    else
+        assoofs_dirty_bh(sb, bh);
+    brelse(bh);
+    return 0;
+}
+
+
+void assoofs_save_sb_info(struct super_block *vsb){
+    // La informaci ́on persistente del superbloque en memoria vive en el propio buffer del bloque 0
+    assoofs_sync_bh(vsb, ASSOOFS_FS(vsb)->sb_bh);
+}
+
+/*
+ *  Grupos de asignación. Cada grupo tiene su mapa de bloques, su mapa de inodos,
+ *  sus contadores en la tabla de descriptores y su propio cerrojo.
+ */
+// Busca palabra a palabra el primer bit a 1 (libre) desde start, dando la vuelta al mapa
+static unsigned int assoofs_find_free_bit(const uint64_t *map, unsigned int nbits, unsigned int start, u64 *scanned) {
+    unsigned int words = DIV_ROUND_UP(nbits, 64);
+    unsigned int first, w, i, bit;
+    uint64_t word;
+
+    if (start >= nbits)
+        start = 0;
+    first = start / 64;
+    // La primera palabra desde start y, al final de la vuelta, sus bits por debajo de start
+    for (i = 0; i <= words; i++) {
+        w = (first + i) % words;
+        word = map[w];
+        if (i == 0)
+            word &= ~0ULL << (start % 64);
+        else if (i == words)
+            word &= ~(~0ULL << (start % 64));
+        if (word) {
+            bit = w * 64 + __ffs64(word);
+            *scanned += (i + 1) * 64;
+            return bit < nbits ? bit : nbits;
+        }
+    }
+    *scanned += (words + 1) * 64;
+    return nbits;
+}
+
+/*
+ *  Índice en memoria de los tramos libres de cada grupo: los mismos nodos en dos rbtree,
+ *  uno por posición y otro por longitud. Se construye al montar desde el mapa de bloques
+ *  y cambia con cada reserva y cada liberación, bajo el cerrojo del grupo; el mapa sigue
+ *  siendo lo que cuenta en disco. Lo pendiente de descartar no entra hasta descartarse.
+ */
+struct assoofs_free_extent {
+    struct rb_node by_start;
+    struct rb_node by_len;      /* por longitud y, a igual longitud, por posición */
+    unsigned int start;         /* primer bloque, relativo al grupo */
+    unsigned int len;
+};
+
+static struct kmem_cache *assoofs_fext_cache;
+
+static void assoofs_fext_link_len(struct assoofs_group_info *gi, struct assoofs_free_extent *fe) {
+    struct rb_node **p = &gi->free_by_len.rb_node, *parent = NULL;
+    struct assoofs_free_extent *cur;
+
+    while (*p) {
+        parent = *p;
+        cur = rb_entry(parent, struct assoofs_free_extent, by_len);
+        if (fe->len < cur->len || (fe->len == cur->len && fe->start < cur->start))
+            p = &parent->rb_left;
+        else
+            p = &parent->rb_right;
+    }
+    rb_link_node(&fe->by_len, parent, p);
+    rb_insert_color(&fe->by_len, &gi->free_by_len);
+}
+
+static void assoofs_fext_link(struct assoofs_group_info *gi, struct assoofs_free_extent *fe) {
+    struct rb_node **p = &gi->free_by_start.rb_node, *parent = NULL;
+    struct assoofs_free_extent *cur;
+
+    while (*p) {
+        parent = *p;
+        cur = rb_entry(parent, struct assoofs_free_extent, by_start);
+        p = fe->start < cur->start ? &parent->rb_left : &parent->rb_right;
+    }
+    rb_link_node(&fe->by_start, parent, p);
+    rb_insert_color(&fe->by_start, &gi->free_by_start);
+    assoofs_fext_link_len(gi, fe);
+}
+
+static void assoofs_fext_erase(struct assoofs_group_info *gi, struct assoofs_free_extent *fe) {
+    rb_erase(&fe->by_start, &gi->free_by_start);
+    rb_erase(&fe->by_len, &gi->free_by_len);
+    kmem_cache_free(assoofs_fext_cache, fe);
+}
+
+// Último tramo que empieza en bit o antes, NULL si no hay ninguno
+static struct assoofs_free_extent *assoofs_fext_prev(struct assoofs_group_info *gi, unsigned int bit) {
+    struct rb_node *n = gi->free_by_start.rb_node;
+    struct assoofs_free_extent *fe, *prev = NULL;
+
+    while (n) {
+        fe = rb_entry(n, struct assoofs_free_extent, by_start);
+        if (fe->start <= bit) {
+            prev = fe;
+            n = n->rb_right;
+        } else {
+            n = n->rb_left;
+        }
+    }
+    return prev;
+}
+
+// El tramo más corto en el que caben want bloques (el más bajo entre los iguales), NULL si ninguno
+static struct assoofs_free_extent *assoofs_fext_best(struct assoofs_group_info *gi, unsigned int want) {
+    struct rb_node *n = gi->free_by_len.rb_node;
+    struct assoofs_free_extent *fe, *best = NULL;
+
+    while (n) {
+        fe = rb_entry(n, struct assoofs_free_extent, by_len);
+        if (fe->len >= want) {
+            best = fe;
+            n = n->rb_left;
+        } else {
+            n = n->rb_right;
+        }
+    }
+    return best;
+}
+
+static struct assoofs_free_extent *assoofs_fext_largest(struct assoofs_group_info *gi) {
+    struct rb_node *n = rb_last(&gi->free_by_len);
+
+    return n ? rb_entry(n, struct assoofs_free_extent, by_len) : NULL;
+}
+
+// Los nodos se piden con __GFP_NOFAIL: un tramo que no entrase en el índice no se volvería a asignar
+static void assoofs_fext_add(struct assoofs_group_info *gi, unsigned int start, unsigned int len) {
+    struct assoofs_free_extent *prev = assoofs_fext_prev(gi, start), *next = NULL, *fe;
+    struct rb_node *n = prev ? rb_next(&prev->by_start) : rb_first(&gi->free_by_start);
+
+    if (n)
+        next = rb_entry(n, struct assoofs_free_extent, by_start);
+    if (prev && prev->start + prev->len == start) {
+        rb_erase(&prev->by_len, &gi->free_by_len);
+        prev->len += len;
+        if (next && start + len == next->start) {
+            prev->len += next->len;
+            assoofs_fext_erase(gi, next);
+        }
+        assoofs_fext_link_len(gi, prev);
+        return;
+    }
+    if (next && start + len == next->start) {
+        rb_erase(&next->by_len, &gi->free_by_len);
+        next->start = start;
+        next->len += len;
+        assoofs_fext_link_len(gi, next);
+        return;
+    }
+    fe = kmem_cache_alloc(assoofs_fext_cache, GFP_NOFS | __GFP_NOFAIL);
+    fe->start = start;
+    fe->len = len;
+    assoofs_fext_link(gi, fe);
+}
+
+// Saca [start, start + len) del tramo fe, que lo contiene entero
+static void assoofs_fext_take(struct assoofs_group_info *gi, struct assoofs_free_extent *fe, unsigned int start, unsigned int len) {
+    unsigned int end = start + len, fe_end = fe->start + fe->len;
+    struct assoofs_free_extent *tail;
+
+    if (start == fe->start && end == fe_end) {
+        assoofs_fext_erase(gi, fe);
+        return;
+    }
+    rb_erase(&fe->by_len, &gi->free_by_len);
+    if (start > fe->start && end < fe_end) {
+        tail = kmem_cache_alloc(assoofs_fext_cache, GFP_NOFS | __GFP_NOFAIL);
+        tail->start = end;
+        tail->len = fe_end - end;
+        assoofs_fext_link(gi, tail);
+        fe->len = start - fe->start;
+    } else if (start == fe->start) {
+        // El orden por posición no cambia: los tramos no se solapan
+        fe->start = end;
+        fe->len = fe_end - end;
+    } else {
+        fe->len = start - fe->start;
+    }
+    assoofs_fext_link_len(gi, fe);
+}
+
+// Bits a 1 (libres) entre los nbits primeros del mapa
+static unsigned int assoofs_count_free(const uint64_t *map, unsigned int nbits) {
+    unsigned int i, n = 0;
+
+    for (i = 0; i < nbits / 64; i++)
+        n += hweight64(map[i]);
+    if (nbits % 64)
+        n += hweight64(map[i] & ((1ULL << (nbits % 64)) - 1));
+    return n;
+}
+
+static void assoofs_fext_destroy(struct assoofs_group_info *gi) {
+    struct assoofs_free_extent *fe, *tmp;
+
+    rbtree_postorder_for_each_entry_safe(fe, tmp, &gi->free_by_start, by_start)
+        kmem_cache_free(assoofs_fext_cache, fe);
+    gi->free_by_start = RB_ROOT;
+    gi->free_by_len = RB_ROOT;
+}
+
+/*
+ *  La primera vez que se usa un grupo, con su cerrojo cogido y antes de tocar su mapa de
+ *  bloques: cada racha de bits libres del mapa es un tramo. Tras un desmontaje sin limpiar los
+ *  contadores del descriptor pueden no cuadrar con los mapas, que son los que mandan.
+ */
+static int assoofs_group_load(struct super_block *sb, unsigned int g) {
+    struct assoofs_fs_info *fs = ASSOOFS_FS(sb);
+    struct assoofs_group_info *gi = &fs->groups[g];
+    unsigned int nbits = assoofs_group_nblocks(sb, g), i, run = 0, free = 0, free_inodes;
+    struct assoofs_group_desc *gd;
+    struct buffer_head *gdt_bh, *bh;
+    uint64_t *map;
+
+    if (gi->loaded)
+        return 0;
+    gd = assoofs_group_desc(sb, g, &gdt_bh);
+    bh = assoofs_bread(sb, gd->block_bitmap);
+    if (!bh)
+        return -EIO;
+    map = (uint64_t *)bh->b_data;
+    for (i = 0; i <= nbits; i++) {
+        if (i < nbits && (map[i / 64] & (1ULL << (i % 64)))) {
+            run++;
+            continue;
+        }
+        if (run)
+            assoofs_fext_add(gi, i - run, run);
+        free += run;
+        run = 0;
+        // Palabras enteras ocupadas de golpe
+        while (i + 1 < nbits && (i + 1) % 64 == 0 && map[(i + 1) / 64] == 0)
+            i += 64;
+    }
+    brelse(bh);
+    if (!fs->unclean)
+        goto out;
+    bh = assoofs_bread(sb, gd->inode_bitmap);
+    if (!bh) {
+        assoofs_fext_destroy(gi);
+        return -EIO;
+    }
+    free_inodes = assoofs_count_free((uint64_t *)bh->b_data, fs->asb->inodes_per_group);
+    brelse(bh);
+    if (gd->free_blocks_count != free) {
+        printk(KERN_WARNING "assoofs: group %u has %u free blocks, not %llu\n", g, free, gd->free_blocks_count);
+        percpu_counter_add(&fs->free_blocks, (s64)free - (s64)gd->free_blocks_count);
+        gd->free_blocks_count = free;
+    }
+    if (gd->free_inodes_count != free_inodes) {
+        printk(KERN_WARNING "assoofs: group %u has %u free inodes, not %llu\n", g, free_inodes, gd->free_inodes_count);
+        percpu_counter_add(&fs->free_inodes, (s64)free_inodes - (s64)gd->free_inodes_count);
+        gd->free_inodes_count = free_inodes;
+    }
+    // De lectura el arreglo se queda en memoria; assoofs_set_clean lo escribe antes de poner la marca
+    if (!sb_rdonly(sb))
+        assoofs_dirty_bh(sb, gdt_bh);
+out:
+    gi->loaded = true;
+    return 0;
+}
+
+
+/*
+ *  Reserva un hueco libre en el almacén de inodos de algún grupo, empezando por goal_group.
+ *  En la primera vuelta se saltan los grupos cuyo cerrojo está cogido, así creaciones
+ *  concurrentes acaban en grupos distintos.
+ */
+static int assoofs_group_alloc_inode(struct super_block *sb, unsigned int goal_group, bool dir, unsigned int *group, unsigned int *bit) {
+    struct assoofs_fs_info *fs = ASSOOFS_FS(sb);
+    unsigned int ngroups = fs->asb->groups_count, pass, i, g, nbits, b;
+    struct assoofs_group_info *gi;
+    struct assoofs_group_desc *gd;
+    struct buffer_head *gdt_bh, *bh;
+    u64 scanned = 0;
+
+    for (pass = 0; pass < 2; pass++) {
+        for (i = 0; i < ngroups; i++) {
+            g = (goal_group + i) % ngroups;
+            gi = &fs->groups[g];
+            gd = assoofs_group_desc(sb, g, &gdt_bh);
+            if (!READ_ONCE(gd->free_inodes_count))
+                continue;
+            if (pass == 0) {
+                if (!mutex_trylock(&gi->lock))
+                    continue;
+            } else {
+                mutex_lock(&gi->lock);
+            }
+            nbits = fs->asb->inodes_per_group;
+            bh = assoofs_bread(sb, gd->inode_bitmap);
+            if (!bh) {
+                mutex_unlock(&gi->lock);
+                return -EIO;
+            }
+            b = assoofs_find_free_bit((uint64_t *)bh->b_data, nbits, gi->inode_hint, &scanned);
+            if (b == nbits) {
+                brelse(bh);
+                mutex_unlock(&gi->lock);
+                continue;
+            }
+            ((uint64_t *)bh->b_data)[b / 64] &= ~(1ULL << (b % 64));
+            assoofs_sync_bh(sb, bh);
+            brelse(bh);
+            gd->free_inodes_count--;
+            if (dir)
+                gd->dirs_count++;
+            gi->inode_hint = b + 1;
+            percpu_counter_dec(&fs->free_inodes);
+            assoofs_sync_bh(sb, gdt_bh);
+            mutex_unlock(&gi->lock);
+            assoofs_stat_add(sb, alloc_scan_bits, scanned);
+            *group = g;
+            *bit = b;
+            return 0;
+        }
+    }
+    return -ENOSPC;
+}
+
+/*
+ *  Reserva entre 1 y want bloques seguidos lo más cerca posible de goal. Si goal está libre
+ *  el tramo empieza ahí, así una escritura secuencial sigue en el mismo extent. Si no, en
+ *  cada grupo desde el de goal se elige en O(log n) el tramo libre más corto en el que
+ *  quepan hint bloques (best fit) y, si ninguno tiene sitio, el más largo que haya.
+ *  La primera vuelta se salta los grupos con el cerrojo cogido y los que no tienen hint
+ *  bloques libres. Sin sync el mapa y el descriptor solo se marcan sucios (datos de ficheros).
+ */
+static int assoofs_group_alloc_blocks(struct super_block *sb, uint64_t goal, unsigned int want, unsigned int hint, bool sync, uint64_t *block, unsigned int *count) {
+    struct assoofs_fs_info *fs = ASSOOFS_FS(sb);
+    unsigned int ngroups = fs->asb->groups_count, goal_group = 0, goal_bit = 0, pass, i, g, b, n, j;
+    bool has_goal = goal >= fs->asb->first_group_block && goal < fs->asb->blocks_count;
+    struct assoofs_free_extent *fe;
+    struct assoofs_group_info *gi;
+    struct assoofs_group_desc *gd;
+    struct buffer_head *gdt_bh, *bh;
+
+    if (has_goal) {
+        goal_group = assoofs_block_group(sb, goal);
+        goal_bit = goal - assoofs_group_first_block(sb, goal_group);
+    }
+    hint = min_t(uint64_t, max(hint, want), fs->asb->blocks_per_group);
+    for (pass = 0; pass < 2; pass++) {
+        for (i = 0; i < ngroups; i++) {
+            g = (goal_group + i) % ngroups;
+            gi = &fs->groups[g];
+            gd = assoofs_group_desc(sb, g, &gdt_bh);
+            // Donde sigue goal no hace falta sitio para todo hint
+            if (READ_ONCE(gd->free_blocks_count) < (pass == 0 && !(has_goal && g == goal_group) ? hint : 1))
+                continue;
+            if (pass == 0) {
+                if (!mutex_trylock(&gi->lock))
+                    continue;
+            } else {
+                mutex_lock(&gi->lock);
+            }
+            if (assoofs_group_load(sb, g)) {
+                mutex_unlock(&gi->lock);
+                return -EIO;
+            }
+            fe = NULL;
+            if (has_goal && g == goal_group) {
+                fe = assoofs_fext_prev(gi, goal_bit);
+                if (fe && goal_bit >= fe->start + fe->len)
+                    fe = NULL;
+            }
+            if (fe) {
+                b = goal_bit;
+            } else {
+                fe = assoofs_fext_best(gi, hint);
+                if (!fe && pass == 1)
+                    fe = assoofs_fext_largest(gi);
+                if (!fe) {
+                    mutex_unlock(&gi->lock);
+                    continue;
+                }
+                b = fe->start;
+            }
+            n = min(want, fe->start + fe->len - b);
+            bh = assoofs_bread(sb, gd->block_bitmap);
+            if (!bh) {
+                mutex_unlock(&gi->lock);
+                return -EIO;
+            }
+            for (j = b; j < b + n; j++)
+                ((uint64_t *)bh->b_data)[j / 64] &= ~(1ULL << (j % 64));
+            if (sync)
+                assoofs_sync_bh(sb, bh);
+            else
+                assoofs_dirty_bh(sb, bh);
+            brelse(bh);
+            assoofs_fext_take(gi, fe, b, n);
+            gd->free_blocks_count -= n;
+            percpu_counter_sub(&fs->free_blocks, n);
+            if (sync)
+                assoofs_sync_bh(sb, gdt_bh);
+            else
+                assoofs_dirty_bh(sb, gdt_bh);
+            mutex_unlock(&gi->lock);
+            assoofs_stat_inc(sb, alloc_calls);
+            *block = assoofs_group_first_block(sb, g) + b;
+            *count = n;
+            return 0;
+        }
+    }
+    return -ENOSPC;
+}
+
+/*
+ *  Libera count bits seguidos desde b. Un bloque compartido (reflink) solo pierde una
+ *  referencia. Un bloque liberado que no llegue al disco solo se pierde: basta marcarlo sucio.
+ */
+static void assoofs_group_free(struct super_block *sb, unsigned int g, unsigned int b, unsigned int count, bool inode, bool dir) {
+    struct assoofs_fs_info *fs = ASSOOFS_FS(sb);
+    struct assoofs_group_info *gi = &fs->groups[g];
+    struct assoofs_group_desc *gd;
+    struct buffer_head *gdt_bh, *bh, *rc_bh = NULL;
+    unsigned int i, freed = 0, run_start = 0, run_len = 0;
+    uint8_t *rc;
+
+    mutex_lock(&gi->lock);
+    gd = assoofs_group_desc(sb, g, &gdt_bh);
+    // Lo que se libere tiene que entrar en el índice del grupo, no en el mapa que aún se leerá
+    bh = NULL;
+    if (inode || !assoofs_group_load(sb, g))
+        bh = assoofs_bread(sb, inode ? gd->inode_bitmap : gd->block_bitmap);
+    if (!bh) {
+        mutex_unlock(&gi->lock);
+        printk(KERN_ERR "assoofs: cannot read bitmap of group %u, leaking %s %u\n", g, inode ? "inode" : "block", b);
+        return;
+    }
+    for (i = b; i < b + count; i++) {
+        if (!inode) {
+            if (!rc_bh || rc_bh->b_blocknr != gd->refcount_table + i / ASSOOFS_DEFAULT_BLOCK_SIZE) {
+                brelse(rc_bh);
+                rc_bh = assoofs_bread(sb, gd->refcount_table + i / ASSOOFS_DEFAULT_BLOCK_SIZE);
+                if (!rc_bh) {
+                    printk(KERN_ERR "assoofs: cannot read refcounts of group %u, leaking blocks\n", g);
+                    break;
+                }
+            }
+            rc = (uint8_t *)rc_bh->b_data + i % ASSOOFS_DEFAULT_BLOCK_SIZE;
+            if (*rc) {
+                (*rc)--;
+                assoofs_dirty_bh(sb, rc_bh);
+                continue;
+            }
+        }
+        ((uint64_t *)bh->b_data)[i / 64] |= 1ULL << (i % 64);
+        freed++;
+        if (inode)
+            continue;
+        // Los bloques liberados seguidos vuelven al índice (o a la cola de descartes) como un solo tramo
+        if (run_len && run_start + run_len == i) {
+            run_len++;
+        } else {
+            if (run_len)
+                assoofs_free_run(sb, g, run_start, run_len);
+            run_start = i;
+            run_len = 1;
+        }
+    }
+    if (run_len)
+        assoofs_free_run(sb, g, run_start, run_len);
+    brelse(rc_bh);
+    if (inode)
+        assoofs_sync_bh(sb, bh);
+    else
+        assoofs_dirty_bh(sb, bh);
+    brelse(bh);
+    // Los huecos bajos se reutilizan antes para que el grupo siga compacto
+    if (inode) {
+        gd->free_inodes_count++;
+        if (dir)
+            gd->dirs_count--;
+        if (b < gi->inode_hint)
+            gi->inode_hint = b;
+        percpu_counter_inc(&fs->free_inodes);
+    } else {
+        gd->free_blocks_count += freed;
+        percpu_counter_add(&fs->free_blocks, freed);
+    }
+    if (inode)
+        assoofs_sync_bh(sb, gdt_bh);
+    else
+        assoofs_dirty_bh(sb, gdt_bh);
+    mutex_unlock(&gi->lock);
+}
+
+/*
+ *  Descartes con -o discard. Un tramo liberado ya está libre en disco, pero no vuelve al
+ *  índice de tramos libres (ni se asigna) hasta que se descarte. El trabajo espera un momento
+ *  para juntar lo que se libere seguido, fusiona los tramos vecinos y lanza todos los
+ *  descartes de una vez, así borrar no espera al dispositivo.
+ */
+#define ASSOOFS_DISCARD_DELAY HZ
+
+struct assoofs_discard {
+    struct list_head list;
+    unsigned int group;
+    unsigned int bit;
+    unsigned int count;
+};
+
+// Con el cerrojo del grupo cogido: el tramo vuelve al índice ya o después de descartarlo
+static void assoofs_free_run(struct super_block *sb, unsigned int g, unsigned int b, unsigned int count) {
+    struct assoofs_fs_info *fs = ASSOOFS_FS(sb);
+    struct assoofs_discard *d = NULL;
+
+    if (fs->mount_opt & ASSOOFS_MOUNT_DISCARD)
+        d = kmalloc(sizeof(*d), GFP_NOFS);
+    if (!d) {
+        // Sin memoria queda sin descartar hasta el próximo FITRIM
+        assoofs_fext_add(&fs->groups[g], b, count);
+        return;
+    }
+    d->group = g;
+    d->bit = b;
+    d->count = count;
+    atomic_long_add(count, &fs->discard_pending);
+    spin_lock(&fs->discard_lock);
+    list_add_tail(&d->list, &fs->discard_list);
+    spin_unlock(&fs->discard_lock);
+    queue_delayed_work(system_unbound_wq, &fs->discard_work, ASSOOFS_DISCARD_DELAY);
+}
+
+static int assoofs_discard_cmp(void *priv, struct list_head *a, struct list_head *b) {
+    struct assoofs_discard *da = list_entry(a, struct assoofs_discard, list);
+    struct assoofs_discard *db = list_entry(b, struct assoofs_discard, list);
+
+    if (da->group != db->group)
+        return da->group < db->group ? -1 : 1;
+    return da->bit < db->bit ? -1 : da->bit > db->bit;
+}
+
+static void assoofs_discard_work(struct work_struct *work) {
+    struct assoofs_fs_info *fs = container_of(to_delayed_work(work), struct assoofs_fs_info, discard_work);
+    struct super_block *sb = fs->sb;
+    unsigned int shift = sb->s_blocksize_bits - 9;
+    struct assoofs_discard *d, *next;
+    struct assoofs_group_info *gi;
+    struct bio *bio = NULL;
+    struct blk_plug plug;
+    uint64_t discarded = 0;
+    LIST_HEAD(batch);
+    int ret;
+
+    spin_lock(&fs->discard_lock);
+    list_splice_init(&fs->discard_list, &batch);
+    spin_unlock(&fs->discard_lock);
+    if (list_empty(&batch))
+        return;
+
+    list_sort(NULL, &batch, assoofs_discard_cmp);
+    list_for_each_entry(d, &batch, list) {
+        while (!list_is_last(&d->list, &batch)) {
+            next = list_next_entry(d, list);
+            if (next->group != d->group || d->bit + d->count != next->bit)
+                break;
+            d->count += next->count;
+            list_del(&next->list);
+            kfree(next);
+        }
+    }
+
+    // Encadenados en una sola espera; un fallo solo deja bloques sin descartar
+    blk_start_plug(&plug);
+    list_for_each_entry(d, &batch, list) {
+        ret = __blkdev_issue_discard(sb->s_bdev, (assoofs_group_first_block(sb, d->group) + d->bit) << shift,
+                                     (sector_t)d->count << shift, GFP_NOFS, 0, &bio);
+        if (!ret)
+            discarded += d->count;
+    }
+    if (bio) {
+        ret = submit_bio_wait(bio);
+        if (ret && ret != -EOPNOTSUPP)
+            printk(KERN_ERR "assoofs: discard failed (%d)\n", ret);
+        bio_put(bio);
+    }
+    blk_finish_plug(&plug);
+    assoofs_stat_add(sb, discard_blocks, discarded);
+
+    while (!list_empty(&batch)) {
+        d = list_first_entry(&batch, struct assoofs_discard, list);
+        gi = &fs->groups[d->group];
+        mutex_lock(&gi->lock);
+        assoofs_fext_add(gi, d->bit, d->count);
+        mutex_unlock(&gi->lock);
+        atomic_long_sub(d->count, &fs->discard_pending);
+        list_del(&d->list);
+        kfree(d);
+    }
+}
+
+/*
+ *  FITRIM: descarta los tramos libres de al menos minlen bloques, recorriendo el índice del
+ *  grupo en orden. Cada grupo se recorre con su cerrojo cogido hasta que sus descartes
+ *  terminan, así nada se asigna en un tramo mientras se descarta; las asignaciones de
+ *  mientras se van a otros grupos.
+ */
+static int assoofs_trim_group(struct super_block *sb, unsigned int g, unsigned int first, unsigned int end, unsigned int minlen, uint64_t *trimmed) {
+    struct assoofs_group_info *gi = &ASSOOFS_FS(sb)->groups[g];
+    uint64_t base = assoofs_group_first_block(sb, g);
+    unsigned int shift = sb->s_blocksize_bits - 9, from, to;
+    struct assoofs_free_extent *fe;
+    struct bio *bio = NULL;
+    struct blk_plug plug;
+    struct rb_node *n;
+    int ret = 0, err;
+
+    if (READ_ONCE(assoofs_group_desc(sb, g, NULL)->free_blocks_count) < minlen)
+        return 0;
+    mutex_lock(&gi->lock);
+    ret = assoofs_group_load(sb, g);
+    if (ret) {
+        mutex_unlock(&gi->lock);
+        return ret;
+    }
+    blk_start_plug(&plug);
+    fe = assoofs_fext_prev(gi, first);
+    n = fe ? &fe->by_start : rb_first(&gi->free_by_start);
+    for (; n && !ret; n = rb_next(n)) {
+        fe = rb_entry(n, struct assoofs_free_extent, by_start);
+        if (fe->start >= end)
+            break;
+        from = max(fe->start, first);
+        to = min(fe->start + fe->len, end);
+        if (to < from + minlen)
+            continue;
+        ret = __blkdev_issue_discard(sb->s_bdev, (base + from) << shift, (sector_t)(to - from) << shift, GFP_NOFS, 0, &bio);
+        if (!ret)
+            *trimmed += to - from;
+    }
+    if (bio) {
+        err = submit_bio_wait(bio);
+        if (!ret && err != -EOPNOTSUPP)
+            ret = err;
+        bio_put(bio);
+    }
+    blk_finish_plug(&plug);
+    mutex_unlock(&gi->lock);
+    return ret;
+}
+
+static long assoofs_ioc_trim(struct file *file, struct fstrim_range __user *arg) {
+    struct super_block *sb = file_inode(file)->i_sb;
+    struct request_queue *q = bdev_get_queue(sb->s_bdev);
+    struct assoofs_super_block_info *asb = ASSOOFS_SB(sb);
+    unsigned int bits = sb->s_blocksize_bits, g, minlen;
+    uint64_t start, end, first, trimmed = 0;
+    struct fstrim_range range;
+    int ret = 0;
+
+    if (!capable(CAP_SYS_ADMIN))
+        return -EPERM;
+    if (!blk_queue_discard(q))
+        return -EOPNOTSUPP;
+    if (copy_from_user(&range, arg, sizeof(range)))
+        return -EFAULT;
+    minlen = max_t(u64, DIV_ROUND_UP(max_t(u64, range.minlen, q->limits.discard_granularity), sb->s_blocksize), 1);
+    start = max_t(u64, range.start >> bits, asb->first_group_block);
+    if (minlen > asb->blocks_per_group || start >= asb->blocks_count || range.len < sb->s_blocksize)
+        return -EINVAL;
+    end = range.len >> bits > asb->blocks_count - start ? asb->blocks_count : start + (range.len >> bits);
+
+    for (g = assoofs_block_group(sb, start); g < asb->groups_count; g++) {
+        first = assoofs_group_first_block(sb, g);
+        if (first >= end)
+            break;
+        ret = assoofs_trim_group(sb, g, start > first ? start - first : 0,
+                                 min_t(uint64_t, end - first, assoofs_group_nblocks(sb, g)), minlen, &trimmed);
+        if (ret)
+            break;
+        if (fatal_signal_pending(current)) {
+            ret = -ERESTARTSYS;
+            break;
+        }
+    }
+    assoofs_stat_add(sb, discard_blocks, trimmed);
+    if (ret)
+        return ret;
+    range.len = trimmed << bits;
+    if (copy_to_user(arg, &range, sizeof(range)))
+        return -EFAULT;
+    return 0;
+}
+
+/*
+ *  Contadores de referencias: un byte por bloque del grupo con las referencias de más.
+ *  0 es lo normal (un único dueño); los reflink los suben y assoofs_group_free los baja.
+ */
+static struct buffer_head *assoofs_refcount_bh(struct super_block *sb, uint64_t block, uint8_t **rc) {
+    unsigned int g = assoofs_block_group(sb, block);
+    unsigned int b = block - assoofs_group_first_block(sb, g);
+    struct buffer_head *bh;
+
+    bh = assoofs_bread(sb, assoofs_group_desc(sb, g, NULL)->refcount_table + b / ASSOOFS_DEFAULT_BLOCK_SIZE);
+    if (bh)
+        *rc = (uint8_t *)bh->b_data + b % ASSOOFS_DEFAULT_BLOCK_SIZE;
+    return bh;
+}
+
+// Sin cerrojo: solo los propios dueños del bloque pueden cambiar su contador mientras lo miran
+static bool assoofs_block_shared(struct super_block *sb, uint64_t block) {
+    struct buffer_head *bh;
+    uint8_t *rc;
+    bool shared;
+
+    bh = assoofs_refcount_bh(sb, block, &rc);
+    if (!bh)
+        return true;    // ante la duda, copia en escritura
+    shared = READ_ONCE(*rc) != 0;
+    brelse(bh);
+    return shared;
+}
+
+/*
+ *  Una referencia más a count bloques seguidos (del mismo grupo). Se escribe en el acto:
+ *  un contador que se quede corto tras un corte liberaría un bloque aún en uso.
+ */
+static int assoofs_blocks_get(struct super_block *sb, uint64_t block, unsigned int count) {
+    unsigned int g = assoofs_block_group(sb, block), b, i;
+    struct assoofs_group_info *gi = &ASSOOFS_FS(sb)->groups[g];
+    struct buffer_head *bh = NULL;
+    uint8_t *rc;
+    int ret = 0;
+
+    if (g != assoofs_block_group(sb, block + count - 1))
+        return -EIO;
+    b = block - assoofs_group_first_block(sb, g);
+    mutex_lock(&gi->lock);
+    for (i = 0; i < count; i++) {
+        if (!bh || (b + i) % ASSOOFS_DEFAULT_BLOCK_SIZE == 0) {
+            if (bh)
+                assoofs_sync_bh(sb, bh);
+            brelse(bh);
+            bh = assoofs_refcount_bh(sb, block + i, &rc);
+            if (!bh) {
+                ret = -EIO;
+                break;
+            }
+        }
+        if (*rc == U8_MAX) {
+            ret = -EMLINK;
+            break;
+        }
+        (*rc)++;
+        rc++;
+    }
+    if (bh) {
+        assoofs_sync_bh(sb, bh);
+        brelse(bh);
+    }
+    mutex_unlock(&gi->lock);
+    // Lo que llegara a subirse se devuelve
+    if (ret && i)
+        assoofs_group_free(sb, g, b, i, false, false);
+    return ret;
+}
+
+// Grupo para un inodo nuevo: los ficheros van con su directorio; los directorios se reparten
+static unsigned int assoofs_pick_inode_group(struct inode *dir, umode_t mode) {
+    struct assoofs_fs_info *fs = ASSOOFS_FS(dir->i_sb);
+
+    if (S_ISDIR(mode))
+        return this_cpu_inc_return(*fs->inode_hint) % fs->asb->groups_count;
+    return assoofs_ino_group(dir->i_sb, dir->i_ino);
+}
+
+// Añade el inodo al almacén en un hueco libre del grupo indicado (o del siguiente con sitio)
+int assoofs_add_inode_info(struct super_block *sb, struct assoofs_inode_info *inode, unsigned int group){
+    struct buffer_head *bh;
+    struct assoofs_inode_info *inode_pos;
+    unsigned int g, b;
+    int ret;
+    ret = assoofs_group_alloc_inode(sb, group, S_ISDIR(inode->mode), &g, &b);
+    if (ret) {
+        printk(KERN_ERR "MAXIMUM NUMBER OF OBJECTS EXCEEDED\n");
+        return ret;
+    }
+    inode->inode_no = (uint64_t)g * ASSOOFS_SB(sb)->inodes_per_group + b + 1;
+    inode->orphan_next = 0;
+    bh = assoofs_bread(sb, assoofs_inode_table_block(sb, inode->inode_no));
+    if (!bh) {
+        assoofs_group_free(sb, g, b, 1, true, S_ISDIR(inode->mode));
+        return -EIO;
+    }
+    inode_pos = (struct assoofs_inode_info *)bh->b_data;
+    inode_pos += (inode->inode_no - 1) % ASSOOFS_INODES_PER_BLOCK;
+    memcpy(inode_pos, inode, sizeof(struct assoofs_inode_info));
+    assoofs_sync_bh(sb, bh);
+    brelse(bh);
+    return 0;
+}
+
+static void assoofs_free_inode_slot(struct super_block *sb, uint64_t ino, umode_t mode) {
+    unsigned int ipg = ASSOOFS_SB(sb)->inodes_per_group;
+
+    assoofs_group_free(sb, (ino - 1) / ipg, (ino - 1) % ipg, 1, true, S_ISDIR(mode));
+}
+
+// Hasta want bloques seguidos (al menos uno) cerca de goal; ver assoofs_group_alloc_blocks
+static int assoofs_alloc_blocks(struct super_block *sb, uint64_t goal, unsigned int want, unsigned int hint, bool sync, uint64_t *block, unsigned int *count) {
+    int ret;
+
+    ret = assoofs_group_alloc_blocks(sb, goal, want, hint, sync, block, count);
+    // Lo que espera su descarte aún no se puede asignar: antes de rendirse se espera a que termine
+    if (ret == -ENOSPC && atomic_long_read(&ASSOOFS_FS(sb)->discard_pending)) {
+        flush_delayed_work(&ASSOOFS_FS(sb)->discard_work);
+        ret = assoofs_group_alloc_blocks(sb, goal, want, hint, sync, block, count);
+    }
+    return ret;
+}
+
+static int assoofs_alloc_block_near(struct super_block *sb, uint64_t goal, bool sync, uint64_t *block) {
+    unsigned int count;
+
+    // Escribimos el bloque reservado en la direcci ́on indicada como último argumento
+    return assoofs_alloc_blocks(sb, goal, 1, 1, sync, block, &count);
+}
+
+// Reserva un bloque lo más cerca posible de goal (normalmente el grupo del inodo)
+int assoofs_sb_get_a_freeblock(struct super_block *sb, uint64_t goal, uint64_t *block){
+    return assoofs_alloc_block_near(sb, goal, true, block);
+}
+
+// Bloques de ficheros regulares: el mapa se escribe con la writeback, como los propios datos
+static int assoofs_alloc_data_block(struct super_block *sb, uint64_t goal, uint64_t *block) {
+    return assoofs_alloc_block_near(sb, goal, false, block);
+}
+
+// Devuelve count bloques seguidos al mapa de bloques libres de su grupo
+static void assoofs_sb_free_blocks(struct super_block *sb, uint64_t block, unsigned int count) {
+    unsigned int g;
+
+    if (block < ASSOOFS_SB(sb)->first_group_block || block + count > ASSOOFS_SB(sb)->blocks_count ||
+        assoofs_block_group(sb, block) != assoofs_block_group(sb, block + count - 1)) {
+        printk(KERN_ERR "assoofs: refusing to free blocks %llu-%llu\n", block, block + count - 1);
+        return;
+    }
+    g = assoofs_block_group(sb, block);
+    assoofs_group_free(sb, g, block - assoofs_group_first_block(sb, g), count, false, false);
+}
+
+static void assoofs_sb_free_block(struct super_block *sb, uint64_t block) {
+    assoofs_sb_free_blocks(sb, block, 1);
+}
+
+/*
+ *  Bloques de paquetes. La cabecera de cada uno, en disco, dice qué trozos están ocupados;
+ *  fs->packs recuerda los que tienen sitio para no tener que buscarlos, con su mapa de
+ *  trozos como valor. Tras montar está vacío: los bloques que ya había vuelven a él
+ *  cuando se suelta algo en ellos.
+ */
+#define ASSOOFS_PACK_SCAN 64    /* bloques con sitio mirados antes de empezar uno nuevo */
+
+// Primer trozo de una tanda de n libres en el mapa used, ASSOOFS_PACK_SLOTS si no la hay
+static unsigned int assoofs_pack_fit(unsigned int used, unsigned int n) {
+    unsigned int mask = (1U << n) - 1, i;
+
+    for (i = 1; i + n <= ASSOOFS_PACK_SLOTS; i++) {
+        if (!(used & (mask << i)))
+            return i;
+    }
+    return ASSOOFS_PACK_SLOTS;
+}
+
+// Bloque de fs->packs entre from y to con n trozos libres seguidos, 0 si no hay
+static unsigned long assoofs_pack_find(struct assoofs_fs_info *fs, unsigned long from, unsigned long to, unsigned int n, unsigned int *scanned) {
+    unsigned long index = from;
+    void *entry;
+
+    for (entry = xa_find(&fs->packs, &index, to, XA_PRESENT); entry && *scanned < ASSOOFS_PACK_SCAN;
+         entry = xa_find_after(&fs->packs, &index, to, XA_PRESENT)) {
+        (*scanned)++;
+        if (assoofs_pack_fit(xa_to_value(entry), n) < ASSOOFS_PACK_SLOTS)
+            return index;
+    }
+    return 0;
+}
+
+// Reserva size bytes (múltiplo de ASSOOFS_PACK_SLOT) en un bloque de paquetes, el primero con sitio desde goal
+static int assoofs_pack_alloc(struct super_block *sb, uint64_t goal, unsigned int size, uint64_t *block, unsigned int *offset) {
+    struct assoofs_fs_info *fs = ASSOOFS_FS(sb);
+    unsigned int n = size / ASSOOFS_PACK_SLOT, scanned = 0, first;
+    struct assoofs_pack_header *ph;
+    struct buffer_head *bh;
+    unsigned long index;
+    int ret = 0;
+
+    mutex_lock(&fs->pack_lock);
+    index = assoofs_pack_find(fs, goal, ULONG_MAX, n, &scanned);
+    if (!index)
+        index = assoofs_pack_find(fs, 0, goal, n, &scanned);
+    if (index) {
+        bh = assoofs_bread(sb, index);
+        if (!bh) {
+            ret = -EIO;
+            goto out;
+        }
+    } else {
+        // Ninguno conocido tiene sitio: bloque nuevo con solo la cabecera
+        ret = assoofs_sb_get_a_freeblock(sb, goal, block);
+        if (ret)
+            goto out;
+        index = *block;
+        bh = sb_getblk(sb, index);
+        if (!bh) {
+            assoofs_sb_free_block(sb, index);
+            ret = -EIO;
+            goto out;
+        }
+        lock_buffer(bh);
+        memset(bh->b_data, 0, bh->b_size);
+        ph = (struct assoofs_pack_header *)bh->b_data;
+        ph->magic = ASSOOFS_PACK_MAGIC;
+        ph->used = 1;
+        set_buffer_uptodate(bh);
+        unlock_buffer(bh);
+    }
+    ph = (struct assoofs_pack_header *)bh->b_data;
+    first = assoofs_pack_fit(ph->used, n);
+    if (ph->magic != ASSOOFS_PACK_MAGIC || first >= ASSOOFS_PACK_SLOTS) {
+        printk(KERN_ERR "assoofs: pack block %lu does not match its header, forgetting it\n", index);
+        xa_erase(&fs->packs, index);
+        brelse(bh);
+        ret = -EIO;
+        goto out;
+    }
+    lock_buffer(bh);
+    ph->used |= ((1U << n) - 1) << first;
+    unlock_buffer(bh);
+    // Si no hay memoria para apuntarlo solo se pierde el atajo: la cabecera manda
+    if (assoofs_pack_fit(ph->used, 1) < ASSOOFS_PACK_SLOTS)
+        xa_store(&fs->packs, index, xa_mk_value(ph->used), GFP_NOFS);
+    else
+        xa_erase(&fs->packs, index);
+    assoofs_dirty_bh(sb, bh);
+    brelse(bh);
+    *block = index;
+    *offset = first * ASSOOFS_PACK_SLOT;
+out:
+    mutex_unlock(&fs->pack_lock);
+    return ret;
+}
+
+// Suelta los trozos [offset, offset + size) de block; sin ninguno ocupado, el bloque vuelve a estar libre
+static void assoofs_pack_free(struct super_block *sb, uint64_t block, unsigned int offset, unsigned int size) {
+    struct assoofs_fs_info *fs = ASSOOFS_FS(sb);
+    struct assoofs_pack_header *ph = NULL;
+    struct buffer_head *bh = NULL;
+    uint16_t mask = 0;
+
+    mutex_lock(&fs->pack_lock);
+    if (offset && size && offset + size <= ASSOOFS_DEFAULT_BLOCK_SIZE) {
+        mask = ASSOOFS_PACK_MASK(offset, size);
+        bh = assoofs_bread(sb, block);
+    }
+    if (bh)
+        ph = (struct assoofs_pack_header *)bh->b_data;
+    if (!ph || ph->magic != ASSOOFS_PACK_MAGIC || (ph->used & mask) != mask) {
+        printk(KERN_ERR "assoofs: bad pack slots %u-%u in block %llu, leaking them\n", offset, offset + size - 1, block);
+        brelse(bh);
+        mutex_unlock(&fs->pack_lock);
+        return;
+    }
+    lock_buffer(bh);
+    ph->used &= ~mask;
+    unlock_buffer(bh);
+    if (ph->used != 1) {
+        xa_store(&fs->packs, block, xa_mk_value(ph->used), GFP_NOFS);
+        assoofs_dirty_bh(sb, bh);
+        brelse(bh);
+        mutex_unlock(&fs->pack_lock);
+        return;
+    }
+    xa_erase(&fs->packs, block);
+    bforget(bh);
+    mutex_unlock(&fs->pack_lock);
+    // Si vuelve a usarse para datos de un fichero, que no quede aquí una copia vieja
+    assoofs_defrag_settle(sb, block, 1, false);
+    assoofs_sb_free_block(sb, block);
+}
+
+/*
+ *  Con map_sem para escribir: el fichero deja de caber en su paquete. Los datos se copian
+ *  a un bloque propio, que pasa a ser el bloque 0 de su mapa de extents; si la página 0
+ *  en caché es más nueva, su writeback la escribirá encima.
+ */
+static int assoofs_pack_unpack(struct inode *inode) {
+    struct super_block *sb = inode->i_sb;
+    struct assoofs_inode *ai = ASSOOFS_I(inode);
+    uint64_t old = ai->info.pack_block, block;
+    unsigned int offset = ai->info.pack_offset, size = ai->info.pack_size;
+    struct buffer_head *src, *dst;
+    int ret;
+
+    if (!(ai->info.flags & ASSOOFS_INODE_PACKED))
+        return 0;
+    src = assoofs_bread(sb, old);
+    if (!src)
+        return -EIO;
+    ret = assoofs_alloc_data_block(sb, assoofs_extent_goal(inode, 0), &block);
+    if (ret) {
+        brelse(src);
+        return ret;
+    }
+    dst = sb_getblk(sb, block);
+    if (!dst) {
+        brelse(src);
+        assoofs_sb_free_block(sb, block);
+        return -EIO;
+    }
+    lock_buffer(dst);
+    memset(dst->b_data, 0, dst->b_size);
+    memcpy(dst->b_data, src->b_data + offset, min_t(unsigned int, ai->info.pack_len, size));
+    set_buffer_uptodate(dst);
+    unlock_buffer(dst);
+    brelse(src);
+    // Los datos en disco antes que el mapa que apunta a ellos; después se leen por la caché del fichero
+    ret = assoofs_sync_bh(sb, dst);
+    brelse(dst);
+    assoofs_defrag_settle(sb, block, 1, false);
+    if (ret) {
+        assoofs_sb_free_block(sb, block);
+        return ret;
+    }
+    ai->info.flags &= ~ASSOOFS_INODE_PACKED;
+    memset(ai->info.extents, 0, sizeof(ai->info.extents));
+    // Sin extents antes, el primero cabe en el inodo y no puede fallar
+    assoofs_extent_insert(inode, 0, block, 1);
+    assoofs_pack_free(sb, old, offset, size);
+    assoofs_stat_inc(sb, pack_unpacks);
+    return 0;
+}
+
+/*
+ *  Entradas de directorio
+ */
+static int assoofs_add_dirent(struct inode *dir, const struct qstr *name, uint64_t ino) {
+    struct super_block *sb = dir->i_sb;
+    struct assoofs_inode_info *parent_inode_info = dir->i_private;
+    struct assoofs_dir_record_entry *dir_contents;
+    struct buffer_head *bh;
+
+    if (parent_inode_info->dir_children_count >= ASSOOFS_MAX_DIR_ENTRIES)
+        return -ENOSPC;
+    bh = assoofs_bread(sb, parent_inode_info->data_block_number);
+    if (!bh)
+        return -EIO;
+    dir_contents = (struct assoofs_dir_record_entry *)bh->b_data;
+    dir_contents += parent_inode_info->dir_children_count;
+    memset(dir_contents, 0, sizeof(*dir_contents));
+    dir_contents->inode_no = ino;
+    memcpy(dir_contents->filename, name->name, name->len);
+    assoofs_sync_bh(sb, bh);
+    brelse(bh);
+    if (ASSOOFS_I(dir)->dir_index && assoofs_dir_index_insert(ASSOOFS_I(dir)->dir_index, name->name, name->len, ino))
+        assoofs_dir_index_drop(dir);
+
+    //ACTUALIZAR LA INFORMACON DEL INODO PADRE INDICANDO QUE AHORA TIENE UN ARCHIVO MAS
+    parent_inode_info->dir_children_count++;
+    dir->i_mtime = dir->i_ctime = current_time(dir);
+    return assoofs_save_inode_info(sb, parent_inode_info);
+}
+
+// Quita la entrada moviendo la última a su hueco, así el bloque sigue compacto
+static int assoofs_remove_dirent(struct inode *dir, const struct qstr *name) {
+    struct super_block *sb = dir->i_sb;
+    struct assoofs_inode_info *parent_inode_info = dir->i_private;
+    struct assoofs_dir_record_entry *record, *last;
+    struct buffer_head *bh;
+    uint64_t i;
+
+    bh = assoofs_bread(sb, parent_inode_info->data_block_number);
+    if (!bh)
+        return -EIO;
+    record = (struct assoofs_dir_record_entry *)bh->b_data;
+    last = record + parent_inode_info->dir_children_count - 1;
+    for (i = 0; i < parent_inode_info->dir_children_count; i++, record++) {
+        if (!strcmp(record->filename, name->name))
+            break;
+    }
+    if (i == parent_inode_info->dir_children_count) {
+        brelse(bh);
+        return -ENOENT;
+    }
+    if (record != last)
+        memcpy(record, last, sizeof(*record));
+    memset(last, 0, sizeof(*last));
+    assoofs_sync_bh(sb, bh);
+    brelse(bh);
+    if (ASSOOFS_I(dir)->dir_index) {
+        struct assoofs_dir_name *dn = assoofs_dir_index_find(ASSOOFS_I(dir)->dir_index, name->name, name->len, assoofs_name_hash(name->name, name->len));
+        // El filtro no admite borrados: sus bits se quedan y como mucho dan algún falso positivo
+        if (dn) {
+            hlist_del(&dn->node);
+            kfree(dn);
+        }
+    }
+
+    parent_inode_info->dir_children_count--;
+    dir->i_mtime = dir->i_ctime = current_time(dir);
+    return assoofs_save_inode_info(sb, parent_inode_info);
+}
+
+static int assoofs_orphan_add(struct super_block *sb, uint64_t ino);
+
+// Destinos largos: van a un bloque de datos propio
+static int assoofs_write_symlink_block(struct super_block *sb, uint64_t block, const char *symname, size_t len) {
+    struct buffer_head *bh;
+
+    bh = sb_getblk(sb, block);
+    if (!bh)
+        return -EIO;
+    lock_buffer(bh);
+    memset(bh->b_data, 0, bh->b_size);
+    memcpy(bh->b_data, symname, len);
+    set_buffer_uptodate(bh);
+    unlock_buffer(bh);
+    assoofs_sync_bh(sb, bh);
+    brelse(bh);
+    return 0;
+}
+
+static const char *assoofs_get_link(struct dentry *dentry, struct inode *inode, struct delayed_call *done) {
+    struct assoofs_inode_info *inode_info = inode->i_private;
+    struct buffer_head *bh;
+    char *link;
+
+    if (!dentry)
+        return ERR_PTR(-ECHILD);
+    bh = assoofs_bread(inode->i_sb, inode_info->data_block_number);
+    if (!bh)
+        return ERR_PTR(-EIO);
+    link = kmemdup_nul(bh->b_data, inode_info->file_size, GFP_KERNEL);
+    brelse(bh);
+    if (!link)
+        return ERR_PTR(-ENOMEM);
+    set_delayed_call(done, kfree_link, link);
+    return link;
+}
+
+static int assoofs_new_inode(struct inode *dir, struct dentry *dentry, umode_t mode, const char *symname) {
+    struct inode *inode;
+    struct super_block *sb;
+    struct assoofs_inode_info *inode_info;
+    unsigned int group;
+    int ret;
+    // obtengo un puntero al superbloque desde dir
+    sb = dir->i_sb;
+    if (dentry->d_name.len >= ASSOOFS_FILENAME_MAXLEN)
+        return -ENAMETOOLONG;
+    if (((struct assoofs_inode_info *)dir->i_private)->dir_children_count >= ASSOOFS_MAX_DIR_ENTRIES)
+        return -ENOSPC;
+
+    //CREACION NUEVO INODO
+    inode = new_inode(sb);
+    if (!inode)
+        return -ENOMEM;
+    inode_info = assoofs_alloc_inode_info();
+    if (!inode_info) {
+        iput(inode);
+        return -ENOMEM;
+    }
+    inode_info->mode = mode; // El segundo mode me llega como argumento
+    inode_info->links_count = 1;
+    inode_info->file_size = symname ? strlen(symname) : 0; // o dir_children_count = 0 para directorios
+    group = assoofs_pick_inode_group(dir, mode);
+    if (S_ISREG(mode)) {
+        // Los ficheros regulares reservan sus bloques al escribir (assoofs_get_block)
+    } else if (assoofs_inode_is_inline(inode_info)) {
+        memcpy(inode_info->inline_symlink, symname, inode_info->file_size + 1);
+    } else {
+        ret = assoofs_sb_get_a_freeblock(sb, assoofs_group_first_block(sb, group), &inode_info->data_block_number);
+        if (!ret && symname)
+            ret = assoofs_write_symlink_block(sb, inode_info->data_block_number, symname, inode_info->file_size);
+        if (ret) {
+            assoofs_free_inode_info(inode_info);
+            iput(inode);
+            return ret;
+        }
+    }
+    ret = assoofs_add_inode_info(sb, inode_info, group);// Asigno n ́umero al nuevo inodo: un hueco libre del almacén del grupo
+    if (ret) {
+        if (assoofs_inode_has_block(inode_info))
+            assoofs_sb_free_block(sb, inode_info->data_block_number);
+        assoofs_free_inode_info(inode_info);
+        iput(inode);
+        return ret;
+    }
+    inode->i_ino = inode_info->inode_no;
+    insert_inode_hash(inode);
+    inode->i_private = inode_info;
+    inode_init_owner(inode, dir, mode);
+    assoofs_set_inode_ops(inode, inode_info);
+    inode->i_atime = inode->i_mtime = inode->i_ctime = current_time(inode);
+
+    //MODIFICAR EL CONTENIDO DEL DIRECTORIO PADRE  ADJUNTANDO UNA NUEVA ENTRADA PARA EL NUEVO FICHERO O DIRECTORIO
+    ret = assoofs_add_dirent(dir, &dentry->d_name, inode_info->inode_no);
+    if (ret) {
+        // El inodo no llegó a enlazarse: queda huérfano y al soltarlo lo recoge assoofs_evict_inode
+        assoofs_orphan_add(sb, inode_info->inode_no);
+        clear_nlink(inode);
+        iput(inode);
+        return ret;
+    }
+    d_instantiate(dentry, inode);
+    return 0;
+}
+
+static int assoofs_create(struct inode *dir, struct dentry *dentry, umode_t mode, bool excl) {
+    printk(KERN_INFO "New file request\n");
+    return assoofs_new_inode(dir, dentry, S_IFREG | mode, NULL);
+}
+
+static int assoofs_mkdir(struct inode *dir , struct dentry *dentry, umode_t mode) {
+    printk(KERN_INFO "New directory request\n");
+    return assoofs_new_inode(dir, dentry, S_IFDIR | mode, NULL);
+}
+
+static int assoofs_symlink(struct inode *dir, struct dentry *dentry, const char *symname) {
+    if (strlen(symname) >= ASSOOFS_DEFAULT_BLOCK_SIZE)
+        return -ENAMETOOLONG;
+    return assoofs_new_inode(dir, dentry, S_IFLNK | 0777, symname);
+}
+
+static int assoofs_link(struct dentry *old_dentry, struct inode *dir, struct dentry *dentry) {
+    struct inode *inode = d_inode(old_dentry);
+    struct assoofs_inode_info *inode_info = inode->i_private;
+    int ret;
+
+    if (dentry->d_name.len >= ASSOOFS_FILENAME_MAXLEN)
+        return -ENAMETOOLONG;
+    ret = assoofs_add_dirent(dir, &dentry->d_name, inode->i_ino);
+    if (ret)
+        return ret;
+    inode->i_ctime = current_time(inode);
+    inc_nlink(inode);
+    inode_info->links_count = inode->i_nlink;
+    ret = assoofs_save_inode_info(dir->i_sb, inode_info);
+    if (ret) {
+        // Sin el contador al día en el disco la entrada nueva no puede quedarse
+        drop_nlink(inode);
+        inode_info->links_count = inode->i_nlink;
+        assoofs_remove_dirent(dir, &dentry->d_name);
+        return ret;
+    }
+    ihold(inode);
+    d_instantiate(dentry, inode);
+    return 0;
+}
+
+/*
+ *  Borrado: la entrada desaparece al momento y el inodo queda huérfano.
+ *  Sus bloques y su hueco en el almacén de inodos se liberan en segundo plano.
+ */
+static struct assoofs_inode_info *assoofs_raw_inode(struct super_block *sb, uint64_t ino, struct buffer_head **bhp) {
+    struct assoofs_inode_info search = { .inode_no = ino };
+    struct assoofs_inode_info *raw;
+    struct buffer_head *bh;
+
+    if (!ino || ino > assoofs_inodes_total(sb))
+        return NULL;
+    bh = assoofs_bread(sb, assoofs_inode_table_block(sb, ino));
+    if (!bh)
+        return NULL;
+    raw = assoofs_search_inode_info(sb, (struct assoofs_inode_info *)bh->b_data, &search);
+    if (!raw) {
+        brelse(bh);
+        return NULL;
+    }
+    *bhp = bh;
+    return raw;
+}
+
+// Primero se escribe el enlace del inodo y después la cabeza de la lista: un corte entre ambas no deja la lista rota
+static int assoofs_orphan_add(struct super_block *sb, uint64_t ino) {
+    struct assoofs_fs_info *fs = ASSOOFS_FS(sb);
+    struct assoofs_inode_info *raw;
+    struct buffer_head *bh;
+
+    mutex_lock(&fs->lock);
+    raw = assoofs_raw_inode(sb, ino, &bh);
+    if (!raw) {
+        mutex_unlock(&fs->lock);
+        return -EIO;
+    }
+    raw->orphan_next = fs->asb->orphan_head;
+    assoofs_sync_bh(sb, bh);
+    brelse(bh);
+    fs->asb->orphan_head = ino;
+    assoofs_save_sb_info(sb);
+    mutex_unlock(&fs->lock);
+    return 0;
+}
+
+// Se llama con fs->lock tomado
+static void assoofs_orphan_del(struct super_block *sb, uint64_t ino, uint64_t next) {
+    struct assoofs_fs_info *fs = ASSOOFS_FS(sb);
+    struct assoofs_inode_info *raw;
+    struct buffer_head *bh;
+    uint64_t prev = fs->asb->orphan_head;
+
+    if (prev == ino) {
+        fs->asb->orphan_head = next;
+        assoofs_save_sb_info(sb);
+        return;
+    }
+    while (prev) {
+        raw = assoofs_raw_inode(sb, prev, &bh);
+        if (!raw)
+            break;
+        if (raw->orphan_next == ino) {
+            raw->orphan_next = next;
+            assoofs_sync_bh(sb, bh);
+            brelse(bh);
+            return;
+        }
+        prev = raw->orphan_next;
+        brelse(bh);
+    }
+    printk(KERN_ERR "assoofs: inode %llu not found in orphan list\n", ino);
+}
+
+// Libera los bloques de datos y el hueco del inodo, y lo saca de la lista de huérfanos
+static void assoofs_reclaim_inode(struct super_block *sb, uint64_t ino) {
+    struct assoofs_fs_info *fs = ASSOOFS_FS(sb);
+    struct assoofs_inode_info *raw, old;
+    struct buffer_head *bh;
+    uint64_t next;
+
+    mutex_lock(&fs->lock);
+    raw = assoofs_raw_inode(sb, ino, &bh);
+    if (!raw) {
+        mutex_unlock(&fs->lock);
+        return;
+    }
+    next = raw->orphan_next;
+    assoofs_orphan_del(sb, ino, next);
+    old = *raw;
+    memset(raw, 0, sizeof(*raw));
+    assoofs_sync_bh(sb, bh);
+    brelse(bh);
+    mutex_unlock(&fs->lock);
+    // Los mapas van con el cerrojo de su grupo, no con el de huérfanos
+    if (S_ISREG(old.mode))
+        assoofs_extent_free_all(sb, &old);
+    else if (assoofs_inode_has_block(&old))
+        assoofs_sb_free_block(sb, old.data_block_number);
+    assoofs_free_inode_slot(sb, ino, old.mode);
+}
+
+struct assoofs_reclaim {
+    struct list_head list;
+    uint64_t inode_no;
+};
+
+static void assoofs_reclaim_work(struct work_struct *work) {
+    struct assoofs_fs_info *fs = container_of(work, struct assoofs_fs_info, reclaim_work);
+    struct assoofs_reclaim *r, *tmp;
+    LIST_HEAD(batch);
+
+    spin_lock(&fs->reclaim_lock);
+    list_splice_init(&fs->reclaim_list, &batch);
+    spin_unlock(&fs->reclaim_lock);
+
+    list_for_each_entry_safe(r, tmp, &batch, list) {
+        assoofs_reclaim_inode(fs->sb, r->inode_no);
+        list_del(&r->list);
+        kfree(r);
+    }
+}
+
+static void assoofs_queue_reclaim(struct super_block *sb, uint64_t ino) {
+    struct assoofs_fs_info *fs = ASSOOFS_FS(sb);
+    struct assoofs_reclaim *r;
+
+    r = kmalloc(sizeof(*r), GFP_NOFS);
+    if (!r) {
+        // Sigue en la lista de huérfanos: se recogerá en el próximo montaje
+        printk(KERN_ERR "assoofs: no memory to reclaim inode %llu\n", ino);
+        return;
+    }
+    r->inode_no = ino;
+    spin_lock(&fs->reclaim_lock);
+    list_add_tail(&r->list, &fs->reclaim_list);
+    spin_unlock(&fs->reclaim_lock);
+    queue_work(system_unbound_wq, &fs->reclaim_work);
+}
+
+// Recorre la lista de huérfanos que dejó un montaje anterior interrumpido
+static void assoofs_process_orphans(struct super_block *sb) {
+    struct assoofs_inode_info *raw;
+    struct buffer_head *bh;
+    uint64_t ino = ASSOOFS_SB(sb)->orphan_head;
+    int n = 0;
+
+    while (ino && n++ < assoofs_inodes_total(sb)) {
+        raw = assoofs_raw_inode(sb, ino, &bh);
+        if (!raw)
+            break;
+        assoofs_queue_reclaim(sb, ino);
+        ino = raw->orphan_next;
+        brelse(bh);
+    }
+    if (n)
+        printk(KERN_INFO "assoofs: reclaiming %d orphan inodes\n", n);
+}
+
+static int assoofs_unlink(struct inode *dir, struct dentry *dentry) {
+    struct inode *inode = d_inode(dentry);
+    int ret;
+
+    ret = assoofs_remove_dirent(dir, &dentry->d_name);
+    if (ret)
+        return ret;
+    inode->i_ctime = dir->i_ctime;
+    drop_nlink(inode);
+    if (inode->i_nlink) {
+        ((struct assoofs_inode_info *)inode->i_private)->links_count = inode->i_nlink;
+        return assoofs_save_inode_info(dir->i_sb, inode->i_private);
+    }
+    return assoofs_orphan_add(dir->i_sb, inode->i_ino);
+}
+
+static int assoofs_rmdir(struct inode *dir, struct dentry *dentry) {
+    struct inode *inode = d_inode(dentry);
+    struct assoofs_inode_info *inode_info = inode->i_private;
+    int ret;
+
+    if (inode_info->dir_children_count)
+        return -ENOTEMPTY;
+    ret = assoofs_remove_dirent(dir, &dentry->d_name);
+    if (ret)
+        return ret;
+    inode->i_ctime = dir->i_ctime;
+    clear_nlink(inode);
+    return assoofs_orphan_add(dir->i_sb, inode->i_ino);
+}
+
+// Última referencia al inodo: si ya no tiene enlaces se encola su liberación
+static void assoofs_evict_inode(struct inode *inode) {
+    struct assoofs_inode *ai = ASSOOFS_I(inode);
+
+    // Fuera del LRU antes de nada: a partir de aquí el shrinker ya no llega a este inodo
+    if (ai)
+        assoofs_cache_del(inode);
+    truncate_inode_pages_final(&inode->i_data);
+    // La liberación lee el mapa de extents de disco: tiene que incluir lo reservado desde la última writeback
+    if (!inode->i_nlink && ai && S_ISREG(ai->info.mode)) {
+        assoofs_extent_write(inode->i_sb, ai, true);
+        assoofs_save_inode_info(inode->i_sb, &ai->info);
+    }
+    clear_inode(inode);
+    if (!inode->i_nlink && inode->i_private)
+        assoofs_queue_reclaim(inode->i_sb, inode->i_ino);
+}
+
+// Tras el periodo de gracia RCU: un recorrido de rutas en modo RCU aún puede leer i_link
+void assoofs_free_inode(struct inode *inode) {
+    struct assoofs_inode *inode_info = inode->i_private;
+    printk(KERN_INFO "Freeing private data of inode %p ( %lu)\n", inode_info, inode->i_ino);
+    if (inode_info) {
+        assoofs_dir_index_free(inode_info->dir_index);
+        assoofs_free_inode_info(&inode_info->info);
+    }
+    free_inode_nonrcu(inode);
+}
+
+/*
+ *  Contadores por montaje en /sys/fs/assoofs/<dev>/
+ */
+static struct kobject *assoofs_kobj_root;
+
+struct assoofs_attr {
+    struct attribute attr;
+    size_t offset;          /* campo dentro de struct assoofs_stats */
+};
+
+#define ASSOOFS_STAT_ATTR(_name)                                    \
+static struct assoofs_attr assoofs_attr_##_name = {                 \
+    .attr = { .name = __stringify(_name), .mode = 0444 },           \
+    .offset = offsetof(struct assoofs_stats, _name),                \
+}
+
+ASSOOFS_STAT_ATTR(block_reads);
+ASSOOFS_STAT_ATTR(block_writes);
+ASSOOFS_STAT_ATTR(readahead_blocks);
+ASSOOFS_STAT_ATTR(sync_write_ns);
+ASSOOFS_STAT_ATTR(lookup_hits);
+ASSOOFS_STAT_ATTR(lookup_misses);
+ASSOOFS_STAT_ATTR(lookup_bloom_rejects);
+ASSOOFS_STAT_ATTR(alloc_calls);
+ASSOOFS_STAT_ATTR(alloc_scan_bits);
+ASSOOFS_STAT_ATTR(bytes_read);
+ASSOOFS_STAT_ATTR(bytes_written);
+ASSOOFS_STAT_ATTR(writeback_pages);
+ASSOOFS_STAT_ATTR(defrag_blocks);
+ASSOOFS_STAT_ATTR(discard_blocks);
+ASSOOFS_STAT_ATTR(cache_shrunk);
+ASSOOFS_STAT_ATTR(pack_stores);
+ASSOOFS_STAT_ATTR(pack_unpacks);
+
+static struct attribute *assoofs_stat_attrs[] = {
+    &assoofs_attr_block_reads.attr,
+    &assoofs_attr_block_writes.attr,
+    &assoofs_attr_readahead_blocks.attr,
+    &assoofs_attr_sync_write_ns.attr,
+    &assoofs_attr_lookup_hits.attr,
+    &assoofs_attr_lookup_misses.attr,
+    &assoofs_attr_lookup_bloom_rejects.attr,
+    &assoofs_attr_alloc_calls.attr,
+    &assoofs_attr_alloc_scan_bits.attr,
+    &assoofs_attr_bytes_read.attr,
+    &assoofs_attr_bytes_written.attr,
+    &assoofs_attr_writeback_pages.attr,
+    &assoofs_attr_defrag_blocks.attr,
+    &assoofs_attr_discard_blocks.attr,
+    &assoofs_attr_cache_shrunk.attr,
+    &assoofs_attr_pack_stores.attr,
+    &assoofs_attr_pack_unpacks.attr,
+    NULL,
+};
+ATTRIBUTE_GROUPS(assoofs_stat);
+
+static ssize_t assoofs_attr_show(struct kobject *kobj, struct attribute *attr, char *buf) {
+    struct assoofs_fs_info *fs = container_of(kobj, struct assoofs_fs_info, kobj);
+    struct assoofs_attr *a = container_of(attr, struct assoofs_attr, attr);
+    u64 sum = 0;
+    int cpu;
+
+    // Solo se suman las copias de cada CPU al leer; la ruta caliente nunca comparte líneas de caché
+    for_each_possible_cpu(cpu)
+        sum += *(u64 *)((char *)per_cpu_ptr(fs->stats, cpu) + a->offset);
+    return sprintf(buf, "%llu\n", sum);
+}
+
+static const struct sysfs_ops assoofs_attr_ops = {
+    .show = assoofs_attr_show,
+};
+
+static void assoofs_kobj_release(struct kobject *kobj) {
+    struct assoofs_fs_info *fs = container_of(kobj, struct assoofs_fs_info, kobj);
+    complete(&fs->kobj_unregister);
+}
+
+static struct kobj_type assoofs_sb_ktype = {
+    .default_groups = assoofs_stat_groups,
+    .sysfs_ops      = &assoofs_attr_ops,
+    .release        = assoofs_kobj_release,
+};
+
+static int assoofs_sysfs_register(struct super_block *sb) {
+    struct assoofs_fs_info *fs = ASSOOFS_FS(sb);
+    int ret;
+
+    init_completion(&fs->kobj_unregister);
+    ret = kobject_init_and_add(&fs->kobj, &assoofs_sb_ktype, assoofs_kobj_root, "%s", sb->s_id);
+    if (ret) {
+        kobject_put(&fs->kobj);
+        wait_for_completion(&fs->kobj_unregister);
+    }
+    return ret;
+}
+
+static void assoofs_sysfs_unregister(struct super_block *sb) {
+    struct assoofs_fs_info *fs = ASSOOFS_FS(sb);
+
+    kobject_del(&fs->kobj);
+    kobject_put(&fs->kobj);
+    wait_for_completion(&fs->kobj_unregister);
+}
+
+/*
+ *  Operaciones sobre el superbloque
+ */
+static void assoofs_free_fs_info(struct super_block *sb) {
+    struct assoofs_fs_info *fs = ASSOOFS_FS(sb);
+    unsigned int i;
+
+    if (fs->gdt_bh) {
+        for (i = 0; i < fs->gdt_blocks; i++)
+            brelse(fs->gdt_bh[i]);
+        kfree(fs->gdt_bh);
+    }
+    if (fs->groups) {
+        for (i = 0; i < fs->asb->groups_count; i++)
+            assoofs_fext_destroy(&fs->groups[i]);
+    }
+    kfree(fs->groups);
+    percpu_counter_destroy(&fs->free_blocks);
+    percpu_counter_destroy(&fs->free_inodes);
+    list_lru_destroy(&fs->cache_lru);
+    xa_destroy(&fs->packs);
+    kvfree(fs->sealed);
+    free_percpu(fs->inode_hint);
+    free_percpu(fs->stats);
+    brelse(fs->sb_bh);
+    kfree(fs);
+    sb->s_fs_info = NULL;
+}
+
+/*
+ *  Al pasar a escritura se quita ASSOOFS_SB_CLEAN y al dejarla se pone con el resumen del
+ *  superbloque, ya con todo lo demás en el disco. Montar de lectura no escribe nada. Si el
+ *  volumen se montó sin la marca, antes de ponerla se comprueban todos los grupos contra sus
+ *  mapas; si alguno no se puede leer se queda sin ella.
+ */
+static void assoofs_set_clean(struct super_block *sb, bool clean) {
+    struct assoofs_fs_info *fs = ASSOOFS_FS(sb);
+    unsigned int g;
+    int ret = 0;
+
+    for (g = 0; clean && fs->unclean && g < fs->asb->groups_count; g++) {
+        mutex_lock(&fs->groups[g].lock);
+        ret = assoofs_group_load(sb, g);
+        mutex_unlock(&fs->groups[g].lock);
+        if (ret) {
+            printk(KERN_ERR "assoofs: cannot check group %u, the volume stays marked in use\n", g);
+            return;
+        }
+    }
+    if (clean && fs->unclean) {
+        // Los arreglos hechos mientras estaba montado de lectura tampoco están aún en el disco
+        for (g = 0; g < fs->gdt_blocks; g++)
+            mark_buffer_dirty(fs->gdt_bh[g]);
+        fs->unclean = false;
+    }
+    if (clean) {
+        sync_blockdev(sb->s_bdev);
+        fs->asb->free_blocks = percpu_counter_sum(&fs->free_blocks);
+        fs->asb->inodes_count = assoofs_inodes_total(sb) - percpu_counter_sum(&fs->free_inodes);
+        fs->asb->flags |= ASSOOFS_SB_CLEAN;
+    } else {
+        fs->asb->flags &= ~ASSOOFS_SB_CLEAN;
+    }
+    assoofs_save_sb_info(sb);
+}
+
+static void assoofs_put_super(struct super_block *sb) {
+    struct assoofs_fs_info *fs = ASSOOFS_FS(sb);
+
+    printk(KERN_INFO "assoofs_put_super request\n");
+    flush_work(&fs->reclaim_work);
+    // Lo último liberado también se descarta antes de soltar el dispositivo
+    flush_delayed_work(&fs->discard_work);
+    // El resumen del superbloque solo se escribe aquí; al montar se recalcula de los grupos
+    if (!sb_rdonly(sb))
+        assoofs_set_clean(sb, true);
+    assoofs_sysfs_unregister(sb);
+    assoofs_free_fs_info(sb);
+}
+
+// Comprueba la geometría de los grupos y retiene la tabla de descriptores en memoria
+static int assoofs_load_groups(struct super_block *sb) {
+    struct assoofs_fs_info *fs = ASSOOFS_FS(sb);
+    struct assoofs_super_block_info *asb = fs->asb;
+    struct assoofs_group_desc *gd;
+    uint64_t dev_blocks = i_size_read(sb->s_bdev->bd_inode) >> sb->s_blocksize_bits;
+    s64 free_blocks = 0, free_inodes = 0;
+    unsigned int i, cpu;
+    int ret;
+
+    if (!asb->groups_count || !asb->blocks_per_group || asb->blocks_per_group > ASSOOFS_MAX_BLOCKS_PER_GROUP ||
+        !asb->inodes_per_group || asb->inodes_per_group > ASSOOFS_BITS_PER_BLOCK ||
+        asb->inodes_per_group % ASSOOFS_INODES_PER_BLOCK ||
+        asb->first_group_block != ASSOOFS_GDT_BLOCK_NUMBER + DIV_ROUND_UP(asb->groups_count, ASSOOFS_DESCS_PER_BLOCK) ||
+        asb->blocks_count > dev_blocks ||
+        asb->first_group_block + (asb->groups_count - 1) * asb->blocks_per_group >= asb->blocks_count) {
+        printk(KERN_ERR "assoofs_fill_super: bad group geometry\n");
+        return -EINVAL;
+    }
+    fs->gdt_blocks = asb->first_group_block - ASSOOFS_GDT_BLOCK_NUMBER;
+    fs->gdt_bh = kcalloc(fs->gdt_blocks, sizeof(*fs->gdt_bh), GFP_KERNEL);
+    fs->groups = kcalloc(asb->groups_count, sizeof(*fs->groups), GFP_KERNEL);
+    if (!fs->gdt_bh || !fs->groups)
+        return -ENOMEM;
+    // La tabla es todo lo que se lee de los grupos al montar: se pide entera de una vez
+    for (i = 0; i < fs->gdt_blocks; i++)
+        assoofs_breadahead(sb, ASSOOFS_GDT_BLOCK_NUMBER + i);
+    for (i = 0; i < fs->gdt_blocks; i++) {
+        fs->gdt_bh[i] = assoofs_bread(sb, ASSOOFS_GDT_BLOCK_NUMBER + i);
+        if (!fs->gdt_bh[i])
+            return -EIO;
+    }
+    for (i = 0; i < asb->groups_count; i++) {
+        gd = assoofs_group_desc(sb, i, NULL);
+        if (gd->free_blocks_count > assoofs_group_nblocks(sb, i) || gd->free_inodes_count > asb->inodes_per_group || !gd->refcount_table) {
+            printk(KERN_ERR "assoofs_fill_super: bad descriptor for group %u\n", i);
+            return -EINVAL;
+        }
+        mutex_init(&fs->groups[i].lock);
+        free_blocks += gd->free_blocks_count;
+        free_inodes += gd->free_inodes_count;
+    }
+    // Los índices de tramos libres se construyen al usar cada grupo (assoofs_group_load)
+    assoofs_readahead_metadata(sb);
+    fs->unclean = !(asb->flags & ASSOOFS_SB_CLEAN);
+    ret = percpu_counter_init(&fs->free_blocks, free_blocks, GFP_KERNEL);
+    if (!ret)
+        ret = percpu_counter_init(&fs->free_inodes, free_inodes, GFP_KERNEL);
+    if (ret)
+        return ret;
+    // Cada CPU arranca su cursor en un grupo distinto
+    for_each_possible_cpu(cpu)
+        *per_cpu_ptr(fs->inode_hint, cpu) = cpu;
+    return 0;
+}
+
+/*
+ *  Writeback de inodos: tamaño y mapa de extents de los ficheros regulares. Los
+ *  directorios y enlaces ya se escriben de forma síncrona al modificarlos.
+ */
+static int assoofs_write_inode(struct inode *inode, struct writeback_control *wbc) {
+    struct assoofs_inode *ai = ASSOOFS_I(inode);
+    bool sync = wbc->sync_mode == WB_SYNC_ALL;
+    struct buffer_head *bh;
+    int ret;
+
+    if (!ai || !S_ISREG(ai->info.mode))
+        return 0;
+    down_read(&ai->map_sem);
+    ai->info.file_size = i_size_read(inode);
+    ret = assoofs_extent_write(inode->i_sb, ai, sync);
+    // En un fsync el paquete llega al disco antes que el inodo que apunta a él
+    if (!ret && sync && (ai->info.flags & ASSOOFS_INODE_PACKED)) {
+        bh = sb_find_get_block(inode->i_sb, ai->info.pack_block);
+        if (bh && buffer_dirty(bh))
+            ret = assoofs_sync_bh(inode->i_sb, bh);
+        brelse(bh);
+    }
+    if (!ret)
+        ret = assoofs_write_inode_info(inode->i_sb, &ai->info, sync);
+    up_read(&ai->map_sem);
+    return ret;
+}
+
+/*
+ *  Un bloque de metadatos que tiene que estar en el medio antes del FUA de fsync: en la primera
+ *  pasada se envía si está sucio y en la segunda se espera. Lo que ya no esté en la caché se
+ *  escribió antes de salir de ella.
+ */
+static int assoofs_fsync_block(struct super_block *sb, sector_t block, bool wait) {
+    struct buffer_head *bh = sb_find_get_block(sb, block);
+    int ret = 0;
+
+    if (!bh)
+        return 0;
+    if (!wait) {
+        write_dirty_buffer(bh, REQ_SYNC);
+    } else {
+        wait_on_buffer(bh);
+        if (!buffer_uptodate(bh))
+            ret = -EIO;
+    }
+    brelse(bh);
+    return ret;
+}
+
+// El mapa de bloques y el descriptor del grupo de un tramo y, si puede estar compartido, sus contadores
+static int assoofs_fsync_run(struct super_block *sb, uint64_t start, uint64_t len, bool shared, bool wait) {
+    unsigned int g = assoofs_block_group(sb, start), last = assoofs_block_group(sb, start + len - 1);
+    struct assoofs_group_desc *gd;
+    uint64_t base, b, from, to;
+    int ret = 0;
+
+    for (; g <= last && !ret; g++) {
+        gd = assoofs_group_desc(sb, g, NULL);
+        ret = assoofs_fsync_block(sb, gd->block_bitmap, wait);
+        if (!ret)
+            ret = assoofs_fsync_block(sb, ASSOOFS_GDT_BLOCK_NUMBER + g / ASSOOFS_DESCS_PER_BLOCK, wait);
+        if (!shared)
+            continue;
+        base = assoofs_group_first_block(sb, g);
+        from = max(start, base) - base;
+        to = min(start + len, base + assoofs_group_nblocks(sb, g)) - base;
+        for (b = from / ASSOOFS_DEFAULT_BLOCK_SIZE; b <= (to - 1) / ASSOOFS_DEFAULT_BLOCK_SIZE && !ret; b++)
+            ret = assoofs_fsync_block(sb, gd->refcount_table + b, wait);
+    }
+    return ret;
+}
+
+/*
+ *  Todo lo que hace falta para que el inodo que llegue al disco no apunte a bloques que el
+ *  disco aún da por libres: el bloque de extents o el paquete y, de cada bloque del fichero,
+ *  el mapa y el descriptor de su grupo (y los contadores si puede haber bloques compartidos).
+ */
+static int assoofs_fsync_meta(struct super_block *sb, struct assoofs_inode *ai, bool wait) {
+    bool shared = ai->info.flags & ASSOOFS_INODE_SHARED;
+    unsigned int i;
+    int ret = 0;
+
+    if (ai->info.flags & ASSOOFS_INODE_PACKED) {
+        if (!ai->info.pack_block)
+            return 0;
+        ret = assoofs_fsync_block(sb, ai->info.pack_block, wait);
+        if (!ret)
+            ret = assoofs_fsync_run(sb, ai->info.pack_block, 1, false, wait);
+        return ret;
+    }
+    if (ai->info.extents_count > ASSOOFS_INLINE_EXTENTS) {
+        ret = assoofs_fsync_block(sb, ai->info.extent_block, wait);
+        if (!ret)
+            ret = assoofs_fsync_run(sb, ai->info.extent_block, 1, false, wait);
+    }
+    for (i = 0; i < ai->info.extents_count && !ret; i++)
+        ret = assoofs_fsync_run(sb, ai->extents[i].start, ai->extents[i].len, shared, wait);
+    return ret;
+}
+
+/*
+ *  fsync y fdatasync: los datos del rango con la writeback de siempre y el inodo con la de
+ *  metadatos, que lo deja en la caché sin I_DIRTY. Después se envían juntos los bloques de los
+ *  que depende y, ya escritos, su bloque del almacén sale el último con FUA, que lleva el único
+ *  flush. fdatasync no toca el inodo si solo han cambiado las fechas. Los directorios ya se
+ *  escriben síncronos al modificarlos: solo les falta el flush.
+ */
+static int assoofs_fsync(struct file *file, loff_t start, loff_t end, int datasync) {
+    struct inode *inode = file->f_mapping->host;
+    struct super_block *sb = inode->i_sb;
+    struct assoofs_inode *ai = ASSOOFS_I(inode);
+    struct buffer_head *bh;
+    int ret;
+
+    ret = file_write_and_wait_range(file, start, end);
+    if (ret || sb_rdonly(sb))
+        return ret;
+    if (S_ISREG(inode->i_mode)) {
+        if (inode->i_state & (datasync ? I_DIRTY_DATASYNC : I_DIRTY_ALL)) {
+            // Sin esperar: assoofs_write_inode solo deja sus bloques sucios en la caché
+            ret = sync_inode_metadata(inode, 0);
+            if (ret)
+                return ret;
+        }
+        ret = assoofs_map_lock(inode, false);
+        if (ret)
+            return ret;
+        ret = assoofs_fsync_meta(sb, ai, false);
+        if (!ret)
+            ret = assoofs_fsync_meta(sb, ai, true);
+        up_read(&ai->map_sem);
+        if (ret)
+            return ret;
+        // El PREFLUSH solo cubre escrituras ya completadas: todo lo anterior, antes
+        bh = sb_find_get_block(sb, assoofs_inode_table_block(sb, inode->i_ino));
+        ret = assoofs_fua_bh(sb, bh);
+        brelse(bh);
+    } else {
+        ret = 1;
+    }
+    // Sin bloque del almacén que escribir, los datos recién escritos siguen necesitando el flush
+    if (ret > 0)
+        ret = blkdev_issue_flush(sb->s_bdev, GFP_KERNEL);
+    return ret;
+}
+
+/*
+ *  Opciones de montaje
+ */
+enum {
+    Opt_discard, Opt_nodiscard, Opt_device, Opt_log, Opt_err,
+};
+
+static const match_table_t assoofs_tokens = {
+    {Opt_discard, "discard"},
+    {Opt_nodiscard, "nodiscard"},
+    {Opt_device, "device=%s"},
+    {Opt_log, "log"},
+    {Opt_err, NULL},
+};
+
+static int assoofs_parse_options(struct super_block *sb, char *options) {
+    struct assoofs_fs_info *fs = ASSOOFS_FS(sb);
+    substring_t args[MAX_OPT_ARGS];
+    char *p;
+
+    while ((p = strsep(&options, ",")) != NULL) {
+        if (!*p)
+            continue;
+        switch (match_token(p, assoofs_tokens, args)) {
+        case Opt_discard:
+            fs->mount_opt |= ASSOOFS_MOUNT_DISCARD;
+            break;
+        case Opt_nodiscard:
+            fs->mount_opt &= ~ASSOOFS_MOUNT_DISCARD;
+            break;
+        case Opt_device:
+            // Los miembros los ha abierto ya assoofs_stripe_mount
+            break;
+        case Opt_log:
+            // El disco virtual del registro lo ha creado ya assoofs_log_mount
+            break;
+        default:
+            printk(KERN_ERR "assoofs: unknown mount option \"%s\"\n", p);
+            return -EINVAL;
+        }
+    }
+    return 0;
+}
+
+// -o discard en un dispositivo que no descarta no haría más que encolar trabajo
+static void assoofs_setup_discard(struct super_block *sb) {
+    struct assoofs_fs_info *fs = ASSOOFS_FS(sb);
+
+    if ((fs->mount_opt & ASSOOFS_MOUNT_DISCARD) && !blk_queue_discard(bdev_get_queue(sb->s_bdev))) {
+        printk(KERN_WARNING "assoofs: the device does not support discard, mounting without it\n");
+        fs->mount_opt &= ~ASSOOFS_MOUNT_DISCARD;
+    }
+}
+
+static int assoofs_show_options(struct seq_file *m, struct dentry *root) {
+    if (ASSOOFS_FS(root->d_sb)->mount_opt & ASSOOFS_MOUNT_DISCARD)
+        seq_puts(m, ",discard");
+    if (assoofs_log_of(root->d_sb->s_bdev))
+        seq_puts(m, ",log");
+    return 0;
+}
+
+/*
+ *  Shrinker: el del superbloque reparte la presión entre dentries, inodos y lo que cuentan
+ *  nr_cached_objects/free_cached_objects, que aquí es fs->cache_lru. Se suelta del más
+ *  antiguo al más reciente; lo usado desde la pasada anterior se salva una vez.
+ */
+static enum lru_status assoofs_cache_isolate(struct list_head *item, struct list_lru_one *lru, spinlock_t *lock, void *arg) {
+    struct assoofs_inode *ai = list_entry(item, struct assoofs_inode, lru);
+    struct inode *inode = ai->inode;
+    bool busy;
+
+    if (READ_ONCE(ai->referenced)) {
+        WRITE_ONCE(ai->referenced, false);
+        return LRU_ROTATE;
+    }
+    if (S_ISDIR(ai->info.mode)) {
+        // Las búsquedas usan el índice con el directorio bloqueado en modo compartido
+        if (!inode_trylock(inode))
+            return LRU_SKIP;
+        assoofs_dir_index_free(xchg(&ai->dir_index, NULL));
+        inode_unlock(inode);
+    } else {
+        if (!down_write_trylock(&ai->map_sem))
+            return LRU_SKIP;
+        // Con el inodo sucio o en writeback el bloque de extents puede no tener aún lo mismo
+        spin_lock(&inode->i_lock);
+        busy = inode->i_state & (I_DIRTY_ALL | I_SYNC);
+        spin_unlock(&inode->i_lock);
+        if (busy) {
+            up_write(&ai->map_sem);
+            return LRU_SKIP;
+        }
+        if (ai->extents != ai->info.extents) {
+            kfree(ai->extents);
+            ai->extents = NULL;
+        }
+        up_write(&ai->map_sem);
+    }
+    list_lru_isolate(lru, item);
+    assoofs_stat_inc(inode->i_sb, cache_shrunk);
+    return LRU_REMOVED;
+}
+
+static long assoofs_nr_cached_objects(struct super_block *sb, struct shrink_control *sc) {
+    return list_lru_shrink_count(&ASSOOFS_FS(sb)->cache_lru, sc);
+}
+
+static long assoofs_free_cached_objects(struct super_block *sb, struct shrink_control *sc) {
+    return list_lru_shrink_walk(&ASSOOFS_FS(sb)->cache_lru, sc, assoofs_cache_isolate, NULL);
+}
+
+// Una imagen sellada no tiene con qué asignar nada: no se puede volver a montar de escritura
+static int assoofs_remount(struct super_block *sb, int *flags, char *data) {
+    struct assoofs_fs_info *fs = ASSOOFS_FS(sb);
+
+    if (fs->sealed) {
+        if (!(*flags & SB_RDONLY))
+            return -EROFS;
+        return 0;
+    }
+    if ((*flags & SB_RDONLY) && !sb_rdonly(sb)) {
+        sync_filesystem(sb);
+        flush_work(&fs->reclaim_work);
+        flush_delayed_work(&fs->discard_work);
+        assoofs_set_clean(sb, true);
+    } else if (!(*flags & SB_RDONLY) && sb_rdonly(sb)) {
+        // Como al montar de escritura: lo que dejó un corte sin liberar se libera ahora
+        assoofs_set_clean(sb, false);
+        assoofs_process_orphans(sb);
+    }
+    return 0;
+}
+
+static const struct super_operations assoofs_sops = {
+    .write_inode = assoofs_write_inode,
+    .drop_inode = generic_delete_inode,
+    .evict_inode = assoofs_evict_inode,
+    .free_inode = assoofs_free_inode,
+    .put_super = assoofs_put_super,
+    .show_options = assoofs_show_options,
+    .remount_fs = assoofs_remount,
+    .nr_cached_objects = assoofs_nr_cached_objects,
+    .free_cached_objects = assoofs_free_cached_objects,
+};
+//OBTENER INFORMACION OERSISTENTE DE UN INODO
+
+/*
+ *  Volúmenes de varios dispositivos: al montar, los miembros se juntan en un disco virtual
+ *  /dev/assoofsN del tamaño del volumen y el resto del sistema de ficheros trabaja sobre él como
+ *  sobre uno solo. Cada bio se parte donde cambia de miembro: los datos van al miembro de su
+ *  unidad, así que una lectura o escritura grande llega a todos a la vez, y las escrituras de
+ *  metadatos van a todos los miembros.
+ */
+#define ASSOOFS_STRIPE_SECTORS (ASSOOFS_DEFAULT_BLOCK_SIZE >> SECTOR_SHIFT)
+
+struct assoofs_stripe {
+    struct gendisk *disk;
+    struct request_queue *queue;
+    struct bio_set bs;
+    struct workqueue_struct *wq;
+    struct work_struct flush_work;
+    spinlock_t flush_lock;
+    struct bio_list flush_bios;     /* con datos y REQ_PREFLUSH: antes hay que vaciar todos */
+    fmode_t mode;
+    int minor;
+    uint64_t header;                /* superbloque y tabla de descriptores, first_group_block */
+    uint64_t data_start;            /* primer bloque de datos en cada miembro */
+    uint32_t blocks_per_group;
+    uint32_t meta;                  /* bloques de metadatos al principio de cada grupo */
+    uint32_t stripe;
+    unsigned int count;
+    struct block_device *members[];
+};
+
+static int assoofs_stripe_major;
+static DEFINE_IDA(assoofs_stripe_ida);
+static const struct block_device_operations assoofs_stripe_fops;
+
+static struct assoofs_stripe *assoofs_stripe_of(struct block_device *bdev) {
+    return bdev->bd_disk->fops == &assoofs_stripe_fops ? bdev->bd_disk->private_data : NULL;
+}
+
+/*
+ *  Bloque del volumen -> miembro y bloque dentro de él. Devuelve cuántos bloques seguidos
+ *  siguen igual; *member es -1 para los metadatos, que están en todos los miembros.
+ */
+static uint64_t assoofs_stripe_map(const struct assoofs_stripe *st, uint64_t block, int *member, uint64_t *phys) {
+    uint64_t group, data, unit;
+    uint32_t off, unit_off, m;
+
+    if (block < st->header) {
+        *member = -1;
+        *phys = block;
+        return st->header - block;
+    }
+    group = div_u64_rem(block - st->header, st->blocks_per_group, &off);
+    if (off < st->meta) {
+        *member = -1;
+        *phys = st->header + 1 + group * st->meta + off;
+        return st->meta - off;
+    }
+    data = group * (st->blocks_per_group - st->meta) + off - st->meta;
+    unit = div_u64_rem(data, st->stripe, &unit_off);
+    unit = div_u64_rem(unit, st->count, &m);
+    *member = m;
+    *phys = st->data_start + unit * st->stripe + unit_off;
+    return min_t(uint64_t, st->blocks_per_group - off, st->stripe - unit_off);
+}
+
+static void assoofs_stripe_remap(struct bio *bio, struct block_device *bdev, uint64_t phys, sector_t sector) {
+    bio_set_dev(bio, bdev);
+    bio->bi_iter.bi_sector = phys * ASSOOFS_STRIPE_SECTORS + (sector & (ASSOOFS_STRIPE_SECTORS - 1));
+}
+
+// Desde un trabajo aparte se puede esperar a los vaciados sin bloquear la cola de bios
+static void assoofs_stripe_flush_work(struct work_struct *work) {
+    struct assoofs_stripe *st = container_of(work, struct assoofs_stripe, flush_work);
+    struct bio_list bios;
+    struct bio *bio;
+    unsigned int i;
+    int ret, err;
+
+    spin_lock(&st->flush_lock);
+    bios = st->flush_bios;
+    bio_list_init(&st->flush_bios);
+    spin_unlock(&st->flush_lock);
+    while ((bio = bio_list_pop(&bios))) {
+        ret = 0;
+        for (i = 0; i < st->count; i++) {
+            err = blkdev_issue_flush(st->members[i], GFP_NOIO);
+            if (err && !ret)
+                ret = err;
+        }
+        if (ret) {
+            bio->bi_status = errno_to_blk_status(ret);
+            bio_endio(bio);
+            continue;
+        }
+        bio->bi_opf &= ~REQ_PREFLUSH;
+        submit_bio_noacct(bio);
+    }
+}
+
+static blk_qc_t assoofs_stripe_submit_bio(struct bio *bio) {
+    struct assoofs_stripe *st = bio->bi_disk->private_data;
+    sector_t sector = bio->bi_iter.bi_sector;
+    struct bio *split, *clone;
+    uint64_t run, phys;
+    unsigned int i;
+    int member;
+
+    if (bio->bi_opf & REQ_PREFLUSH) {
+        if (bio_sectors(bio)) {
+            spin_lock(&st->flush_lock);
+            bio_list_add(&st->flush_bios, bio);
+            spin_unlock(&st->flush_lock);
+            queue_work(st->wq, &st->flush_work);
+            return BLK_QC_T_NONE;
+        }
+        // Un vaciado sin datos: uno por miembro, en paralelo
+        for (i = 0; i < st->count; i++) {
+            clone = bio_clone_fast(bio, GFP_NOIO, &st->bs);
+            bio_set_dev(clone, st->members[i]);
+            bio_chain(clone, bio);
+            submit_bio_noacct(clone);
+        }
+        bio_endio(bio);
+        return BLK_QC_T_NONE;
+    }
+
+    // Lo que pase del primer tramo vuelve a entrar aquí
+    run = assoofs_stripe_map(st, sector / ASSOOFS_STRIPE_SECTORS, &member, &phys);
+    if (bio_sectors(bio) > run * ASSOOFS_STRIPE_SECTORS - (sector & (ASSOOFS_STRIPE_SECTORS - 1))) {
+        split = bio_split(bio, run * ASSOOFS_STRIPE_SECTORS - (sector & (ASSOOFS_STRIPE_SECTORS - 1)), GFP_NOIO, &st->bs);
+        bio_chain(split, bio);
+        submit_bio_noacct(bio);
+        bio = split;
+    }
+    if (member < 0 && op_is_write(bio_op(bio))) {
+        for (i = 1; i < st->count; i++) {
+            clone = bio_clone_fast(bio, GFP_NOIO, &st->bs);
+            assoofs_stripe_remap(clone, st->members[i], phys, sector);
+            bio_chain(clone, bio);
+            submit_bio_noacct(clone);
+        }
+        member = 0;
+    } else if (member < 0) {
+        // Las copias son iguales: las lecturas de metadatos se reparten entre los miembros
+        member = div_u64(phys, st->stripe) % st->count;
+    }
+    assoofs_stripe_remap(bio, st->members[member], phys, sector);
+    submit_bio_noacct(bio);
+    return BLK_QC_T_NONE;
+}
+
+static const struct block_device_operations assoofs_stripe_fops = {
+    .owner = THIS_MODULE,
+    .submit_bio = assoofs_stripe_submit_bio,
+};
+
+static void assoofs_stripe_free(struct assoofs_stripe *st) {
+    unsigned int i;
+
+    if (st->wq)
+        destroy_workqueue(st->wq);
+    if (st->disk && (st->disk->flags & GENHD_FL_UP))
+        del_gendisk(st->disk);
+    if (st->queue)
+        blk_cleanup_queue(st->queue);
+    if (st->disk)
+        put_disk(st->disk);
+    if (st->minor >= 0)
+        ida_free(&assoofs_stripe_ida, st->minor);
+    bioset_exit(&st->bs);
+    for (i = 0; i < st->count; i++) {
+        if (!IS_ERR_OR_NULL(st->members[i]))
+            blkdev_put(st->members[i], st->mode);
+    }
+    kfree(st);
+}
+
+// Lectura directa, sin pasar por la caché de los miembros, que después no se vuelve a usar
+static int assoofs_stripe_read(struct block_device *bdev, uint64_t block, struct page *page) {
+    struct bio *bio = bio_alloc(GFP_KERNEL, 1);
+    int ret;
+
+    bio_set_dev(bio, bdev);
+    bio->bi_iter.bi_sector = block * ASSOOFS_STRIPE_SECTORS;
+    bio->bi_opf = REQ_OP_READ;
+    bio_add_page(bio, page, ASSOOFS_DEFAULT_BLOCK_SIZE, 0);
+    ret = submit_bio_wait(bio);
+    bio_put(bio);
+    return ret;
+}
+
+/*
+ *  Comprueba que los miembros abiertos son los del volumen y en su orden, y que caben en ellos
+ *  sus unidades de datos. El resto de la geometría lo comprueba assoofs_fill_super.
+ */
+static int assoofs_stripe_check(struct assoofs_stripe *st, uint64_t *blocks) {
+    struct assoofs_super_block_info *asb;
+    struct assoofs_member_label *label;
+    struct page *page;
+    uint64_t volume_id, devices, data, need;
+    unsigned int i;
+    int ret;
+
+    page = alloc_page(GFP_KERNEL);
+    if (!page)
+        return -ENOMEM;
+    asb = page_address(page);
+    ret = assoofs_stripe_read(st->members[0], ASSOOFS_SUPERBLOCK_BLOCK_NUMBER, page);
+    if (ret)
+        goto out;
+    ret = -EINVAL;
+    if (asb->magic != ASSOOFS_MAGIC || asb->version != ASSOOFS_VERSION || asb->block_size != ASSOOFS_DEFAULT_BLOCK_SIZE) {
+        printk(KERN_ERR "assoofs: the first device does not hold an assoofs volume\n");
+        goto out;
+    }
+    if (asb->devices_count != st->count) {
+        printk(KERN_ERR "assoofs: the volume has %llu devices, %u given\n", asb->devices_count, st->count);
+        goto out;
+    }
+    if (!asb->groups_count || !asb->blocks_per_group || asb->blocks_per_group > ASSOOFS_MAX_BLOCKS_PER_GROUP ||
+        !asb->inodes_per_group || asb->inodes_per_group > ASSOOFS_BITS_PER_BLOCK ||
+        !asb->stripe_blocks || asb->stripe_blocks > ASSOOFS_MAX_BLOCKS_PER_GROUP ||
+        asb->first_group_block != ASSOOFS_GDT_BLOCK_NUMBER + DIV_ROUND_UP(asb->groups_count, ASSOOFS_DESCS_PER_BLOCK) ||
+        asb->first_group_block + (asb->groups_count - 1) * asb->blocks_per_group >= asb->blocks_count) {
+        printk(KERN_ERR "assoofs: bad striped volume geometry\n");
+        goto out;
+    }
+    st->header = asb->first_group_block;
+    st->blocks_per_group = asb->blocks_per_group;
+    st->meta = 2 + DIV_ROUND_UP(asb->blocks_per_group, ASSOOFS_DEFAULT_BLOCK_SIZE) + asb->inodes_per_group / ASSOOFS_INODES_PER_BLOCK;
+    st->stripe = asb->stripe_blocks;
+    if (st->meta >= st->blocks_per_group) {
+        printk(KERN_ERR "assoofs: bad striped volume geometry\n");
+        goto out;
+    }
+    st->data_start = st->header + 1 + asb->groups_count * st->meta;
+    data = asb->blocks_count - st->header - asb->groups_count * st->meta;
+    need = st->data_start + DIV_ROUND_UP(DIV_ROUND_UP(data, st->stripe), st->count) * st->stripe;
+    volume_id = asb->volume_id;
+    devices = asb->devices_count;
+    *blocks = asb->blocks_count;
+
+    label = page_address(page);
+    for (i = 0; i < st->count; i++) {
+        if (i_size_read(st->members[i]->bd_inode) / ASSOOFS_DEFAULT_BLOCK_SIZE < need) {
+            printk(KERN_ERR "assoofs: device %u of the volume is too small\n", i);
+            goto out;
+        }
+        ret = assoofs_stripe_read(st->members[i], st->header, page);
+        if (ret)
+            goto out;
+        ret = -EINVAL;
+        if (label->magic != ASSOOFS_MEMBER_MAGIC || label->volume_id != volume_id || label->devices_count != devices) {
+            printk(KERN_ERR "assoofs: device %u is not a member of this volume\n", i);
+            goto out;
+        }
+        if (label->index != i) {
+            printk(KERN_ERR "assoofs: device %u is member %llu of the volume, give them in order\n", i, label->index);
+            goto out;
+        }
+    }
+    ret = 0;
+out:
+    __free_page(page);
+    return ret;
+}
+
+static int assoofs_stripe_add_disk(struct assoofs_stripe *st, uint64_t blocks, bool rdonly) {
+    struct request_queue *q;
+    bool discard = true;
+    unsigned int i;
+
+    st->minor = ida_alloc(&assoofs_stripe_ida, GFP_KERNEL);
+    if (st->minor < 0)
+        return st->minor;
+    st->queue = q = blk_alloc_queue(NUMA_NO_NODE);
+    st->disk = alloc_disk(1);
+    if (!st->queue || !st->disk)
+        return -ENOMEM;
+    blk_queue_logical_block_size(q, ASSOOFS_DEFAULT_BLOCK_SIZE);
+    blk_queue_physical_block_size(q, ASSOOFS_DEFAULT_BLOCK_SIZE);
+    blk_queue_io_min(q, st->stripe * ASSOOFS_DEFAULT_BLOCK_SIZE);
+    blk_queue_io_opt(q, st->stripe * st->count * ASSOOFS_DEFAULT_BLOCK_SIZE);
+    blk_queue_write_cache(q, true, true);
+    for (i = 0; i < st->count; i++)
+        discard &= blk_queue_discard(bdev_get_queue(st->members[i]));
+    if (discard) {
+        blk_queue_flag_set(QUEUE_FLAG_DISCARD, q);
+        blk_queue_max_discard_sectors(q, UINT_MAX);
+        q->limits.discard_granularity = ASSOOFS_DEFAULT_BLOCK_SIZE;
+    }
+    st->disk->major = assoofs_stripe_major;
+    st->disk->first_minor = st->minor;
+    st->disk->fops = &assoofs_stripe_fops;
+    st->disk->private_data = st;
+    st->disk->queue = q;
+    snprintf(st->disk->disk_name, DISK_NAME_LEN, "assoofs%d", st->minor);
+    set_capacity(st->disk, blocks * ASSOOFS_STRIPE_SECTORS);
+    set_disk_ro(st->disk, rdonly);
+    add_disk(st->disk);
+    return 0;
+}
+
+/*
+ *  Modo registro: un disco virtual /dev/assoofsN del tamaño lógico del volumen sobre un
+ *  dispositivo en el que solo se escribe seguido. Las escrituras, los vaciados, los descartes y
+ *  el limpiador pasan de uno en uno por una cola ordenada, que es quien reparte los bloques: así
+ *  llegan al dispositivo en el orden de la zona. Las lecturas van directas según el mapa.
+ *  El mapa se cambia al enviar cada escritura; lo que hay por encima (la caché de páginas y la
+ *  de buffers) no lee un bloque mientras se está escribiendo.
+ */
+#define ASSOOFS_LOG_CP_PAGES 64             /* registros de cambios que se escriben de una vez */
+#define ASSOOFS_LOG_NONE U32_MAX
+
+struct assoofs_log {
+    struct gendisk *disk;
+    struct request_queue *queue;
+    struct bio_set bs;
+    struct block_device *bdev;
+    fmode_t mode;
+    int minor;
+    bool zoned;
+    struct workqueue_struct *wq;
+    struct work_struct write_work;
+    struct work_struct clean_work;
+    spinlock_t bio_lock;
+    struct bio_list bios;
+    spinlock_t lock;                        /* mapa, bloques válidos y zonas libres */
+    uint32_t *map;                          /* bloque lógico -> físico, 0 si no se ha escrito */
+    uint32_t *rev;                          /* bloque físico -> lógico, ASSOOFS_LOG_NONE si ya no vale */
+    uint32_t *valid;                        /* bloques válidos de cada zona */
+    atomic_t *reads;                        /* lecturas en curso en cada zona */
+    uint64_t zone_blocks;
+    uint64_t zones;
+    uint64_t logical;
+    uint64_t volume_id;
+    uint64_t free_zones;                    /* del registro, sin nada válido y sin abrir */
+    uint64_t open_zone, open_wp;            /* zona en la que se escribe y su siguiente bloque */
+    atomic_t inflight;                      /* escrituras enviadas sin terminar */
+    wait_queue_head_t wait;
+    // Punto de control: zona en uso, su siguiente bloque y cambios aún sin escribir
+    uint64_t cp_zone, cp_wp, seq;
+    struct assoofs_log_entry *pending;
+    uint32_t npending;
+    struct page *cp_pages[ASSOOFS_LOG_CP_PAGES];
+    struct page *clean_pages[ASSOOFS_LOG_CP_PAGES];
+    uint64_t moved;                         /* bloques que ha movido el limpiador */
+};
+
+// Cada clon sabe a qué bio pertenece y en qué zona lee
+struct assoofs_log_io {
+    struct assoofs_log *lg;
+    struct bio *orig;
+    uint64_t zone;
+    struct bio clone;
+};
+
+static const struct block_device_operations assoofs_log_fops;
+
+static struct assoofs_log *assoofs_log_of(struct block_device *bdev) {
+    return bdev->bd_disk->fops == &assoofs_log_fops ? bdev->bd_disk->private_data : NULL;
+}
+
+static inline uint64_t assoofs_log_zone(const struct assoofs_log *lg, uint64_t phys) {
+    return div64_u64(phys, lg->zone_blocks);
+}
+
+// Con lg->lock: el bloque lógico pasa a phys (0 para soltarlo) y el cambio queda pendiente
+static void assoofs_log_set(struct assoofs_log *lg, uint32_t logical, uint32_t phys) {
+    uint32_t old = lg->map[logical];
+    uint64_t zone;
+
+    if (old) {
+        lg->rev[old] = ASSOOFS_LOG_NONE;
+        zone = assoofs_log_zone(lg, old);
+        if (!--lg->valid[zone] && zone != lg->open_zone)
+            lg->free_zones++;
+    }
+    lg->map[logical] = phys;
+    if (phys) {
+        lg->rev[phys] = logical;
+        lg->valid[assoofs_log_zone(lg, phys)]++;
+    }
+    lg->pending[lg->npending].logical = logical;
+    lg->pending[lg->npending++].physical = phys;
+}
+
+// Lectura o escritura síncrona de count bloques seguidos, una página por bloque
+static int assoofs_log_rw(struct assoofs_log *lg, unsigned int opf, uint64_t block, struct page **pages, unsigned int count) {
+    struct bio *bio = bio_alloc(GFP_NOIO, count);
+    unsigned int i;
+    int ret;
+
+    bio_set_dev(bio, lg->bdev);
+    bio->bi_iter.bi_sector = block * ASSOOFS_STRIPE_SECTORS;
+    bio->bi_opf = opf;
+    for (i = 0; i < count; i++)
+        bio_add_page(bio, pages[i], ASSOOFS_DEFAULT_BLOCK_SIZE, 0);
+    ret = submit_bio_wait(bio);
+    bio_put(bio);
+    return ret;
+}
+
+// Registros de un punto de control, de una vez y con PREFLUSH|FUA: lo escrito antes queda con ellos
+static int assoofs_log_write_cp(struct assoofs_log *lg, uint64_t block, unsigned int count) {
+    return assoofs_log_rw(lg, REQ_OP_WRITE | REQ_SYNC | REQ_PREFLUSH | REQ_FUA, block, lg->cp_pages, count);
+}
+
+static int assoofs_log_reset_zone(struct assoofs_log *lg, uint64_t zone) {
+    if (!lg->zoned)
+        return 0;
+    return blkdev_zone_mgmt(lg->bdev, REQ_OP_ZONE_RESET, zone * lg->zone_blocks * ASSOOFS_STRIPE_SECTORS,
+                            lg->zone_blocks * ASSOOFS_STRIPE_SECTORS, GFP_NOIO);
+}
+
+// Llena los registros desde *next con el mapa entero; devuelve cuántos
+static unsigned int assoofs_log_fill_full(struct assoofs_log *lg, uint64_t *next) {
+    struct assoofs_log_cp *cp;
+    unsigned int i;
+
+    for (i = 0; i < ASSOOFS_LOG_CP_PAGES && *next < lg->logical; i++) {
+        cp = page_address(lg->cp_pages[i]);
+        memset(cp, 0, sizeof(*cp));
+        cp->magic = ASSOOFS_LOG_CP_MAGIC;
+        cp->volume_id = lg->volume_id;
+        cp->seq = ++lg->seq;
+        for (; *next < lg->logical && cp->count < ASSOOFS_LOG_CP_ENTRIES; (*next)++) {
+            if (!lg->map[*next])
+                continue;
+            cp->entries[cp->count].logical = *next;
+            cp->entries[cp->count++].physical = lg->map[*next];
+        }
+    }
+    return i;
+}
+
+/*
+ *  La zona de puntos de control se ha llenado: el mapa entero va a la otra, que se vacía
+ *  antes. Hasta que no está escrito el último registro sigue valiendo el de la zona de ahora.
+ */
+static int assoofs_log_full_cp(struct assoofs_log *lg) {
+    uint64_t zone = lg->cp_zone == ASSOOFS_LOG_CP_ZONE ? ASSOOFS_LOG_CP_ZONE + 1 : ASSOOFS_LOG_CP_ZONE;
+    uint64_t next = 0, wp = 0;
+    struct assoofs_log_cp *cp;
+    unsigned int count;
+    int ret;
+
+    ret = assoofs_log_reset_zone(lg, zone);
+    if (ret)
+        return ret;
+    do {
+        // Sin nada escrito en el volumen también hace falta un registro con BASE y END
+        count = assoofs_log_fill_full(lg, &next);
+        if (!count) {
+            cp = page_address(lg->cp_pages[0]);
+            memset(cp, 0, sizeof(*cp));
+            cp->magic = ASSOOFS_LOG_CP_MAGIC;
+            cp->volume_id = lg->volume_id;
+            cp->seq = ++lg->seq;
+            count = 1;
+        }
+        if (!wp)
+            ((struct assoofs_log_cp *)page_address(lg->cp_pages[0]))->flags |= ASSOOFS_LOG_CP_BASE;
+        if (next == lg->logical)
+            ((struct assoofs_log_cp *)page_address(lg->cp_pages[count - 1]))->flags |= ASSOOFS_LOG_CP_END;
+        if (wp + count > lg->zone_blocks)
+            return -ENOSPC;
+        ret = assoofs_log_write_cp(lg, zone * lg->zone_blocks + wp, count);
+        if (ret)
+            return ret;
+        wp += count;
+    } while (next < lg->logical);
+    lg->cp_zone = zone;
+    lg->cp_wp = wp;
+    lg->npending = 0;
+    return 0;
 }
 
 /*
- *  Operaciones sobre directorios
+ *  Punto de control: espera a que terminen las escrituras enviadas y guarda detrás del último
+ *  registro los cambios pendientes. Sin cambios basta con vaciar la caché del dispositivo.
  */
-static int assoofs_iterate(struct file *filp, struct dir_context *ctx);
-const struct file_operations assoofs_dir_operations = {
-    .owner = THIS_MODULE,
-    .iterate = assoofs_iterate,
-};
+static int assoofs_log_checkpoint(struct assoofs_log *lg) {
+    struct assoofs_log_cp *cp;
+    uint32_t done = 0;
+    unsigned int count;
 
-static int assoofs_iterate(struct file *filp, struct dir_context *ctx) {
-    struct inode *inode;
-    struct super_block *sb;
-    struct assoofs_inode_info *inode_info;
-    struct buffer_head *bh;
-    int i = 0;
-    printk(KERN_INFO "Iterate request\n");
-    inode = filp->f_path.dentry->d_inode;
-    sb = inode->i_sb;
-    inode_info = inode->i_private;
-    if (ctx->pos) return 0;
-    if ((!S_ISDIR(inode_info->mode))) return -1;
-    bh = sb_bread(sb, inode_info->data_block_number);
-    struct assoofs_dir_record_entry *record ;
-         record = (struct assoofs_dir_record_entry *) bh->b_data;
-    for (i = 0; i < inode_info->dir_children_count; i++) {
-        dir_emit(ctx, record->filename, ASSOOFS_FILENAME_MAXLEN, record->inode_no, DT_UNKNOWN);
-        ctx->pos += sizeof(struct assoofs_dir_record_entry);
-        record++;
+    wait_event(lg->wait, !atomic_read(&lg->inflight));
+    if (!lg->npending)
+        return blkdev_issue_flush(lg->bdev, GFP_NOIO);
+    count = DIV_ROUND_UP(lg->npending, ASSOOFS_LOG_CP_ENTRIES);
+    if (lg->cp_wp + count > lg->zone_blocks)
+        return assoofs_log_full_cp(lg);
+    for (count = 0; done < lg->npending; count++) {
+        cp = page_address(lg->cp_pages[count]);
+        memset(cp, 0, sizeof(*cp));
+        cp->magic = ASSOOFS_LOG_CP_MAGIC;
+        cp->volume_id = lg->volume_id;
+        cp->seq = lg->seq + count + 1;
+        cp->count = min_t(uint32_t, lg->npending - done, ASSOOFS_LOG_CP_ENTRIES);
+        memcpy(cp->entries, lg->pending + done, cp->count * sizeof(*cp->entries));
+        done += cp->count;
     }
-
-    brelse(bh);
+    if (assoofs_log_write_cp(lg, lg->cp_zone * lg->zone_blocks + lg->cp_wp, count))
+        return -EIO;
+    lg->seq += count;
+    lg->cp_wp += count;
+    lg->npending = 0;
     return 0;
 }
 
 /*
- *  Operaciones sobre inodos
+ *  Abre la siguiente zona libre, empezando a buscar detrás de la abierta. Antes de vaciarla
+ *  el mapa en disco tiene que haber dejado de apuntar a ella y no puede quedar ninguna
+ *  lectura suya en curso.
  */
-static int assoofs_create(struct inode *dir, struct dentry *dentry, umode_t mode, bool excl);
-struct dentry *assoofs_lookup(struct inode *parent_inode, struct dentry *child_dentry, unsigned int flags);
-static int assoofs_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode);
-static struct inode_operations assoofs_inode_ops = {
-    .create = assoofs_create,
-    .lookup = assoofs_lookup,
-    .mkdir = assoofs_mkdir,
-};
+static int assoofs_log_open(struct assoofs_log *lg) {
+    uint64_t zone = lg->open_zone, i;
+    int ret;
 
-struct assoofs_inode_info *assoofs_get_inode_info(struct super_block *sb, uint64_t inode_no) {
-    struct assoofs_inode_info *inode_info = NULL;
-    struct buffer_head *bh;
-    struct assoofs_super_block_info *afs_sb ;
-    struct assoofs_inode_info *buffer = NULL;
-    int i=0;
-    bh = sb_bread(sb, ASSOOFS_INODESTORE_BLOCK_NUMBER);
-    inode_info = (struct assoofs_inode_info *)bh->b_data;
-    afs_sb = sb->s_fs_info;
-    for (i = 0; i < afs_sb->inodes_count; i++) {
-        if (inode_info->inode_no == inode_no) {
-            buffer = kmalloc(sizeof(struct assoofs_inode_info), GFP_KERNEL);
-            memcpy(buffer, inode_info, sizeof(*buffer));
+    if (lg->npending) {
+        ret = assoofs_log_checkpoint(lg);
+        if (ret)
+            return ret;
+    }
+    spin_lock(&lg->lock);
+    for (i = 0; i < lg->zones; i++) {
+        zone = zone + 1 < lg->zones ? zone + 1 : ASSOOFS_LOG_FIRST_ZONE;
+        if (zone >= ASSOOFS_LOG_FIRST_ZONE && zone != lg->open_zone && !lg->valid[zone])
             break;
+    }
+    if (i == lg->zones) {
+        spin_unlock(&lg->lock);
+        return -ENOSPC;
+    }
+    // La zona cerrada que ya no tenga nada válido vuelve a estar libre
+    if (lg->open_zone >= ASSOOFS_LOG_FIRST_ZONE && !lg->valid[lg->open_zone])
+        lg->free_zones++;
+    lg->free_zones--;
+    lg->open_zone = zone;
+    lg->open_wp = 0;
+    spin_unlock(&lg->lock);
+    wait_event(lg->wait, !atomic_read(&lg->reads[zone]));
+    return assoofs_log_reset_zone(lg, zone);
+}
+
+static int assoofs_log_clean_one(struct assoofs_log *lg);
+
+/*
+ *  Hasta want bloques seguidos al final de la zona abierta. Las escrituras normales dejan
+ *  siempre una zona libre para el limpiador, que solo necesita una para vaciar otra.
+ */
+static int assoofs_log_alloc(struct assoofs_log *lg, uint64_t want, bool cleaning, uint64_t *phys, uint64_t *count) {
+    int ret;
+
+    if (lg->open_wp == lg->zone_blocks) {
+        while (!cleaning && lg->free_zones < 2) {
+            ret = assoofs_log_clean_one(lg);
+            if (ret)
+                return ret;
         }
-        inode_info++;
+        ret = assoofs_log_open(lg);
+        if (ret)
+            return ret;
     }
-    brelse(bh);
-    return buffer;
-};
+    // Los cambios de cada escritura tienen que caber en la lista de pendientes
+    *count = min3(want, lg->zone_blocks - lg->open_wp, (uint64_t)ASSOOFS_LOG_CP_PAGES * ASSOOFS_LOG_CP_ENTRIES);
+    if (lg->npending + *count > ASSOOFS_LOG_CP_PAGES * ASSOOFS_LOG_CP_ENTRIES) {
+        ret = assoofs_log_checkpoint(lg);
+        if (ret)
+            return ret;
+    }
+    *phys = lg->open_zone * lg->zone_blocks + lg->open_wp;
+    lg->open_wp += *count;
+    return 0;
+}
 
-static struct inode *assoofs_get_inode(struct super_block *sb, int ino){
-    struct inode *inod;
-    struct assoofs_inode_info *inode_info=NULL;
-    inode_info = assoofs_get_inode_info(sb, ino);
-   // uint64_t count;
-   // count=((struct assoofs_super_block_info *)sb->s_fs_info)->inodes_count; // obtengo el n ́umero de inodos de lainformaci ́on persistente del superbloque;
+static void assoofs_log_write_end(struct bio *clone) {
+    struct assoofs_log_io *io = container_of(clone, struct assoofs_log_io, clone);
+    struct assoofs_log *lg = io->lg;
+    struct bio *orig = io->orig;
 
+    if (clone->bi_status && !orig->bi_status)
+        orig->bi_status = clone->bi_status;
+    if (atomic_dec_and_test(&lg->inflight))
+        wake_up(&lg->wait);
+    bio_put(clone);
+    bio_endio(orig);
+}
 
-    inod=new_inode(sb);
-    inod->i_ino = ino; // ńumero de inodo
-    inod->i_sb = sb; // puntero al superbloque
-    inod->i_op = &assoofs_inode_ops; // direcci ́on de una variable de tipo struct inode_operations previamente declarada
-    if (S_ISDIR(inode_info->mode))
-        inod->i_fop = &assoofs_dir_operations;
-    else if (S_ISREG(inode_info->mode))
-        inod->i_fop = &assoofs_file_operations;
-    else
-        printk(KERN_ERR "Unknown inode type. Neither a directory nor a file."); // direccion de una variable de tipo struct file_operations previamente declarada
-    inod->i_atime = inod->i_mtime = inod->i_ctime = current_time(inod);
-    inod->i_private = inode_info; // Informaci ́on persistente del inodo
-    inode_info = kmem_cache_alloc(assoofs_inode_cache, GFP_KERNEL);
-    return inod;
+static void assoofs_log_read_end(struct bio *clone) {
+    struct assoofs_log_io *io = container_of(clone, struct assoofs_log_io, clone);
+    struct assoofs_log *lg = io->lg;
+    struct bio *orig = io->orig;
 
-};
+    if (clone->bi_status && !orig->bi_status)
+        orig->bi_status = clone->bi_status;
+    if (atomic_dec_and_test(&lg->reads[io->zone]))
+        wake_up(&lg->wait);
+    bio_put(clone);
+    bio_endio(orig);
+}
 
-struct dentry *assoofs_lookup(struct inode *parent_inode, struct dentry *child_dentry, unsigned int flags) {
-    printk(KERN_INFO"Lookup request\n");
-    struct assoofs_inode_info *parent_info=NULL;
-    struct super_block *sb;
-    struct buffer_head *bh;
-    struct assoofs_dir_record_entry *record;
-    struct inode *inod;
-    parent_info = parent_inode->i_private;
-    sb=parent_inode->i_sb;
-    bh = sb_bread(sb, parent_info->data_block_number);
-    printk(KERN_INFO"Lookup in: \nino=%llu   b=%llu\n", parent_info->inode_no, parent_info->data_block_number);
-    record = (struct assoofs_dir_record_entry *) bh->b_data;
-    int i=0;
-    for (i = 0; i < parent_info->dir_children_count; i++) {
-        if (!strcmp(record->filename, child_dentry->d_name.name)) {
-            inod= assoofs_get_inode(sb,record->inode_no); // Funcion auxiliar que obtiene la informacion de un inodo a partir de su numero de inodo.
-            inode_init_owner(inod, parent_inode, ((struct assoofs_inode_info *) inod->i_private)->mode);
-            d_add(child_dentry, inod);
-            return NULL;
+// Un trozo de la bio, de offset a offset+len bloques, hacia phys; la original acaba con el último
+static struct bio *assoofs_log_clone(struct assoofs_log *lg, struct bio *bio, uint64_t offset, uint64_t len, uint64_t phys) {
+    struct assoofs_log_io *io;
+    struct bio *clone;
+
+    clone = bio_clone_fast(bio, GFP_NOIO, &lg->bs);
+    io = container_of(clone, struct assoofs_log_io, clone);
+    io->lg = lg;
+    io->orig = bio;
+    bio_trim(clone, offset * ASSOOFS_STRIPE_SECTORS, len * ASSOOFS_STRIPE_SECTORS);
+    bio_set_dev(clone, lg->bdev);
+    clone->bi_iter.bi_sector = phys * ASSOOFS_STRIPE_SECTORS;
+    clone->bi_opf &= ~(REQ_PREFLUSH | REQ_FUA);
+    bio_inc_remaining(bio);
+    return clone;
+}
+
+// Tramos con el mismo orden en el disco que en el volumen; lo no escrito se lee a ceros
+static void assoofs_log_read(struct assoofs_log *lg, struct bio *bio) {
+    uint64_t block = bio->bi_iter.bi_sector / ASSOOFS_STRIPE_SECTORS, left = bio_sectors(bio) / ASSOOFS_STRIPE_SECTORS;
+    uint64_t done = 0, n, zone = 0, end = 0;
+    struct bio *clone;
+    uint32_t phys;
+
+    while (left) {
+        spin_lock(&lg->lock);
+        phys = lg->map[block + done];
+        if (phys) {
+            zone = assoofs_log_zone(lg, phys);
+            end = (zone + 1) * lg->zone_blocks;
+            atomic_inc(&lg->reads[zone]);
         }
-        record++;
+        for (n = 1; n < left; n++) {
+            if (phys ? phys + n == end || lg->map[block + done + n] != phys + n : lg->map[block + done + n] != 0)
+                break;
+        }
+        spin_unlock(&lg->lock);
+        clone = assoofs_log_clone(lg, bio, done, n, phys);
+        if (phys) {
+            container_of(clone, struct assoofs_log_io, clone)->zone = zone;
+            clone->bi_end_io = assoofs_log_read_end;
+            submit_bio_noacct(clone);
+        } else {
+            zero_fill_bio(clone);
+            bio_put(clone);
+            bio_endio(bio);
+        }
+        done += n;
+        left -= n;
     }
-    return NULL;
+    bio_endio(bio);
 }
 
-struct assoofs_inode_info *assoofs_search_inode_info(struct super_block *sb, struct assoofs_inode_info *start, struct assoofs_inode_info *search){
-    uint64_t count = 0;
-    while (start->inode_no != search->inode_no && count < ((struct assoofs_super_block_info *)sb->s_fs_info)->inodes_count) {
-        count++;
-        start++;
+static int assoofs_log_write(struct assoofs_log *lg, struct bio *bio) {
+    uint64_t block = bio->bi_iter.bi_sector / ASSOOFS_STRIPE_SECTORS, left = bio_sectors(bio) / ASSOOFS_STRIPE_SECTORS;
+    uint64_t done = 0, n, phys, i;
+    struct bio *clone;
+    int ret;
+
+    while (left) {
+        ret = assoofs_log_alloc(lg, left, false, &phys, &n);
+        if (ret)
+            return ret;
+        clone = assoofs_log_clone(lg, bio, done, n, phys);
+        clone->bi_end_io = assoofs_log_write_end;
+        spin_lock(&lg->lock);
+        for (i = 0; i < n; i++)
+            assoofs_log_set(lg, block + done + i, phys + i);
+        spin_unlock(&lg->lock);
+        atomic_inc(&lg->inflight);
+        submit_bio_noacct(clone);
+        done += n;
+        left -= n;
     }
-    if (start->inode_no == search->inode_no)
-        return start;
-    else
-        return NULL;
+    return 0;
 }
 
-int assoofs_save_inode_info(struct super_block *sb, struct assoofs_inode_info *inode_info){
-    struct buffer_head *bh;
-    struct assoofs_inode_info *inode_pos=NULL;
-    bh = sb_bread(sb, ASSOOFS_INODESTORE_BLOCK_NUMBER);
-    inode_pos = assoofs_search_inode_info(sb, (struct assoofs_inode_info *)bh->b_data, inode_info);
-    memcpy(inode_pos, inode_info, sizeof(*inode_pos));
-    inode_pos = kmem_cache_alloc(assoofs_inode_cache, GFP_KERNEL);
-    mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
+// Un descarte suelta los bloques: no se leen más y el limpiador ya no tiene que moverlos
+static int assoofs_log_discard(struct assoofs_log *lg, struct bio *bio) {
+    uint64_t block = bio->bi_iter.bi_sector / ASSOOFS_STRIPE_SECTORS, end = bio_end_sector(bio) / ASSOOFS_STRIPE_SECTORS;
+    int ret;
+
+    for (; block < end; block++) {
+        if (lg->npending == ASSOOFS_LOG_CP_PAGES * ASSOOFS_LOG_CP_ENTRIES) {
+            ret = assoofs_log_checkpoint(lg);
+            if (ret)
+                return ret;
+        }
+        spin_lock(&lg->lock);
+        if (lg->map[block])
+            assoofs_log_set(lg, block, 0);
+        spin_unlock(&lg->lock);
+    }
     return 0;
 }
 
+/*
+ *  Vacía la zona con menos bloques válidos copiándolos al final del registro. Cuando acaba la
+ *  zona ya no tiene nada válido, pero solo se reutiliza tras el siguiente punto de control.
+ */
+static int assoofs_log_clean_one(struct assoofs_log *lg) {
+    uint64_t victim = 0, zone, start, b, n, run, phys, i, j, moved;
+    uint32_t best = U32_MAX;
+    struct bio *bio;
+    int ret = 0;
 
-void assoofs_save_sb_info(struct super_block *vsb){
-    struct buffer_head *bh;
-    struct assoofs_super_block *sb ;
-            sb = vsb->s_fs_info; // Informaci ́on persistente del superbloque en memoria
-    bh = sb_bread(vsb, ASSOOFS_SUPERBLOCK_BLOCK_NUMBER);
-    bh->b_data = (char *)sb; // Sobreescribo los datos de disco con la informaci ́on en memoria
-    mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
-    brelse(bh);
+    spin_lock(&lg->lock);
+    for (zone = ASSOOFS_LOG_FIRST_ZONE; zone < lg->zones; zone++) {
+        if (zone != lg->open_zone && lg->valid[zone] && lg->valid[zone] < best) {
+            best = lg->valid[zone];
+            victim = zone;
+        }
+    }
+    spin_unlock(&lg->lock);
+    if (!victim || best >= lg->zone_blocks)
+        return -ENOSPC;
+    // Lo que se va a leer de la zona tiene que haber llegado antes al disco
+    wait_event(lg->wait, !atomic_read(&lg->inflight));
+    start = victim * lg->zone_blocks;
+    moved = 0;
+    for (b = 0; b < lg->zone_blocks && !ret; b += n) {
+        // Tramos de bloques válidos seguidos, de hasta ASSOOFS_LOG_CP_PAGES
+        for (n = 0; b + n < lg->zone_blocks && n < ASSOOFS_LOG_CP_PAGES && lg->rev[start + b + n] != ASSOOFS_LOG_NONE; n++)
+            ;
+        if (!n) {
+            n = 1;
+            continue;
+        }
+        ret = assoofs_log_rw(lg, REQ_OP_READ, start + b, lg->clean_pages, n);
+        for (i = 0; i < n && !ret; i += run) {
+            ret = assoofs_log_alloc(lg, n - i, true, &phys, &run);
+            if (!ret)
+                ret = assoofs_log_rw(lg, REQ_OP_WRITE, phys, lg->clean_pages + i, run);
+            if (ret)
+                break;
+            spin_lock(&lg->lock);
+            for (j = 0; j < run; j++)
+                assoofs_log_set(lg, lg->rev[start + b + i + j], phys + j);
+            spin_unlock(&lg->lock);
+            moved += run;
+        }
+    }
+    lg->moved += moved;
+    return ret;
 }
 
-void assoofs_add_inode_info(struct super_block *sb, struct assoofs_inode_info *inode){
-    struct buffer_head *bh;
-    struct assoofs_super_block_info *assoofs_sb = sb->s_fs_info;
-    bh = sb_bread(sb, ASSOOFS_INODESTORE_BLOCK_NUMBER);
-    inode = (struct assoofs_inode_info *)bh->b_data;
-    inode += assoofs_sb->inodes_count;
-    memcpy(inode, inode, sizeof(struct assoofs_inode_info));
-    inode = kmem_cache_alloc(assoofs_inode_cache, GFP_KERNEL);
-    mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
-    assoofs_sb->inodes_count++;
-    assoofs_save_sb_info(sb);
+static void assoofs_log_handle(struct assoofs_log *lg, struct bio *bio) {
+    int ret = 0;
+
+    if (bio_op(bio) == REQ_OP_DISCARD)
+        ret = assoofs_log_discard(lg, bio);
+    else if (bio_sectors(bio))
+        ret = assoofs_log_write(lg, bio);
+    // Con PREFLUSH o FUA la bio acaba cuando ella y lo anterior están en un punto de control
+    if (!ret && (bio->bi_opf & (REQ_PREFLUSH | REQ_FUA)))
+        ret = assoofs_log_checkpoint(lg);
+    if (ret && !bio->bi_status)
+        bio->bi_status = errno_to_blk_status(ret);
+    bio_endio(bio);
 }
 
-int assoofs_sb_get_a_freeblock(struct super_block *sb, uint64_t *block){
-    struct assoofs_super_block_info *assoofs_sb ;
-    int i=0;
-    assoofs_sb= sb->s_fs_info;
-    for (i = 2; i < ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED; i++)
-        if (assoofs_sb->free_blocks & (1 << i))
-            break; // cuando aparece el primer bit 1 en free_block dejamos de recorrer el mapa de bits, i tiene la posici ́ondel primer bloque libre
-    *block = i; // Escribimos el valor de i en la direcci ́on de memoria indicada como segundo argumento en la funci ́on
-    assoofs_sb->free_blocks &= ~(1 << i);
-    assoofs_save_sb_info(sb);
-    return 0;
+// El limpiador trabaja por detrás mientras quedan menos zonas libres que estas
+#define ASSOOFS_LOG_CLEAN_ZONES 4
+
+static void assoofs_log_write_work(struct work_struct *work) {
+    struct assoofs_log *lg = container_of(work, struct assoofs_log, write_work);
+    struct bio_list bios;
+    struct bio *bio;
+
+    spin_lock(&lg->bio_lock);
+    bios = lg->bios;
+    bio_list_init(&lg->bios);
+    spin_unlock(&lg->bio_lock);
+    while ((bio = bio_list_pop(&bios)))
+        assoofs_log_handle(lg, bio);
+    if (lg->free_zones < ASSOOFS_LOG_CLEAN_ZONES)
+        queue_work(lg->wq, &lg->clean_work);
 }
 
-static int assoofs_create(struct inode *dir, struct dentry *dentry, umode_t mode, bool excl) {
-    printk(KERN_INFO "New file request\n");
-    struct inode *inode;
-    uint64_t count;
-    struct buffer_head *bh;
-    struct super_block *sb;
-    struct assoofs_inode_info *parent_inode_info=NULL;
-    struct assoofs_dir_record_entry *dir_contents;
-    struct assoofs_inode_info *inode_info;
-    // obtengo un puntero al superbloque desde dir
-    sb = dir->i_sb;
-     // obtengo el n ́umero de inodos de lainformaci ́on persistente del superbloque
-    count = ((struct assoofs_super_block_info *)sb->s_fs_info)->inodes_count;
-
-    if(count<ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED) {
-        //CREACION NUEVO INODO
-        inode = new_inode(sb);
-        inode->i_ino = count + 1;
-        inode_info = kmalloc(sizeof(struct assoofs_inode_info), GFP_KERNEL);
-        inode_info->inode_no = inode->i_ino;
-        inode_info->mode = mode; // El segundo mode me llega como argumento
-        inode_info->file_size = 0;
-        inode->i_private = inode_info;
-        inode_init_owner(inode, dir, mode);
-        d_add(dentry, inode);
-
-        /*if (S_ISDIR(inode_info->mode))
-            inode->i_fop = &assoofs_dir_operations;
-        else if (S_ISREG(inode_info->mode))
+// Una zona cada vez: entre una y otra pasan las escrituras que estén esperando
+static void assoofs_log_clean_work(struct work_struct *work) {
+    struct assoofs_log *lg = container_of(work, struct assoofs_log, clean_work);
 
-        else
-            printk(KERN_ERR "Unknown inode type. Neither a directory nor a file.");
-*/      inode->i_fop = &assoofs_file_operations;
-        inode_info = kmem_cache_alloc(assoofs_inode_cache, GFP_KERNEL);
-        assoofs_sb_get_a_freeblock(sb, &inode_info->data_block_number);
-        assoofs_add_inode_info(sb, inode_info);// Asigno n ́umero al nuevo inodo a partir de count
-
-        //MODIFICAR EL CONTENIDO DEL DIRECTORIO PADRE  ADJUNTANDO UNA NUEVA ENTRADA PARA EL NUEVO FICHERO O DIRECTORIO
-
-        parent_inode_info = dir->i_private;
-        bh = sb_bread(sb, parent_inode_info->data_block_number);
-        dir_contents = (struct assoofs_dir_record_entry *)bh->b_data;
-        dir_contents += parent_inode_info->dir_children_count;
-        dir_contents->inode_no = inode_info->inode_no; // inode_info es la informaci ́on persistente del inodo creado en el paso 2.
-        strcpy(dir_contents->filename, dentry->d_name.name);
-        mark_buffer_dirty(bh);
-        sync_dirty_buffer(bh);
-        brelse(bh);
+    if (lg->free_zones < ASSOOFS_LOG_CLEAN_ZONES && !assoofs_log_clean_one(lg) &&
+        lg->free_zones < ASSOOFS_LOG_CLEAN_ZONES)
+        queue_work(lg->wq, &lg->clean_work);
+}
 
-        //ACTUALIZAR LA INFORMACON DEL INODO PADRE INDICANDO QUE AHORA TIENE UN ARCHIVO MAS
-        parent_inode_info->dir_children_count++;
-        assoofs_save_inode_info(sb, parent_inode_info);
-        return 0;
-    }else {
-        printk(KERN_ERR "MAXIMUM NUMBER OF OBJECTS EXCEEDED\n");
-        return -1;
-    }
+static blk_qc_t assoofs_log_submit_bio(struct bio *bio) {
+    struct assoofs_log *lg = bio->bi_disk->private_data;
 
-    return 0;
+    switch (bio_op(bio)) {
+    case REQ_OP_READ:
+        assoofs_log_read(lg, bio);
+        break;
+    case REQ_OP_WRITE:
+    case REQ_OP_DISCARD:
+        spin_lock(&lg->bio_lock);
+        bio_list_add(&lg->bios, bio);
+        spin_unlock(&lg->bio_lock);
+        queue_work(lg->wq, &lg->write_work);
+        break;
+    default:
+        bio->bi_status = BLK_STS_NOTSUPP;
+        bio_endio(bio);
+    }
+    return BLK_QC_T_NONE;
 }
 
-static int assoofs_mkdir(struct inode *dir , struct dentry *dentry, umode_t mode) {
-    printk(KERN_INFO "New directory request\n");
-    struct inode *inode;
-    uint64_t count;
-    struct buffer_head *bh;
-    struct super_block *sb;
-    struct assoofs_inode_info *parent_inode_info;
-    struct assoofs_dir_record_entry *dir_contents;
-    struct assoofs_inode_info *inode_info;
+static const struct block_device_operations assoofs_log_fops = {
+    .owner = THIS_MODULE,
+    .submit_bio = assoofs_log_submit_bio,
+};
 
-    // obtengo un puntero al superbloque desde dir
-    sb = dir->i_sb;
+/*
+ *  Aplica los registros de una zona de puntos de control. Vale si empieza por un mapa entero
+ *  completo; los cambios se siguen mientras la secuencia no se corte.
+ */
+static int assoofs_log_replay(struct assoofs_log *lg, uint64_t zone) {
+    struct assoofs_log_cp *cp;
+    struct assoofs_log_entry *e;
+    uint64_t wp = 0, seq = 0, first = ASSOOFS_LOG_FIRST_ZONE * lg->zone_blocks, last = lg->zones * lg->zone_blocks;
+    unsigned int i, j, count = 0;
+    bool end = false;
 
-    // obtengo el n ́umero de inodos de lainformaci ́on persistente del superbloque
-    count = ((struct assoofs_super_block_info *)sb->s_fs_info)->inodes_count;
-    inode = new_inode(sb);
-    if(count<ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED) {
-
-        //CREACION NUEVO INODO
-        inode->i_ino = count + 1;
-        inode_info = kmalloc(sizeof(struct assoofs_inode_info), GFP_KERNEL);
-        inode_info->inode_no = inode->i_ino;
-        inode_info->mode = S_IFDIR | mode; // El segundo mode me llega como argumento
-        inode_info->file_size = 0;
-        inode_info->dir_children_count = 0;
-        inode->i_private = inode_info;
-        inode_init_owner(inode, dir, mode);
-        d_add(dentry, inode);
-        inode->i_fop=&assoofs_dir_operations;
-        inode_info = kmem_cache_alloc(assoofs_inode_cache, GFP_KERNEL);
-        assoofs_sb_get_a_freeblock(sb, &inode_info->data_block_number);
-        assoofs_add_inode_info(sb, inode_info);// Asigno numero al nuevo inodo a partir de count
-
-
-        //MODIFICAR EL CONTENIDO DEL DIRECTORIO PADRE  ADJUNTANDO UNA NUEVA ENTRADA PARA EL NUEVO FICHERO O DIRECTORIO
-        parent_inode_info = dir->i_private;
-        bh = sb_bread(sb, parent_inode_info->data_block_number);
-        dir_contents = (struct assoofs_dir_record_entry *)bh->b_data;
-        dir_contents += parent_inode_info->dir_children_count;
-        dir_contents->inode_no = inode_info->inode_no; // inode_info es la informaci ́on persistente del inodo creado en el paso 2.
-        strcpy(dir_contents->filename, dentry->d_name.name);
-        mark_buffer_dirty(bh);
-        sync_dirty_buffer(bh);
-        brelse(bh);
-        //ACTUALOZAR LA INFORMACON DEL INODO PADRE INDICANDO QUE AHORA TIENE UN ARCHIVO MAS
-        parent_inode_info->dir_children_count++;
-        assoofs_save_inode_info(sb, parent_inode_info);
-        return 0;
+    memset(lg->map, 0, lg->logical * sizeof(*lg->map));
+    for (; wp < lg->zone_blocks; wp++) {
+        // Por tandas; si una falla (en una zona secuencial, pasado el puntero) se sigue de una en una
+        if (!count) {
+            count = min_t(uint64_t, ASSOOFS_LOG_CP_PAGES, lg->zone_blocks - wp);
+            if (assoofs_log_rw(lg, REQ_OP_READ, zone * lg->zone_blocks + wp, lg->cp_pages, count)) {
+                count = 1;
+                if (assoofs_log_rw(lg, REQ_OP_READ, zone * lg->zone_blocks + wp, lg->cp_pages, 1))
+                    break;
+            }
+            i = 0;
+        }
+        cp = page_address(lg->cp_pages[i++]);
+        count--;
+        if (cp->magic != ASSOOFS_LOG_CP_MAGIC || cp->volume_id != lg->volume_id || cp->count > ASSOOFS_LOG_CP_ENTRIES)
+            break;
+        if (wp ? cp->seq != seq + 1 : !(cp->flags & ASSOOFS_LOG_CP_BASE))
+            break;
+        seq = cp->seq;
+        for (j = 0; j < cp->count; j++) {
+            e = &cp->entries[j];
+            if (e->logical >= lg->logical || (e->physical && (e->physical < first || e->physical >= last)))
+                return -EINVAL;
+            lg->map[e->logical] = e->physical;
+        }
+        if (cp->flags & ASSOOFS_LOG_CP_END)
+            end = true;
+    }
+    if (!end)
+        return -EINVAL;
+    lg->cp_zone = zone;
+    lg->cp_wp = wp;
+    lg->seq = seq;
+    return 0;
+}
 
-    }else{
-        printk(KERN_ERR "MAXIMUM NUMBER OF OBJECTS EXCEEDED\n");
-        return -1;
+// Mapa inverso y bloques válidos por zona a partir del mapa; dos bloques en el mismo sitio es un error
+static int assoofs_log_build(struct assoofs_log *lg) {
+    uint64_t l, zone;
+    uint32_t phys;
+
+    memset(lg->rev, 0xff, lg->zones * lg->zone_blocks * sizeof(*lg->rev));
+    memset(lg->valid, 0, lg->zones * sizeof(*lg->valid));
+    for (l = 0; l < lg->logical; l++) {
+        phys = lg->map[l];
+        if (!phys)
+            continue;
+        if (lg->rev[phys] != ASSOOFS_LOG_NONE)
+            return -EINVAL;
+        lg->rev[phys] = l;
+        lg->valid[assoofs_log_zone(lg, phys)]++;
+    }
+    lg->free_zones = 0;
+    for (zone = ASSOOFS_LOG_FIRST_ZONE; zone < lg->zones; zone++) {
+        if (!lg->valid[zone])
+            lg->free_zones++;
     }
+    // Sin zona abierta: la primera escritura abre una libre
+    lg->open_zone = ASSOOFS_LOG_LABEL_ZONE;
+    lg->open_wp = lg->zone_blocks;
     return 0;
 }
 
 /*
- *  Operaciones sobre el superbloque
+ *  Lee la etiqueta y el punto de control más reciente de los dos que estén completos. Lo
+ *  escrito después del último no cuenta: nadie lo ha visto terminado con un vaciado.
  */
-static const struct super_operations assoofs_sops = {
-    .drop_inode = generic_delete_inode,
-};
-//OBTENER INFORMACION OERSISTENTE DE UN INODO
+static int assoofs_log_load(struct assoofs_log *lg) {
+    struct assoofs_log_label *label = page_address(lg->cp_pages[0]);
+    struct assoofs_log_cp *cp = page_address(lg->cp_pages[0]);
+    uint64_t dev_blocks = i_size_read(lg->bdev->bd_inode) / ASSOOFS_DEFAULT_BLOCK_SIZE, seq[2] = { 0, 0 };
+    unsigned int i, newest, zone;
+    int ret;
+
+    ret = assoofs_log_rw(lg, REQ_OP_READ, 0, lg->cp_pages, 1);
+    if (ret)
+        return ret;
+    if (label->magic != ASSOOFS_LOG_MAGIC) {
+        printk(KERN_ERR "assoofs: the device does not hold a log-structured assoofs volume\n");
+        return -EINVAL;
+    }
+    lg->zone_blocks = label->zone_blocks;
+    lg->zones = label->zones_count;
+    lg->logical = label->logical_blocks;
+    lg->volume_id = label->volume_id;
+    lg->zoned = bdev_is_zoned(lg->bdev);
+    if (!lg->zone_blocks || lg->zones <= ASSOOFS_LOG_FIRST_ZONE + 2 || lg->zones > dev_blocks / lg->zone_blocks ||
+        lg->zones * lg->zone_blocks > U32_MAX || !lg->logical ||
+        lg->logical > (lg->zones - ASSOOFS_LOG_FIRST_ZONE - 2) * lg->zone_blocks ||
+        (lg->zoned && bdev_zone_sectors(lg->bdev) != lg->zone_blocks * ASSOOFS_STRIPE_SECTORS)) {
+        printk(KERN_ERR "assoofs: bad log-structured volume geometry\n");
+        return -EINVAL;
+    }
+    lg->map = kvcalloc(lg->logical, sizeof(*lg->map), GFP_KERNEL);
+    lg->rev = kvmalloc_array(lg->zones * lg->zone_blocks, sizeof(*lg->rev), GFP_KERNEL);
+    lg->valid = kvcalloc(lg->zones, sizeof(*lg->valid), GFP_KERNEL);
+    lg->reads = kvcalloc(lg->zones, sizeof(*lg->reads), GFP_KERNEL);
+    lg->pending = kvmalloc_array(ASSOOFS_LOG_CP_PAGES * ASSOOFS_LOG_CP_ENTRIES, sizeof(*lg->pending), GFP_KERNEL);
+    if (!lg->map || !lg->rev || !lg->valid || !lg->reads || !lg->pending)
+        return -ENOMEM;
+
+    for (i = 0; i < 2; i++) {
+        if (!assoofs_log_rw(lg, REQ_OP_READ, (ASSOOFS_LOG_CP_ZONE + i) * lg->zone_blocks, lg->cp_pages, 1) &&
+            cp->magic == ASSOOFS_LOG_CP_MAGIC &&
+            cp->volume_id == lg->volume_id && (cp->flags & ASSOOFS_LOG_CP_BASE))
+            seq[i] = cp->seq;
+    }
+    // Primero el más reciente; si está a medias, el otro
+    newest = seq[1] > seq[0];
+    ret = -EINVAL;
+    for (i = 0; i < 2 && ret; i++) {
+        zone = i ? !newest : newest;
+        if (seq[zone])
+            ret = assoofs_log_replay(lg, ASSOOFS_LOG_CP_ZONE + zone);
+    }
+    if (!ret)
+        ret = assoofs_log_build(lg);
+    if (ret)
+        printk(KERN_ERR "assoofs: no usable checkpoint in the log-structured volume\n");
+    return ret;
+}
+
+static int assoofs_log_add_disk(struct assoofs_log *lg, bool rdonly) {
+    struct request_queue *q;
+
+    lg->minor = ida_alloc(&assoofs_stripe_ida, GFP_KERNEL);
+    if (lg->minor < 0)
+        return lg->minor;
+    lg->queue = q = blk_alloc_queue(NUMA_NO_NODE);
+    lg->disk = alloc_disk(1);
+    if (!lg->queue || !lg->disk)
+        return -ENOMEM;
+    blk_queue_logical_block_size(q, ASSOOFS_DEFAULT_BLOCK_SIZE);
+    blk_queue_physical_block_size(q, ASSOOFS_DEFAULT_BLOCK_SIZE);
+    blk_queue_write_cache(q, true, true);
+    // Descartar solo cambia el mapa, aunque el dispositivo no sepa hacerlo
+    blk_queue_flag_set(QUEUE_FLAG_DISCARD, q);
+    blk_queue_max_discard_sectors(q, UINT_MAX);
+    q->limits.discard_granularity = ASSOOFS_DEFAULT_BLOCK_SIZE;
+    lg->disk->major = assoofs_stripe_major;
+    lg->disk->first_minor = lg->minor;
+    lg->disk->fops = &assoofs_log_fops;
+    lg->disk->private_data = lg;
+    lg->disk->queue = q;
+    snprintf(lg->disk->disk_name, DISK_NAME_LEN, "assoofs%d", lg->minor);
+    set_capacity(lg->disk, lg->logical * ASSOOFS_STRIPE_SECTORS);
+    set_disk_ro(lg->disk, rdonly);
+    add_disk(lg->disk);
+    return 0;
+}
+
+static void assoofs_log_free(struct assoofs_log *lg) {
+    unsigned int i;
+
+    if (lg->wq)
+        destroy_workqueue(lg->wq);
+    // Lo que haya quedado sin punto de control tras el último vaciado del desmontaje
+    if (lg->pending && lg->npending && (lg->mode & FMODE_WRITE) && assoofs_log_checkpoint(lg))
+        printk(KERN_ERR "assoofs: cannot write the last checkpoint of the log\n");
+    if (lg->moved)
+        printk(KERN_INFO "assoofs: the log cleaner moved %llu blocks\n", lg->moved);
+    if (lg->disk && (lg->disk->flags & GENHD_FL_UP))
+        del_gendisk(lg->disk);
+    if (lg->queue)
+        blk_cleanup_queue(lg->queue);
+    if (lg->disk)
+        put_disk(lg->disk);
+    if (lg->minor >= 0)
+        ida_free(&assoofs_stripe_ida, lg->minor);
+    bioset_exit(&lg->bs);
+    if (!IS_ERR_OR_NULL(lg->bdev))
+        blkdev_put(lg->bdev, lg->mode);
+    for (i = 0; i < ASSOOFS_LOG_CP_PAGES; i++) {
+        if (lg->cp_pages[i])
+            __free_page(lg->cp_pages[i]);
+        if (lg->clean_pages[i])
+            __free_page(lg->clean_pages[i]);
+    }
+    kvfree(lg->map);
+    kvfree(lg->rev);
+    kvfree(lg->valid);
+    kvfree(lg->reads);
+    kvfree(lg->pending);
+    kfree(lg);
+}
+
+static struct assoofs_log *assoofs_log_create(const char *dev_name, fmode_t mode) {
+    struct assoofs_log *lg;
+    unsigned int i;
+    int ret;
+
+    lg = kzalloc(sizeof(*lg), GFP_KERNEL);
+    if (!lg)
+        return ERR_PTR(-ENOMEM);
+    lg->mode = mode;
+    lg->minor = -1;
+    spin_lock_init(&lg->bio_lock);
+    spin_lock_init(&lg->lock);
+    bio_list_init(&lg->bios);
+    init_waitqueue_head(&lg->wait);
+    INIT_WORK(&lg->write_work, assoofs_log_write_work);
+    INIT_WORK(&lg->clean_work, assoofs_log_clean_work);
+    ret = bioset_init(&lg->bs, BIO_POOL_SIZE, offsetof(struct assoofs_log_io, clone), BIOSET_NEED_RESCUER);
+    if (ret)
+        goto out;
+    ret = -ENOMEM;
+    for (i = 0; i < ASSOOFS_LOG_CP_PAGES; i++) {
+        lg->cp_pages[i] = alloc_page(GFP_KERNEL);
+        lg->clean_pages[i] = alloc_page(GFP_KERNEL);
+        if (!lg->cp_pages[i] || !lg->clean_pages[i])
+            goto out;
+    }
+    lg->wq = alloc_ordered_workqueue("assoofs_log", WQ_MEM_RECLAIM);
+    if (!lg->wq)
+        goto out;
+    lg->bdev = blkdev_get_by_path(dev_name, mode, lg);
+    if (IS_ERR(lg->bdev)) {
+        ret = PTR_ERR(lg->bdev);
+        printk(KERN_ERR "assoofs: cannot open %s (%d)\n", dev_name, ret);
+        goto out;
+    }
+    ret = assoofs_log_load(lg);
+    // Al montar de escritura se empieza zona de puntos de control: la anterior pudo quedar a medias
+    if (!ret && (mode & FMODE_WRITE))
+        ret = assoofs_log_full_cp(lg);
+    if (!ret)
+        ret = assoofs_log_add_disk(lg, !(mode & FMODE_WRITE));
+    if (!ret)
+        return lg;
+out:
+    assoofs_log_free(lg);
+    return ERR_PTR(ret);
+}
 
 /*
  *  Inicialización del superbloque
@@ -367,53 +5311,290 @@ int assoofs_fill_super(struct super_block *sb, void *data, int silent) {
     // 1.- Leer la información persistente del superbloque del dispositivo de bloques
     struct buffer_head *bh;
     struct assoofs_super_block_info *assoofs_sb;
+    struct assoofs_fs_info *fs;
     struct inode *root_inode;
-    struct assoofs_super_block *asb;
+    int ret;
+    if (!sb_set_blocksize(sb, ASSOOFS_DEFAULT_BLOCK_SIZE))
+        return -EINVAL;
     bh = sb_bread(sb, ASSOOFS_SUPERBLOCK_BLOCK_NUMBER); // sb lo recibe assoofs_fill_super como argumento
+    if (!bh)
+        return -EIO;
     assoofs_sb = (struct assoofs_super_block_info *)bh->b_data;
-    brelse(bh);
     // 2.- Comprobar los parámetros del superbloque
     if(unlikely(assoofs_sb->magic!= ASSOOFS_MAGIC)) {
         printk(KERN_ERR "assoofs_fill_super: wrong magic number, this is not a filesystem of type ASSOOFS\n");
+        if (((struct assoofs_log_label *)bh->b_data)->magic == ASSOOFS_LOG_MAGIC)
+            printk(KERN_ERR "assoofs_fill_super: it is a log-structured volume, mount it with -o log\n");
         brelse(bh);
         return -EPERM;
+    }
+    if(unlikely(assoofs_sb->version != ASSOOFS_VERSION)) {
+        printk(KERN_ERR "assoofs_fill_super: unsupported on-disk version %llu, run mkassoofs again\n", assoofs_sb->version);
+        brelse(bh);
+        return -EINVAL;
     }
      if(unlikely(assoofs_sb->block_size!= ASSOOFS_DEFAULT_BLOCK_SIZE)){
         printk(KERN_INFO "assoofs_fill_super: wrong blocksize\n");
          brelse(bh);
         return -EPERM;
     }
+    if (unlikely(assoofs_sb->devices_count > 1 && !assoofs_stripe_of(sb->s_bdev))) {
+        printk(KERN_ERR "assoofs_fill_super: the volume spans %llu devices, mount it with -o device=<dev> for each of the others\n",
+               assoofs_sb->devices_count);
+        brelse(bh);
+        return -EINVAL;
+    }
+    if (unlikely((assoofs_sb->flags & ASSOOFS_SB_SEALED) && !sb_rdonly(sb))) {
+        printk(KERN_ERR "assoofs_fill_super: this is a sealed image, mount it read-only\n");
+        brelse(bh);
+        return -EROFS;
+    }
+    // Los datos de una imagen sellada se leen en sectores de 512 bytes alineados solo a eso
+    if (unlikely((assoofs_sb->flags & ASSOOFS_SB_SEALED) && bdev_logical_block_size(sb->s_bdev) > ASSOOFS_SEALED_ALIGN)) {
+        printk(KERN_ERR "assoofs_fill_super: sealed images need a device with %d-byte logical blocks, this one has %u\n",
+               ASSOOFS_SEALED_ALIGN, bdev_logical_block_size(sb->s_bdev));
+        brelse(bh);
+        return -EINVAL;
+    }
     printk(KERN_INFO "ASSOOFS FILESYSTEM WITH \nVERSION: %llu \nBLOCKSIZE: %llu\nMAGIC NUMBER= %llu",assoofs_sb->version, assoofs_sb->block_size, assoofs_sb->magic);
     // 3.- Escribir la información persistente leída del dispositivo de bloques en el superbloque sb, incluído el campo s_op con las operaciones que soporta.
+    //Para no tener que acceder al bloque 0 del disco constantemente guardaremos la informacion léıda
+    // del bloque 0 en el campo s_fs_info del superbloque sb. El buffer se retiene hasta put_super.
+    fs = kzalloc(sizeof(*fs), GFP_KERNEL);
+    if (!fs) {
+        brelse(bh);
+        return -ENOMEM;
+    }
+    fs->sb_bh = bh;
+    sb->s_fs_info=fs;
+    mutex_init(&fs->pack_lock);
+    xa_init(&fs->packs);
+    fs->stats = alloc_percpu(struct assoofs_stats);
+    fs->inode_hint = alloc_percpu(unsigned int);
+    if (!fs->stats || !fs->inode_hint) {
+        ret = -ENOMEM;
+        goto failed;
+    }
+    fs->asb = assoofs_sb;
+    fs->sb = sb;
+    mutex_init(&fs->lock);
+    spin_lock_init(&fs->reclaim_lock);
+    INIT_LIST_HEAD(&fs->reclaim_list);
+    INIT_WORK(&fs->reclaim_work, assoofs_reclaim_work);
+    spin_lock_init(&fs->discard_lock);
+    INIT_LIST_HEAD(&fs->discard_list);
+    INIT_DELAYED_WORK(&fs->discard_work, assoofs_discard_work);
+    // Mismo shrinker que las dentries y los inodos del montaje
+    ret = list_lru_init_memcg(&fs->cache_lru, &sb->s_shrink);
+    if (ret)
+        goto failed;
     sb->s_magic=ASSOOFS_MAGIC;
-    sb->s_fs_info=assoofs_sb;
     sb->s_op=&assoofs_sops;
-sb->s_maxbytes=ASSOOFS_DEFAULT_BLOCK_SIZE;
-//Para no tener que acceder al bloque 0 del disco constantemente guardaremos la informacion léıda
-// del bloque 0 n el campo s_fs_info del superbloque sb.
-  asb=sb->s_fs_info;
-bh = sb_bread(sb, ASSOOFS_SUPERBLOCK_BLOCK_NUMBER);
-bh->b_data = (char *)asb;
-mark_buffer_dirty(bh);
-sync_dirty_buffer(bh);
-brelse(bh);
+    sb->s_maxbytes=(loff_t)U32_MAX * ASSOOFS_DEFAULT_BLOCK_SIZE; // file_block es de 32 bits
+    sb->s_max_links=ASSOOFS_LINK_MAX;
+    ret = assoofs_parse_options(sb, data);
+    if (ret)
+        goto failed;
+    assoofs_setup_discard(sb);
+    if (assoofs_sb->flags & ASSOOFS_SB_SEALED)
+        ret = assoofs_sealed_load(sb);
+    else
+        ret = assoofs_load_groups(sb);
+    if (ret)
+        goto failed;
+    ret = assoofs_sysfs_register(sb);
+    if (ret)
+        goto failed;
+
     // 4.- Crear el inodo raíz y asignarle operaciones sobre inodos (i_op) y sobre directorios (i_fop)
 
 root_inode = new_inode(sb);
 inode_init_owner(root_inode, NULL, S_IFDIR); // S_IFDIR para directorios, S_IFREG para ficheros.
 
-root_inode->i_ino = ASSOOFS_ROOTDIR_INODE_NUMBER; // ńumero de inodo
+root_inode->i_ino = ASSOOFS_ROOTDIR_INODE_NUMBER; // ńumero de inodo
 root_inode->i_sb = sb; // puntero al superbloque
 root_inode->i_op = &assoofs_inode_ops; // direcci ́on de una variable de tipo struct inode_operations previamente declarada
 root_inode->i_fop = &assoofs_dir_operations; // direccion de una variable de tipo struct file_operations previamente declarada
 root_inode->i_atime = root_inode->i_mtime = root_inode->i_ctime = current_time(root_inode); // fechas.
 root_inode->i_private = assoofs_get_inode_info(sb, ASSOOFS_ROOTDIR_INODE_NUMBER); // Informaci ́on persistente del inodo
+if (fs->sealed && root_inode->i_private)
+    assoofs_sealed_set_ops(root_inode, root_inode->i_private);
 sb->s_root = d_make_root(root_inode);
 if (!sb->s_root){
-    brelse(bh);
-    return -ENOMEM;
+    assoofs_sysfs_unregister(sb);
+    ret = -ENOMEM;
+    goto failed;
 }
+    // 5.- Marcar el volumen en uso y terminar de liberar lo que se borró antes de un corte
+    if (!sb_rdonly(sb)) {
+        assoofs_set_clean(sb, false);
+        assoofs_process_orphans(sb);
+    }
 return 0;
+
+failed:
+    assoofs_free_fs_info(sb);
+    return ret;
+}
+
+static int assoofs_set_bdev_super(struct super_block *sb, void *data) {
+    sb->s_bdev = data;
+    sb->s_dev = sb->s_bdev->bd_dev;
+    sb->s_bdi = bdi_get(sb->s_bdev->bd_bdi);
+    return 0;
+}
+
+/*
+ *  Lo que hace mount_bdev, en dos partes, sobre un disco virtual ya creado. Si sget falla el
+ *  disco sigue siendo de quien llama; después lo suelta assoofs_kill_sb.
+ */
+static struct super_block *assoofs_vdisk_sget(struct file_system_type *fs_type, int flags, struct gendisk *disk, fmode_t mode) {
+    struct block_device *bdev;
+    struct super_block *s;
+
+    bdev = blkdev_get_by_dev(disk_devt(disk), mode, fs_type);
+    if (IS_ERR(bdev))
+        return ERR_CAST(bdev);
+    s = sget(fs_type, NULL, assoofs_set_bdev_super, flags | SB_NOSEC, bdev);
+    if (IS_ERR(s)) {
+        blkdev_put(bdev, mode);
+        return s;
+    }
+    s->s_mode = mode;
+    snprintf(s->s_id, sizeof(s->s_id), "%pg", bdev);
+    return s;
+}
+
+static int assoofs_vdisk_fill(struct super_block *s, void *data, int flags) {
+    int ret;
+
+    ret = assoofs_fill_super(s, data, flags & SB_SILENT ? 1 : 0);
+    if (ret) {
+        deactivate_locked_super(s);
+        return ret;
+    }
+    s->s_flags |= SB_ACTIVE;
+    s->s_bdev->bd_super = s;
+    return 0;
+}
+
+/*
+ *  mount -o device=<miembro 1>,device=<miembro 2>,... <miembro 0>: abre los miembros, monta
+ *  el disco virtual igual que mount_bdev y lo deshace assoofs_kill_sb al desmontar. Los
+ *  miembros se abren en exclusiva para este montaje, así que no se puede montar dos veces.
+ */
+static struct dentry *assoofs_stripe_mount(struct file_system_type *fs_type, int flags, const char *dev_name, void *data) {
+    fmode_t mode = FMODE_READ | FMODE_EXCL | (flags & SB_RDONLY ? 0 : FMODE_WRITE);
+    const char *paths[ASSOOFS_MAX_DEVICES];
+    struct assoofs_stripe *st = NULL;
+    struct super_block *s;
+    unsigned int count = 1, i;
+    char *opts, *o, *p;
+    uint64_t blocks;
+    int ret;
+
+    opts = o = kstrdup(data, GFP_KERNEL);
+    if (!opts)
+        return ERR_PTR(-ENOMEM);
+    paths[0] = dev_name;
+    ret = 0;
+    while ((p = strsep(&o, ",")) != NULL) {
+        if (strncmp(p, "device=", 7))
+            continue;
+        if (count == ASSOOFS_MAX_DEVICES) {
+            printk(KERN_ERR "assoofs: more than %d devices\n", ASSOOFS_MAX_DEVICES);
+            ret = -EINVAL;
+            goto out;
+        }
+        paths[count++] = p + 7;
+    }
+    st = kzalloc(struct_size(st, members, count), GFP_KERNEL);
+    if (!st) {
+        ret = -ENOMEM;
+        goto out;
+    }
+    st->count = count;
+    st->mode = mode;
+    st->minor = -1;
+    spin_lock_init(&st->flush_lock);
+    bio_list_init(&st->flush_bios);
+    INIT_WORK(&st->flush_work, assoofs_stripe_flush_work);
+    ret = bioset_init(&st->bs, BIO_POOL_SIZE, 0, BIOSET_NEED_RESCUER);
+    if (ret)
+        goto out;
+    st->wq = alloc_workqueue("assoofs_stripe", WQ_MEM_RECLAIM, 0);
+    if (!st->wq) {
+        ret = -ENOMEM;
+        goto out;
+    }
+    for (i = 0; i < count; i++) {
+        st->members[i] = blkdev_get_by_path(paths[i], mode, st);
+        if (IS_ERR(st->members[i])) {
+            ret = PTR_ERR(st->members[i]);
+            printk(KERN_ERR "assoofs: cannot open %s (%d)\n", paths[i], ret);
+            goto out;
+        }
+    }
+    ret = assoofs_stripe_check(st, &blocks);
+    if (!ret)
+        ret = assoofs_stripe_add_disk(st, blocks, flags & SB_RDONLY);
+    if (ret)
+        goto out;
+
+    s = assoofs_vdisk_sget(fs_type, flags, st->disk, mode);
+    if (IS_ERR(s)) {
+        ret = PTR_ERR(s);
+        goto out;
+    }
+    // A partir de aquí el disco virtual y los miembros los suelta assoofs_kill_sb
+    kfree(opts);
+    ret = assoofs_vdisk_fill(s, data, flags);
+    if (ret)
+        return ERR_PTR(ret);
+    printk(KERN_INFO "assoofs: %s striped over %u devices in units of %u blocks\n", s->s_id, count, st->stripe);
+    return dget(s->s_root);
+
+out:
+    if (st)
+        assoofs_stripe_free(st);
+    kfree(opts);
+    return ERR_PTR(ret);
+}
+
+// mount -o log <dispositivo>: el volumen se monta sobre el disco virtual del registro
+static struct dentry *assoofs_log_mount(struct file_system_type *fs_type, int flags, const char *dev_name, void *data) {
+    fmode_t mode = FMODE_READ | FMODE_EXCL | (flags & SB_RDONLY ? 0 : FMODE_WRITE);
+    struct assoofs_log *lg;
+    struct super_block *s;
+    int ret;
+
+    lg = assoofs_log_create(dev_name, mode);
+    if (IS_ERR(lg))
+        return ERR_CAST(lg);
+    s = assoofs_vdisk_sget(fs_type, flags, lg->disk, mode);
+    if (IS_ERR(s)) {
+        assoofs_log_free(lg);
+        return ERR_CAST(s);
+    }
+    ret = assoofs_vdisk_fill(s, data, flags);
+    if (ret)
+        return ERR_PTR(ret);
+    printk(KERN_INFO "assoofs: %s logged on %s in %llu zones of %llu blocks\n", s->s_id, dev_name, lg->zones, lg->zone_blocks);
+    return dget(s->s_root);
+}
+
+// ¿Está name entre las opciones, separadas por comas?
+static bool assoofs_has_option(const char *data, const char *name) {
+    size_t len = strlen(name);
+
+    while (data && *data) {
+        if (!strncmp(data, name, len) && (data[len] == ',' || !data[len]))
+            return true;
+        data = strchr(data, ',');
+        if (data)
+            data++;
+    }
+    return false;
 }
 
 /*
@@ -421,18 +5602,38 @@ return 0;
  */
 static struct dentry *assoofs_mount(struct file_system_type *fs_type, int flags, const char *dev_name, void *data) {
     printk(KERN_INFO "assoofs_mount request\n");
-    struct dentry *ret = mount_bdev(fs_type, flags, dev_name, data, assoofs_fill_super);
+    struct dentry *ret;
+
+    if (data && (!strncmp(data, "device=", 7) || strstr(data, ",device="))) {
+        if (assoofs_has_option(data, "log")) {
+            printk(KERN_ERR "assoofs: a log-structured volume lives on a single device\n");
+            return ERR_PTR(-EINVAL);
+        }
+        ret = assoofs_stripe_mount(fs_type, flags, dev_name, data);
+    } else if (assoofs_has_option(data, "log"))
+        ret = assoofs_log_mount(fs_type, flags, dev_name, data);
+    else
+        ret = mount_bdev(fs_type, flags, dev_name, data, assoofs_fill_super);
     // Control de errores a partir del valor de ret. En este caso se puede utilizar la macro IS_ERR: if (IS_ERR(ret)) ...
     if (IS_ERR(ret)) {
         printk(KERN_ERR"Failed to unregister assoofs");
     }
+    return ret;
 };
 
-void assoofs_destroy_inode(struct inode *inode) {
-    struct assoofs_inode *inode_info = inode->i_private;
-    printk(KERN_INFO "Freeing private data of inode %p ( %lu)\n", inode_info, inode->i_ino);
-    kmem_cache_free(assoofs_inode_cache, inode_info);
+// Un volumen de varios dispositivos o en modo registro deshace además su disco virtual
+static void assoofs_kill_sb(struct super_block *sb) {
+    struct assoofs_stripe *st = assoofs_stripe_of(sb->s_bdev);
+    struct assoofs_log *lg = assoofs_log_of(sb->s_bdev);
+
+    kill_block_super(sb);
+    if (st)
+        assoofs_stripe_free(st);
+    if (lg)
+        assoofs_log_free(lg);
 }
+
+
 /*
  *  assoofs file system type
  */
@@ -440,23 +5641,54 @@ static struct file_system_type assoofs_type = {
     .owner   = THIS_MODULE,
     .name    = "assoofs",
     .mount   = assoofs_mount,
-    .kill_sb = kill_litter_super,
+    .kill_sb = assoofs_kill_sb,
 };
 
+#if IS_ENABLED(CONFIG_ASSOOFS_KUNIT_TEST)
+#include "assoofs-test.c"
+#else
+static inline void assoofs_test_run(void) { }
+static inline void assoofs_test_done(void) { }
+#endif
 
 static int __init assoofs_init(void) {
     printk(KERN_INFO "assoofs_init request\n");
-    assoofs_inode_cache = kmem_cache_create("assoofs_inode_cache",sizeof(struct assoofs_inode_info),0,(SLAB_RECLAIM_ACCOUNT | SLAB_MEM_SPREAD), NULL);
+    assoofs_inode_cache = kmem_cache_create("assoofs_inode_cache",sizeof(struct assoofs_inode),0,(SLAB_RECLAIM_ACCOUNT | SLAB_MEM_SPREAD), NULL);
     if(!assoofs_inode_cache) return -ENOMEM;
+    assoofs_fext_cache = kmem_cache_create("assoofs_fext_cache", sizeof(struct assoofs_free_extent), 0, SLAB_RECLAIM_ACCOUNT, NULL);
+    if (!assoofs_fext_cache) {
+        kmem_cache_destroy(assoofs_inode_cache);
+        return -ENOMEM;
+    }
+
+    assoofs_kobj_root = kobject_create_and_add("assoofs", fs_kobj);
+    if (!assoofs_kobj_root) {
+        kmem_cache_destroy(assoofs_fext_cache);
+        kmem_cache_destroy(assoofs_inode_cache);
+        return -ENOMEM;
+    }
+    // Discos virtuales de los volúmenes de varios dispositivos
+    assoofs_stripe_major = register_blkdev(0, "assoofs");
+    if (assoofs_stripe_major < 0) {
+        kobject_put(assoofs_kobj_root);
+        kmem_cache_destroy(assoofs_fext_cache);
+        kmem_cache_destroy(assoofs_inode_cache);
+        return assoofs_stripe_major;
+    }
 
     int ret = register_filesystem(&assoofs_type);
     // Control de errores a partir del valor de ret
     if(ret == 0) {
         printk(KERN_INFO
         "Succesfully registered assoofs\n");
+        assoofs_test_run();
         return 0;
     }else{
         printk(KERN_ERR "Failed to register assooff");
+        unregister_blkdev(assoofs_stripe_major, "assoofs");
+        kobject_put(assoofs_kobj_root);
+        kmem_cache_destroy(assoofs_fext_cache);
+        kmem_cache_destroy(assoofs_inode_cache);
         return -EPERM;
     }
 
@@ -464,9 +5696,13 @@ static int __init assoofs_init(void) {
 
 static void __exit assoofs_exit(void) {
     printk(KERN_INFO "assoofs_exit request\n");
+    assoofs_test_done();
     int ret = unregister_filesystem(&assoofs_type);
     // Control de errores a partir del valor de ret
+    unregister_blkdev(assoofs_stripe_major, "assoofs");
+    kobject_put(assoofs_kobj_root);
     kmem_cache_destroy(assoofs_inode_cache);
+    kmem_cache_destroy(assoofs_fext_cache);
     if(ret == 0) {
         printk(KERN_INFO
         "Succesfully unregistered assoofs\n");
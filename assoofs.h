@@ -1,36 +1,204 @@
 #define ASSOOFS_MAGIC 0x20170509
+#define ASSOOFS_VERSION 7
 #define ASSOOFS_DEFAULT_BLOCK_SIZE 4096
 #define ASSOOFS_FILENAME_MAXLEN 255
 #define ASSOOFS_START_INO 10
 #define ASSOOFS_RESERVED_INODES 3 
-#define ASSOOFS_LAST_RESERVED_BLOCK ASSOOFS_ROOTDIR_DATABLOCK_NUMBER
-#define ASSOOFS_LAST_RESERVED_INODE ASSOOFS_INODESTORE_BLOCK_NUMBER
+#define ASSOOFS_INLINE_SYMLINK_LEN 32
+#define ASSOOFS_BITS_PER_BLOCK (ASSOOFS_DEFAULT_BLOCK_SIZE * 8)
+#define ASSOOFS_MAX_BLOCKS_PER_GROUP ASSOOFS_BITS_PER_BLOCK /* un bloque de mapa por grupo */
 const int ASSOOFS_SUPERBLOCK_BLOCK_NUMBER = 0;
-const int ASSOOFS_INODESTORE_BLOCK_NUMBER = 1;
-const int ASSOOFS_ROOTDIR_DATABLOCK_NUMBER = 2;
+const int ASSOOFS_GDT_BLOCK_NUMBER = 1;      /* tabla de descriptores de grupo */
 const int ASSOOFS_ROOTDIR_INODE_NUMBER = 1;
-const int ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED = 64;
 
 struct assoofs_super_block_info {
     uint64_t version;
     uint64_t magic;
     uint64_t block_size;    
-    uint64_t inodes_count;
-    uint64_t free_blocks;
+    uint64_t inodes_count;  /* inodos en uso (resumen, se recalcula desde los grupos al montar) */
+    uint64_t free_blocks;   /* bloques libres (resumen, ídem) */
+    uint64_t orphan_head;   /* primer inodo sin enlaces pendiente de liberar, 0 si no hay */
+    uint64_t blocks_count;  /* tamaño del dispositivo en bloques */
+    uint64_t groups_count;
+    uint64_t blocks_per_group;
+    uint64_t inodes_per_group;
+    uint64_t first_group_block; /* primer bloque del grupo 0, tras la tabla de descriptores */
+    uint64_t devices_count; /* miembros de un volumen repartido; 0 es un solo dispositivo */
+    uint64_t stripe_blocks; /* unidad de reparto de los datos entre los miembros */
+    uint64_t volume_id;     /* el mismo en la etiqueta de cada miembro */
+    uint64_t flags;         /* ASSOOFS_SB_* */
+    uint64_t meta_blocks;   /* imagen sellada: bloques de metadatos tras el superbloque */
+    char padding[3968];
+};
+
+// Montado de escritura se quita y al desmontar se vuelve a poner con el resumen al día
+#define ASSOOFS_SB_CLEAN 0x2        /* desmontado bien: los descriptores cuadran con los mapas */
+
+/*
+ *  Imágenes selladas (mkassoofs -S), solo para montar de lectura: tras el superbloque van
+ *  meta_blocks bloques seguidos con los inodos por número, las entradas de cada directorio
+ *  ordenadas por nombre (strcmp) y los destinos de los enlaces largos; en directorios y
+ *  enlaces data_block_number es el byte de esta zona donde empiezan. Detrás van los datos de
+ *  los ficheros uno tras otro, sin redondear a bloques: cada uno en sealed_offset, alineado
+ *  a ASSOOFS_SEALED_ALIGN y con el final de su último sector a cero.
+ */
+#define ASSOOFS_SB_SEALED 0x1
+#define ASSOOFS_SEALED_META_BLOCK 1
+#define ASSOOFS_SEALED_ALIGN 512
+
+/*
+ *  Volúmenes de varios dispositivos: los bloques de datos de los grupos se reparten por turno
+ *  entre los miembros en unidades de stripe_blocks; el superbloque, la tabla de descriptores y
+ *  los metadatos de cada grupo van repetidos en todos. Cada miembro guarda, por este orden, el
+ *  superbloque y la tabla (en los mismos bloques que en el volumen), su etiqueta, los metadatos
+ *  de todos los grupos seguidos y sus unidades de datos.
+ */
+#define ASSOOFS_MEMBER_MAGIC 0x6d656d62
+#define ASSOOFS_MAX_DEVICES 16
+
+struct assoofs_member_label {
+    uint64_t magic;
+    uint64_t volume_id;
+    uint64_t index;         /* posición del miembro; el 0 es el que se pasa a mount */
+    uint64_t devices_count;
+    char padding[4064];
+};
+
+/*
+ *  Modo registro (mkassoofs -L), para dispositivos por zonas o que solo escriben seguido: el
+ *  volumen de siempre se ve a través de un disco virtual que escribe cada bloque al final de la
+ *  zona abierta y apunta en un mapa dónde ha quedado. La zona 0 solo guarda la etiqueta; la 1 y
+ *  la 2 se turnan los puntos de control del mapa y el resto son del registro. Un punto de
+ *  control empieza con el mapa entero (de ASSOOFS_LOG_CP_BASE a ASSOOFS_LOG_CP_END) y sigue
+ *  con los cambios, cada registro con el número de secuencia siguiente al anterior.
+ */
+#define ASSOOFS_LOG_MAGIC 0x6c6f6773
+#define ASSOOFS_LOG_CP_MAGIC 0x6c6f6763
+#define ASSOOFS_LOG_LABEL_ZONE 0
+#define ASSOOFS_LOG_CP_ZONE 1
+#define ASSOOFS_LOG_FIRST_ZONE 3
+#define ASSOOFS_LOG_CP_BASE 0x1     /* primer registro de un mapa entero: se empieza de cero */
+#define ASSOOFS_LOG_CP_END 0x2      /* último registro de un mapa entero */
+
+struct assoofs_log_label {
+    uint64_t magic;
+    uint64_t zone_blocks;
+    uint64_t zones_count;
+    uint64_t logical_blocks;    /* tamaño del volumen que se ve por encima */
+    uint64_t volume_id;         /* también en cada registro: los de un volumen anterior no valen */
     char padding[4056];
 };
 
+// physical 0 (la etiqueta) no es del registro: marca un bloque lógico sin escribir, que se lee a ceros
+struct assoofs_log_entry {
+    uint32_t logical;
+    uint32_t physical;
+};
+
+#define ASSOOFS_LOG_CP_ENTRIES ((ASSOOFS_DEFAULT_BLOCK_SIZE - 32) / sizeof(struct assoofs_log_entry))
+
+struct assoofs_log_cp {
+    uint64_t magic;
+    uint64_t volume_id;
+    uint64_t seq;
+    uint32_t count;
+    uint32_t flags;             /* ASSOOFS_LOG_CP_* */
+    struct assoofs_log_entry entries[ASSOOFS_LOG_CP_ENTRIES];
+};
+
+/*
+ *  Grupos de asignación: el dispositivo se divide en grupos con su propio mapa de
+ *  bloques libres, mapa de inodos libres y trozo del almacén de inodos.
+ *  En los mapas, igual que antes en free_blocks, un bit a 1 significa libre.
+ */
+struct assoofs_group_desc {
+    uint64_t block_bitmap;      /* bloque con el mapa de bloques libres del grupo */
+    uint64_t inode_bitmap;      /* bloque con el mapa de huecos libres del almacén de inodos */
+    uint64_t inode_table;       /* primer bloque del almacén de inodos del grupo */
+    uint64_t free_blocks_count;
+    uint64_t free_inodes_count;
+    uint64_t dirs_count;
+    uint64_t refcount_table;    /* un byte por bloque: referencias de más por reflink */
+    char padding[8];
+};
+
 struct assoofs_dir_record_entry {
     char filename[ASSOOFS_FILENAME_MAXLEN];
     uint64_t inode_no;
 };
 
+/*
+ *  Los ficheros regulares guardan sus datos en extents: tramos de bloques contiguos.
+ *  Los primeros van dentro del inodo y el resto en un bloque de extents propio.
+ */
+struct assoofs_extent {
+    uint32_t file_block;    /* primer bloque dentro del fichero */
+    uint32_t len;           /* número de bloques contiguos */
+    uint64_t start;         /* primer bloque en el dispositivo */
+};
+
+#define ASSOOFS_INLINE_EXTENTS 3
+#define ASSOOFS_EXTENTS_PER_BLOCK (ASSOOFS_DEFAULT_BLOCK_SIZE / sizeof(struct assoofs_extent))
+#define ASSOOFS_MAX_EXTENTS (ASSOOFS_INLINE_EXTENTS + ASSOOFS_EXTENTS_PER_BLOCK)
+
+#define ASSOOFS_INODE_SHARED 0x1  /* puede tener bloques compartidos: escribir exige copiarlos antes */
+#define ASSOOFS_INODE_PACKED 0x2  /* fichero pequeño guardado en un bloque de paquetes, sin extents */
+
 struct assoofs_inode_info {
     mode_t mode;
+    uint32_t links_count;
     uint64_t inode_no;
-    uint64_t data_block_number;
+    union {
+        uint64_t data_block_number;
+        /* destino de enlaces simbólicos cortos, guardado dentro del propio inodo */
+        char inline_symlink[ASSOOFS_INLINE_SYMLINK_LEN];
+    };
     union {
         uint64_t file_size;
         uint64_t dir_children_count;
     };
-};
\ No newline at end of file
+    uint64_t orphan_next;   /* siguiente inodo en la lista de huérfanos */
+    uint32_t extents_count; /* solo ficheros regulares; data_block_number no se usa */
+    uint32_t flags;         /* ASSOOFS_INODE_* */
+    uint64_t extent_block;  /* extents a partir del ASSOOFS_INLINE_EXTENTS, 0 si no hace falta */
+    union {
+        struct assoofs_extent extents[ASSOOFS_INLINE_EXTENTS];
+        struct {
+            uint64_t pack_block;    /* bloque de paquetes con los datos */
+            uint16_t pack_offset;   /* dentro del bloque, múltiplo de ASSOOFS_PACK_SLOT */
+            uint16_t pack_size;     /* bytes reservados, también múltiplo */
+            uint32_t pack_len;      /* bytes con datos; lo que siga hasta file_size se lee como ceros */
+        };
+        uint64_t sealed_offset;     /* imagen sellada: byte del dispositivo donde empiezan los datos */
+    };
+};
+
+/*
+ *  Empaquetado: los ficheros de hasta ASSOOFS_PACK_MAX bytes no ocupan un bloque entero
+ *  sino trozos de ASSOOFS_PACK_SLOT bytes de un bloque compartido. El primer trozo de cada
+ *  bloque de paquetes es su cabecera, con un bit por trozo ocupado (el 0 es ella misma).
+ */
+#define ASSOOFS_PACK_MAGIC 0x7061636b
+#define ASSOOFS_PACK_SLOT 256
+#define ASSOOFS_PACK_SLOTS (ASSOOFS_DEFAULT_BLOCK_SIZE / ASSOOFS_PACK_SLOT)
+#define ASSOOFS_PACK_MAX (ASSOOFS_DEFAULT_BLOCK_SIZE / 2)
+#define ASSOOFS_PACK_MASK(offset, size) \
+    ((uint16_t)(((1U << ((size) / ASSOOFS_PACK_SLOT)) - 1) << ((offset) / ASSOOFS_PACK_SLOT)))
+
+struct assoofs_pack_header {
+    uint32_t magic;
+    uint16_t used;          /* bit i: trozo i ocupado */
+    uint16_t padding;
+};
+
+/*
+ *  Desfragmentación en línea: sobre un fichero regular abierto para escritura mueve sus
+ *  bloques a tramos libres contiguos y cambia su mapa de extents de una vez.
+ */
+struct assoofs_defrag_info {
+    uint32_t extents_before;
+    uint32_t extents_after;
+    uint64_t blocks_moved;
+};
+
+#define ASSOOFS_IOC_DEFRAG _IOR(0xa5, 1, struct assoofs_defrag_info)
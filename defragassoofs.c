@@ -0,0 +1,153 @@
+#define _XOPEN_SOURCE 700
+#include <unistd.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "assoofs.h"
+
+/*
+ *  Desfragmenta ficheros de un assoofs montado sin desmontarlo: para cada fichero regular
+ *  (los directorios se recorren enteros) pide al módulo ASSOOFS_IOC_DEFRAG, que copia sus
+ *  bloques a tramos contiguos y cambia su mapa de extents con el fichero abierto.
+ */
+static bool dry_run;
+static bool verbose;
+static unsigned int min_extents = 2;
+static uint64_t files_seen, files_moved, blocks_moved, extents_before, extents_after;
+static int status;
+
+// Extents según FIEMAP; con fm_extent_count a 0 el kernel solo los cuenta
+static int count_extents(int fd, uint32_t *count) {
+    struct fiemap fm;
+
+    memset(&fm, 0, sizeof(fm));
+    fm.fm_length = FIEMAP_MAX_OFFSET;
+    fm.fm_flags = FIEMAP_FLAG_SYNC;
+    if (ioctl(fd, FS_IOC_FIEMAP, &fm) < 0)
+        return -1;
+    *count = fm.fm_mapped_extents;
+    return 0;
+}
+
+static void defrag_file(const char *path) {
+    struct assoofs_defrag_info info;
+    uint32_t count;
+    int fd;
+
+    fd = open(path, (dry_run ? O_RDONLY : O_RDWR) | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        status = 1;
+        return;
+    }
+    files_seen++;
+    if (count_extents(fd, &count) < 0) {
+        fprintf(stderr, "%s: cannot map extents: %s\n", path, strerror(errno));
+        status = 1;
+        goto out;
+    }
+    if (count < min_extents) {
+        if (verbose)
+            printf("%s: %u extent(s), left alone\n", path, count);
+        goto out;
+    }
+    if (dry_run) {
+        printf("%s: %u extents\n", path, count);
+        goto out;
+    }
+    if (ioctl(fd, ASSOOFS_IOC_DEFRAG, &info) < 0) {
+        if (errno == ENOTTY)
+            fprintf(stderr, "%s: not on an assoofs volume\n", path);
+        else if (errno == EOPNOTSUPP)
+            fprintf(stderr, "%s: shares blocks with a clone, skipped\n", path);
+        else if (errno == ENOSPC)
+            fprintf(stderr, "%s: not enough contiguous free space\n", path);
+        else
+            fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        if (errno != EOPNOTSUPP)
+            status = 1;
+        goto out;
+    }
+    extents_before += info.extents_before;
+    extents_after += info.extents_after;
+    if (info.blocks_moved) {
+        files_moved++;
+        blocks_moved += info.blocks_moved;
+    }
+    if (verbose || info.blocks_moved)
+        printf("%s: %u -> %u extents, %llu blocks moved\n", path, info.extents_before, info.extents_after,
+               (unsigned long long)info.blocks_moved);
+out:
+    close(fd);
+}
+
+static int walk_entry(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    if (type == FTW_F && S_ISREG(st->st_mode))
+        defrag_file(path);
+    else if (type == FTW_DNR || type == FTW_NS) {
+        fprintf(stderr, "%s: cannot read\n", path);
+        status = 1;
+    }
+    return 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-n] [-v] [-m min_extents] <file|dir>...\n", prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    struct stat st;
+    int opt, i;
+
+    while ((opt = getopt(argc, argv, "nvm:")) != -1) {
+        switch (opt) {
+        case 'n':
+            dry_run = true;
+            break;
+        case 'v':
+            verbose = true;
+            break;
+        case 'm':
+            min_extents = strtoul(optarg, NULL, 0);
+            if (min_extents < 2)
+                min_extents = 2;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind >= argc)
+        usage(argv[0]);
+
+    for (i = optind; i < argc; i++) {
+        if (lstat(argv[i], &st) < 0) {
+            perror(argv[i]);
+            status = 1;
+            continue;
+        }
+        // FTW_MOUNT: no se sale del sistema de ficheros del argumento
+        if (S_ISDIR(st.st_mode))
+            nftw(argv[i], walk_entry, 16, FTW_PHYS | FTW_MOUNT);
+        else if (S_ISREG(st.st_mode))
+            defrag_file(argv[i]);
+        else
+            fprintf(stderr, "%s: not a regular file or directory\n", argv[i]);
+    }
+
+    if (!dry_run)
+        printf("%llu files checked, %llu defragmented, %llu blocks moved, extents %llu -> %llu\n",
+               (unsigned long long)files_seen, (unsigned long long)files_moved, (unsigned long long)blocks_moved,
+               (unsigned long long)extents_before, (unsigned long long)extents_after);
+    return status;
+}
@@ -1,157 +1,1883 @@
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <stdio.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/blkzoned.h>
+#include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <search.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/random.h>
+#include <time.h>
 #include "assoofs.h"
-#define WELCOMEFILE_DATABLOCK_NUMBER (ASSOOFS_LAST_RESERVED_BLOCK + 1)
-#define WELCOMEFILE_INODE_NUMBER (ASSOOFS_LAST_RESERVED_INODE + 1)
+#define WELCOMEFILE_INODE_NUMBER (ASSOOFS_ROOTDIR_INODE_NUMBER + 1)
+#define INODES_PER_BLOCK (ASSOOFS_DEFAULT_BLOCK_SIZE / sizeof(struct assoofs_inode_info))
+#define DESCS_PER_BLOCK (ASSOOFS_DEFAULT_BLOCK_SIZE / sizeof(struct assoofs_group_desc))
+#define MAX_DIR_ENTRIES (ASSOOFS_DEFAULT_BLOCK_SIZE / sizeof(struct assoofs_dir_record_entry))
+#define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
+#define COPY_CHUNK (1024 * 1024)        /* tamaño de las lecturas de la fuente y de las escrituras */
 
-static int write_superblock(int fd) {
-    struct assoofs_super_block_info sb = {
-        .version = 1,
-        .magic = ASSOOFS_MAGIC,
-        .block_size = ASSOOFS_DEFAULT_BLOCK_SIZE,
-        .inodes_count = WELCOMEFILE_INODE_NUMBER,
-        .free_blocks = (~0) & ~(15),
+/*
+ *  Geometría: bloque 0 superbloque, después la tabla de descriptores y después los grupos.
+ *  Cada grupo empieza por su mapa de bloques, su mapa de inodos, sus contadores de referencias
+ *  y su trozo del almacén de inodos.
+ */
+struct geometry {
+    uint64_t blocks_count;
+    uint64_t groups_count;
+    uint64_t blocks_per_group;
+    uint64_t inodes_per_group;
+    uint64_t first_group_block;
+};
+
+static uint64_t group_first_block(const struct geometry *g, uint64_t group) {
+    return g->first_group_block + group * g->blocks_per_group;
+}
+
+static uint64_t group_nblocks(const struct geometry *g, uint64_t group) {
+    uint64_t left = g->blocks_count - group_first_block(g, group);
+
+    return left < g->blocks_per_group ? left : g->blocks_per_group;
+}
+
+// Un byte de contador de referencias por bloque del grupo
+static uint64_t group_refcount_blocks(const struct geometry *g) {
+    return DIV_ROUND_UP(g->blocks_per_group, ASSOOFS_DEFAULT_BLOCK_SIZE);
+}
+
+// Bloques de metadatos al principio de cada grupo
+static uint64_t group_meta_blocks(const struct geometry *g) {
+    return 2 + group_refcount_blocks(g) + g->inodes_per_group / INODES_PER_BLOCK;
+}
+
+static int device_blocks(int fd, uint64_t *blocks) {
+    struct stat st;
+    uint64_t bytes;
+
+    if (fstat(fd, &st)) {
+        perror("Error reading the device size");
+        return -1;
+    }
+    bytes = st.st_size;
+    if (S_ISBLK(st.st_mode) && ioctl(fd, BLKGETSIZE64, &bytes)) {
+        perror("Error reading the device size");
+        return -1;
+    }
+    *blocks = bytes / ASSOOFS_DEFAULT_BLOCK_SIZE;
+    return 0;
+}
+
+static int compute_geometry(uint64_t blocks, uint64_t bpg, struct geometry *g) {
+    uint64_t gdt = 1, prev;
+
+    if (!bpg || bpg > ASSOOFS_MAX_BLOCKS_PER_GROUP)
+        bpg = ASSOOFS_MAX_BLOCKS_PER_GROUP;
+    g->blocks_count = blocks;
+    if (blocks < 1 + gdt + 6) {
+        printf("The device is too small: %llu blocks.\n", (unsigned long long)blocks);
+        return -1;
+    }
+    if (bpg > blocks - 1 - gdt)
+        bpg = blocks - 1 - gdt;
+    g->blocks_per_group = bpg;
+    // Un inodo por cada 8 bloques, redondeado a bloques enteros del almacén
+    g->inodes_per_group = DIV_ROUND_UP(bpg / 8, INODES_PER_BLOCK) * INODES_PER_BLOCK;
+    if (g->inodes_per_group < INODES_PER_BLOCK)
+        g->inodes_per_group = INODES_PER_BLOCK;
+    // La tabla de descriptores depende del número de grupos y viceversa
+    do {
+        prev = gdt;
+        g->groups_count = DIV_ROUND_UP(blocks - 1 - gdt, bpg);
+        gdt = DIV_ROUND_UP(g->groups_count, DESCS_PER_BLOCK);
+    } while (gdt != prev);
+    g->first_group_block = 1 + gdt;
+    // Un último grupo sin sitio para sus metadatos y algún dato no sirve: se deja fuera
+    if (group_nblocks(g, g->groups_count - 1) <= group_meta_blocks(g)) {
+        g->groups_count--;
+        g->blocks_count = group_first_block(g, g->groups_count);
+    }
+    // El grupo 0 guarda además el directorio raíz y README.txt
+    if (!g->groups_count || group_nblocks(g, 0) < group_meta_blocks(g) + 2) {
+        printf("The device is too small: %llu blocks.\n", (unsigned long long)blocks);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ *  Volumen de varios dispositivos (-m): los datos de los grupos se reparten por turno entre los
+ *  miembros en unidades de stripe_blocks y los metadatos se escriben en todos, como en assoofs.h.
+ *  El miembro 0 es el dispositivo de la línea de órdenes.
+ */
+struct stripe {
+    int fds[ASSOOFS_MAX_DEVICES];
+    const char *paths[ASSOOFS_MAX_DEVICES];
+    unsigned int count;
+    uint64_t stripe_blocks;
+    uint64_t header;            /* first_group_block */
+    uint64_t meta;              /* group_meta_blocks */
+    uint64_t blocks_per_group;
+    uint64_t data_start;        /* primer bloque de datos en cada miembro */
+};
+
+static struct stripe stripe = { .count = 1, .stripe_blocks = 16 };
+
+static void stripe_setup(const struct geometry *g) {
+    stripe.header = g->first_group_block;
+    stripe.meta = group_meta_blocks(g);
+    stripe.blocks_per_group = g->blocks_per_group;
+    stripe.data_start = stripe.header + 1 + g->groups_count * stripe.meta;
+}
+
+// Bloques que necesita cada miembro: el 0 es el que lleva más unidades
+static uint64_t stripe_member_blocks(const struct geometry *g) {
+    uint64_t data = g->blocks_count - g->first_group_block - g->groups_count * group_meta_blocks(g);
+
+    return stripe.data_start + DIV_ROUND_UP(DIV_ROUND_UP(data, stripe.stripe_blocks), stripe.count) * stripe.stripe_blocks;
+}
+
+// Igual que assoofs_stripe_map en el módulo: member -1 son metadatos, que van en todos
+static uint64_t stripe_map(uint64_t block, int *member, uint64_t *phys) {
+    uint64_t group, off, data, unit, run;
+
+    if (block < stripe.header) {
+        *member = -1;
+        *phys = block;
+        return stripe.header - block;
+    }
+    group = (block - stripe.header) / stripe.blocks_per_group;
+    off = (block - stripe.header) % stripe.blocks_per_group;
+    if (off < stripe.meta) {
+        *member = -1;
+        *phys = stripe.header + 1 + group * stripe.meta + off;
+        return stripe.meta - off;
+    }
+    data = group * (stripe.blocks_per_group - stripe.meta) + off - stripe.meta;
+    unit = data / stripe.stripe_blocks;
+    *member = unit % stripe.count;
+    *phys = stripe.data_start + unit / stripe.count * stripe.stripe_blocks + data % stripe.stripe_blocks;
+    run = stripe.stripe_blocks - data % stripe.stripe_blocks;
+    return run < stripe.blocks_per_group - off ? run : stripe.blocks_per_group - off;
+}
+
+/*
+ *  Con varios miembros la longitud del volumen sale de la del más pequeño: se prueba con la
+ *  suma y se recorta hasta que las unidades de cada uno caben
+ */
+static int stripe_geometry(uint64_t member_blocks, uint64_t bpg, struct geometry *g) {
+    uint64_t blocks = member_blocks * stripe.count, need;
+
+    for (;;) {
+        if (compute_geometry(blocks, bpg, g))
+            return -1;
+        stripe_setup(g);
+        need = stripe_member_blocks(g);
+        if (need <= member_blocks)
+            return 0;
+        if ((need - member_blocks) * stripe.count >= blocks) {
+            printf("The devices are too small: %llu blocks each.\n", (unsigned long long)member_blocks);
+            return -1;
+        }
+        blocks -= (need - member_blocks) * stripe.count;
+    }
+}
+
+/*
+ *  Modo registro (-L): los bloques del volumen se escriben seguidos desde la primera zona del
+ *  registro en el orden en que llegan y se apunta dónde queda cada uno. Al final van el mapa
+ *  entero, como primer punto de control, y la etiqueta. En un dispositivo por zonas se vacían
+ *  todas antes y se escribe con O_DIRECT para que lleguen en orden.
+ */
+struct logdev {
+    bool on;
+    bool zoned;
+    uint64_t zone_blocks;
+    uint64_t zones;
+    uint64_t logical;
+    uint64_t next;              /* siguiente bloque físico del registro */
+    uint32_t *map;              /* bloque lógico -> físico */
+    uint64_t volume_id;
+    char *bounce;               /* alineado, para O_DIRECT */
+    pthread_mutex_t lock;       /* los hilos de copia escriben de uno en uno */
+};
+
+static struct logdev logdev = { .zone_blocks = 1024, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static int log_write(int fd, uint64_t block, const void *buf, size_t len) {
+    uint64_t n;
+    size_t chunk, i;
+    int ret = 0;
+
+    pthread_mutex_lock(&logdev.lock);
+    while (len && !ret) {
+        chunk = len < COPY_CHUNK ? len : COPY_CHUNK;
+        n = DIV_ROUND_UP(chunk, ASSOOFS_DEFAULT_BLOCK_SIZE);
+        if (block + n > logdev.logical || logdev.next + n > logdev.zones * logdev.zone_blocks) {
+            ret = -1;
+            break;
+        }
+        memcpy(logdev.bounce, buf, chunk);
+        memset(logdev.bounce + chunk, 0, n * ASSOOFS_DEFAULT_BLOCK_SIZE - chunk);
+        if (pwrite(fd, logdev.bounce, n * ASSOOFS_DEFAULT_BLOCK_SIZE, logdev.next * ASSOOFS_DEFAULT_BLOCK_SIZE) !=
+            (ssize_t)(n * ASSOOFS_DEFAULT_BLOCK_SIZE)) {
+            ret = -1;
+            break;
+        }
+        for (i = 0; i < n; i++)
+            logdev.map[block + i] = logdev.next + i;
+        logdev.next += n;
+        block += n;
+        buf = (const char *)buf + chunk;
+        len -= chunk;
+    }
+    pthread_mutex_unlock(&logdev.lock);
+    return ret;
+}
+
+/*
+ *  Zonas del dispositivo (las suyas si es por zonas) y tamaño del volumen que se ve encima:
+ *  se dejan sin usar al menos dos zonas del registro, y una de cada diez, para el limpiador.
+ */
+static int log_setup(int fd, uint64_t dev_blocks, uint64_t *blocks) {
+    struct blk_zone_range range;
+    uint64_t spare;
+    uint32_t sectors = 0;
+
+    if (!ioctl(fd, BLKGETZONESZ, &sectors) && sectors) {
+        logdev.zoned = true;
+        logdev.zone_blocks = (uint64_t)sectors * 512 / ASSOOFS_DEFAULT_BLOCK_SIZE;
+    }
+    logdev.zones = dev_blocks / logdev.zone_blocks;
+    if (logdev.zones < ASSOOFS_LOG_FIRST_ZONE + 4) {
+        printf("The device is too small: it has %llu zones of %llu blocks.\n", (unsigned long long)logdev.zones,
+               (unsigned long long)logdev.zone_blocks);
+        return -1;
+    }
+    if (logdev.zones * logdev.zone_blocks > UINT32_MAX) {
+        printf("The device is too big for the log map.\n");
+        return -1;
+    }
+    spare = (logdev.zones - ASSOOFS_LOG_FIRST_ZONE) / 10;
+    if (spare < 2)
+        spare = 2;
+    logdev.logical = (logdev.zones - ASSOOFS_LOG_FIRST_ZONE - spare) * logdev.zone_blocks;
+    // El mapa entero tiene que caber en media zona de puntos de control
+    if (DIV_ROUND_UP(logdev.logical, ASSOOFS_LOG_CP_ENTRIES) > logdev.zone_blocks / 2) {
+        printf("Zones of %llu KiB are too small for the map of this device; use a bigger -z.\n",
+               (unsigned long long)logdev.zone_blocks * ASSOOFS_DEFAULT_BLOCK_SIZE / 1024);
+        return -1;
+    }
+    logdev.map = calloc(logdev.logical, sizeof(*logdev.map));
+    if (!logdev.map || posix_memalign((void **)&logdev.bounce, ASSOOFS_DEFAULT_BLOCK_SIZE, COPY_CHUNK)) {
+        perror("Error allocating the log map");
+        return -1;
+    }
+    if (logdev.zoned) {
+        range.sector = 0;
+        range.nr_sectors = logdev.zones * logdev.zone_blocks * (ASSOOFS_DEFAULT_BLOCK_SIZE / 512);
+        if (ioctl(fd, BLKRESETZONE, &range) || fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_DIRECT)) {
+            perror("Error preparing the zones");
+            return -1;
+        }
+    }
+    if (getrandom(&logdev.volume_id, sizeof(logdev.volume_id), 0) != sizeof(logdev.volume_id))
+        logdev.volume_id = (uint64_t)time(NULL) << 32 ^ getpid();
+    logdev.next = ASSOOFS_LOG_FIRST_ZONE * logdev.zone_blocks;
+    logdev.on = true;
+    *blocks = logdev.logical;
+    return 0;
+}
+
+// El mapa entero en la primera zona de puntos de control y, la última, la etiqueta
+static int log_finish(int fd) {
+    struct assoofs_log_label *label = (struct assoofs_log_label *)logdev.bounce;
+    struct assoofs_log_cp *cp;
+    uint64_t l = 0, wp = 0, seq = 0;
+    size_t n;
+
+    do {
+        for (n = 0; n < COPY_CHUNK / ASSOOFS_DEFAULT_BLOCK_SIZE && (l < logdev.logical || !wp); n++) {
+            cp = (struct assoofs_log_cp *)logdev.bounce + n;
+            memset(cp, 0, sizeof(*cp));
+            cp->magic = ASSOOFS_LOG_CP_MAGIC;
+            cp->volume_id = logdev.volume_id;
+            cp->seq = ++seq;
+            if (!wp && !n)
+                cp->flags = ASSOOFS_LOG_CP_BASE;
+            for (; l < logdev.logical && cp->count < ASSOOFS_LOG_CP_ENTRIES; l++) {
+                if (!logdev.map[l])
+                    continue;
+                cp->entries[cp->count].logical = l;
+                cp->entries[cp->count++].physical = logdev.map[l];
+            }
+            if (l == logdev.logical)
+                cp->flags |= ASSOOFS_LOG_CP_END;
+            wp++;
+        }
+        if (pwrite(fd, logdev.bounce, n * ASSOOFS_DEFAULT_BLOCK_SIZE,
+                   (ASSOOFS_LOG_CP_ZONE * logdev.zone_blocks + wp - n) * ASSOOFS_DEFAULT_BLOCK_SIZE) !=
+            (ssize_t)(n * ASSOOFS_DEFAULT_BLOCK_SIZE)) {
+            printf("Writing the log checkpoint has failed.\n");
+            return -1;
+        }
+    } while (l < logdev.logical);
+
+    memset(label, 0, sizeof(*label));
+    label->magic = ASSOOFS_LOG_MAGIC;
+    label->zone_blocks = logdev.zone_blocks;
+    label->zones_count = logdev.zones;
+    label->logical_blocks = logdev.logical;
+    label->volume_id = logdev.volume_id;
+    if (pwrite(fd, label, sizeof(*label), 0) != sizeof(*label)) {
+        printf("Writing the log label has failed.\n");
+        return -1;
+    }
+    printf("Log of %llu zones of %llu blocks written succesfully: %llu blocks used, checkpoint of %llu blocks.\n",
+           (unsigned long long)logdev.zones, (unsigned long long)logdev.zone_blocks,
+           (unsigned long long)(logdev.next - ASSOOFS_LOG_FIRST_ZONE * logdev.zone_blocks), (unsigned long long)wp);
+    return 0;
+}
+
+static int dev_write(int fd, uint64_t block, const void *buf, size_t len) {
+    uint64_t run, phys;
+    unsigned int i;
+    size_t chunk;
+    int member;
+
+    if (logdev.on)
+        return log_write(fd, block, buf, len);
+    if (stripe.count == 1)
+        return pwrite(fd, buf, len, block * ASSOOFS_DEFAULT_BLOCK_SIZE) == (ssize_t)len ? 0 : -1;
+    while (len) {
+        run = stripe_map(block, &member, &phys);
+        chunk = run * ASSOOFS_DEFAULT_BLOCK_SIZE < len ? run * ASSOOFS_DEFAULT_BLOCK_SIZE : len;
+        for (i = 0; i < stripe.count; i++) {
+            if ((member < 0 || member == (int)i) &&
+                pwrite(stripe.fds[i], buf, chunk, phys * ASSOOFS_DEFAULT_BLOCK_SIZE) != (ssize_t)chunk)
+                return -1;
+        }
+        buf = (const char *)buf + chunk;
+        len -= chunk;
+        block += run;
+    }
+    return 0;
+}
+
+static int write_block(int fd, uint64_t block, const void *buf, size_t len) {
+    if (dev_write(fd, block, buf, len)) {
+        printf("Writing block %llu has failed.\n", (unsigned long long)block);
+        return -1;
+    }
+    return 0;
+}
+
+// Cada miembro se reconoce por su etiqueta, detrás del superbloque y la tabla de descriptores
+static int write_labels(uint64_t volume_id) {
+    struct assoofs_member_label label = {
+        .magic = ASSOOFS_MEMBER_MAGIC,
+        .volume_id = volume_id,
+        .devices_count = stripe.count,
     };
-    ssize_t ret;
+    unsigned int i;
+
+    for (i = 0; i < stripe.count; i++) {
+        label.index = i;
+        if (pwrite(stripe.fds[i], &label, sizeof(label), stripe.header * ASSOOFS_DEFAULT_BLOCK_SIZE) != sizeof(label)) {
+            printf("Writing the label of %s has failed.\n", stripe.paths[i]);
+            return -1;
+        }
+    }
+    printf("%u member labels written succesfully.\n", stripe.count);
+    return 0;
+}
+
+static void set_bits(uint64_t *map, uint64_t from, uint64_t to) {
+    for (; from < to; from++)
+        map[from / 64] |= 1ULL << (from % 64);
+}
+
+/*
+ *  Contenido de la imagen. Los bloques de datos y los huecos del almacén de inodos se reparten
+ *  siempre desde el principio de cada grupo y en orden, así que de cada grupo basta con saber
+ *  cuántos hay ocupados, y el inodo n es el n-ésimo repartido.
+ */
+struct dent {
+    char *name;
+    uint32_t node;
+};
+
+// Un fichero, directorio o enlace del árbol de origen
+struct node {
+    uint32_t mode;
+    uint32_t links;
+    uint64_t size;
+    uint64_t ino;
+    uint64_t block;             /* bloque del directorio o del enlace largo; sellada: byte en los metadatos */
+    uint64_t offset;            /* imagen sellada: byte del dispositivo donde empiezan sus datos */
+    char *target;               /* destino de un enlace simbólico */
+    char *src;                  /* fichero de origen, al copiar un directorio */
+    struct dent *child;         /* entradas de un directorio */
+    unsigned int nchild, nalloc;
+    struct assoofs_extent *ext;
+    unsigned int next;
+    uint64_t extent_block;
+};
+
+struct image {
+    int fd;
+    struct geometry geo;
+    uint64_t *data_used;        /* bloques de datos ocupados de cada grupo */
+    uint64_t *inodes_used;      /* huecos ocupados del almacén de cada grupo */
+    uint64_t *dirs;
+    uint64_t open_group;        /* primer grupo con bloques de datos libres */
+    struct assoofs_inode_info *inodes;  /* por número de inodo menos uno */
+    uint64_t ninodes;
+    struct node *nodes;         /* árbol de origen; el 0 es la raíz */
+    uint32_t nnodes, cap;
+    uint32_t *order;            /* recorrido en anchura, cada inodo una vez */
+    uint32_t norder;
+    void *hardlinks;            /* (st_dev, st_ino) ya vistos, para los enlaces duros */
+    uint32_t next_copy;         /* siguiente fichero a copiar por los hilos */
+    uint64_t bytes_copied;
+    int failed;
+    bool sealed;                /* -S: sin grupos, todo seguido desde el bloque 1 */
+    uint64_t meta_blocks;
+};
 
-    ret = write(fd, &sb, sizeof(sb));
-    if (ret != ASSOOFS_DEFAULT_BLOCK_SIZE) {
-        printf("Bytes written [%d] are not equal to the default block size.\n", (int)ret);
+static uint64_t group_free_data(const struct image *im, uint64_t group) {
+    return group_nblocks(&im->geo, group) - group_meta_blocks(&im->geo) - im->data_used[group];
+}
+
+static uint64_t take_blocks(struct image *im, uint64_t group, uint64_t count) {
+    uint64_t start = group_first_block(&im->geo, group) + group_meta_blocks(&im->geo) + im->data_used[group];
+
+    im->data_used[group] += count;
+    while (im->open_group < im->geo.groups_count && !group_free_data(im, im->open_group))
+        im->open_group++;
+    return start;
+}
+
+// Los bloques sueltos (directorios, enlaces y extents) van seguidos desde el primer hueco
+static int alloc_block(struct image *im, uint64_t *block) {
+    if (im->open_group == im->geo.groups_count) {
+        printf("No space left on the device.\n");
         return -1;
     }
+    *block = take_blocks(im, im->open_group, 1);
+    return 0;
+}
 
-    printf("Super block written succesfully.\n");
+/*
+ *  Los datos de un fichero van seguidos en el primer grupo donde caben enteros; solo si no
+ *  caben en ningún grupo se reparten en un tramo por grupo desde el primero con sitio.
+ */
+static int alloc_extents(struct image *im, struct node *n, const char *path) {
+    uint64_t groups = im->geo.groups_count, left = DIV_ROUND_UP(n->size, ASSOOFS_DEFAULT_BLOCK_SIZE), g, len, file_block = 0;
+
+    if (!left)
+        return 0;
+    if (left > UINT32_MAX) {
+        printf("%s is too big for assoofs.\n", path);
+        return -1;
+    }
+    for (g = im->open_group; g < groups && group_free_data(im, g) < left; g++)
+        ;
+    if (g == groups)
+        g = im->open_group;
+    n->ext = calloc(ASSOOFS_MAX_EXTENTS, sizeof(*n->ext));
+    if (!n->ext) {
+        perror("Error allocating the extent map");
+        return -1;
+    }
+    while (left) {
+        for (; g < groups && !group_free_data(im, g); g++)
+            ;
+        if (g == groups) {
+            printf("No space left on the device for %s.\n", path);
+            return -1;
+        }
+        if (n->next == ASSOOFS_MAX_EXTENTS) {
+            printf("%s needs more than %u extents.\n", path, (unsigned int)ASSOOFS_MAX_EXTENTS);
+            return -1;
+        }
+        len = group_free_data(im, g) < left ? group_free_data(im, g) : left;
+        n->ext[n->next].file_block = file_block;
+        n->ext[n->next].len = len;
+        n->ext[n->next].start = take_blocks(im, g, len);
+        n->next++;
+        file_block += len;
+        left -= len;
+    }
+    if (n->next > ASSOOFS_INLINE_EXTENTS)
+        return alloc_block(im, &n->extent_block);
+    return 0;
+}
+
+static int next_inode(struct image *im, uint32_t mode, uint64_t *ino) {
+    uint64_t group;
+
+    if (im->sealed) {
+        *ino = ++im->ninodes;
+        return 0;
+    }
+    if (im->ninodes == im->geo.groups_count * im->geo.inodes_per_group) {
+        printf("Not enough inodes: the device has room for %llu.\n", (unsigned long long)im->ninodes);
+        return -1;
+    }
+    *ino = ++im->ninodes;
+    group = (*ino - 1) / im->geo.inodes_per_group;
+    im->inodes_used[group]++;
+    if (S_ISDIR(mode))
+        im->dirs[group]++;
     return 0;
 }
 
-static int write_root_inode(int fd) {
+/*
+ *  Escrituras en bloques seguidos: se juntan en trozos de COPY_CHUNK
+ */
+struct wbuf {
+    int fd;
+    uint64_t block;
+    size_t len;
+    char *buf;
+};
+
+static int wbuf_flush(struct wbuf *wb) {
+    int ret = 0;
+
+    if (wb->len)
+        ret = write_block(wb->fd, wb->block, wb->buf, wb->len);
+    wb->len = 0;
+    return ret;
+}
+
+static int wbuf_add(struct wbuf *wb, uint64_t block, const void *data) {
+    if (wb->len && (wb->block + wb->len / ASSOOFS_DEFAULT_BLOCK_SIZE != block || wb->len == COPY_CHUNK) && wbuf_flush(wb))
+        return -1;
+    if (!wb->len)
+        wb->block = block;
+    memcpy(wb->buf + wb->len, data, ASSOOFS_DEFAULT_BLOCK_SIZE);
+    wb->len += ASSOOFS_DEFAULT_BLOCK_SIZE;
+    return 0;
+}
+
+static ssize_t read_full(int fd, void *buf, size_t len) {
+    size_t done = 0;
     ssize_t ret;
-    struct assoofs_inode_info root_inode;
 
-    root_inode.mode = S_IFDIR;
-    root_inode.inode_no = ASSOOFS_ROOTDIR_INODE_NUMBER;
-    root_inode.data_block_number = ASSOOFS_ROOTDIR_DATABLOCK_NUMBER;
-    root_inode.dir_children_count = 1;
+    while (done < len) {
+        ret = read(fd, (char *)buf + done, len - done);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0)
+            return -1;
+        if (!ret)
+            break;
+        done += ret;
+    }
+    return done;
+}
+
+/*
+ *  Copia los n->size bytes de src a los extents del fichero, en escrituras de hasta COPY_CHUNK
+ *  y con el final del último bloque a cero. En un flujo (tar) que se acabe antes es un error;
+ *  un fichero que ha encogido mientras se copiaba se completa con ceros.
+ */
+static int copy_data(int fd, int src, const char *path, const struct node *n, char *buf, bool stream) {
+    uint64_t left = n->size, off, room;
+    size_t want, len;
+    ssize_t got;
+    unsigned int i;
+    bool shrunk = false;
+
+    for (i = 0; i < n->next && left; i++) {
+        off = n->ext[i].start * ASSOOFS_DEFAULT_BLOCK_SIZE;
+        room = (uint64_t)n->ext[i].len * ASSOOFS_DEFAULT_BLOCK_SIZE;
+        while (room && left) {
+            want = COPY_CHUNK;
+            if (want > room)
+                want = room;
+            if (want > left)
+                want = left;
+            got = shrunk ? 0 : read_full(src, buf, want);
+            if (got < 0) {
+                printf("Error reading %s: %s\n", path, strerror(errno));
+                return -1;
+            }
+            if ((size_t)got < want) {
+                if (stream) {
+                    printf("Unexpected end of archive in %s.\n", path);
+                    return -1;
+                }
+                if (!shrunk)
+                    printf("%s changed size while copying, padding with zeros.\n", path);
+                shrunk = true;
+                memset(buf + got, 0, want - got);
+            }
+            len = DIV_ROUND_UP(want, ASSOOFS_DEFAULT_BLOCK_SIZE) * ASSOOFS_DEFAULT_BLOCK_SIZE;
+            memset(buf + want, 0, len - want);
+            if (dev_write(fd, off / ASSOOFS_DEFAULT_BLOCK_SIZE, buf, len)) {
+                printf("Writing %s has failed.\n", path);
+                return -1;
+            }
+            off += len;
+            room -= len;
+            left -= want;
+        }
+    }
+    return 0;
+}
+
+/*
+ *  Árbol de origen
+ */
+static int new_node(struct image *im, uint32_t mode, uint32_t *out) {
+    struct node *nodes;
+    uint32_t cap;
+
+    if (im->nnodes == im->cap) {
+        cap = im->cap ? im->cap * 2 : 1024;
+        nodes = realloc(im->nodes, cap * sizeof(*nodes));
+        if (!nodes) {
+            perror("Error allocating the file tree");
+            return -1;
+        }
+        im->nodes = nodes;
+        im->cap = cap;
+    }
+    memset(&im->nodes[im->nnodes], 0, sizeof(*nodes));
+    im->nodes[im->nnodes].mode = mode;
+    im->nodes[im->nnodes].links = 1;
+    if (S_ISDIR(mode)) {
+        im->nodes[im->nnodes].child = calloc(MAX_DIR_ENTRIES, sizeof(struct dent));
+        if (!im->nodes[im->nnodes].child) {
+            perror("Error allocating the file tree");
+            return -1;
+        }
+        im->nodes[im->nnodes].nalloc = MAX_DIR_ENTRIES;
+    }
+    *out = im->nnodes++;
+    return 0;
+}
+
+/*
+ *  Como assoofs_add_dirent: un bloque por directorio, sin sitio para más de MAX_DIR_ENTRIES.
+ *  En una imagen sellada las entradas van seguidas en los metadatos y no tienen límite.
+ */
+static int add_child(struct image *im, uint32_t dir, const char *name, uint32_t node, const char *path) {
+    struct node *d = &im->nodes[dir];
+    struct dent *child;
 
-    ret = write(fd, &root_inode, sizeof(root_inode));
+    if (strlen(name) >= ASSOOFS_FILENAME_MAXLEN) {
+        printf("Name too long: %s\n", path);
+        return -1;
+    }
+    if (d->nchild == d->nalloc) {
+        if (!im->sealed) {
+            printf("Cannot add %s: an assoofs directory holds at most %zu entries.\n", path, MAX_DIR_ENTRIES);
+            return -1;
+        }
+        child = realloc(d->child, d->nalloc * 2 * sizeof(*child));
+        if (!child) {
+            perror("Error allocating the file tree");
+            return -1;
+        }
+        d->child = child;
+        d->nalloc *= 2;
+    }
+    d->child[d->nchild].name = strdup(name);
+    if (!d->child[d->nchild].name) {
+        perror("Error allocating the file tree");
+        return -1;
+    }
+    d->child[d->nchild++].node = node;
+    return 0;
+}
 
-    if (ret != sizeof(root_inode)) {
-        printf("The inode store was not written properly.\n");
+static int set_symlink(struct image *im, uint32_t node, const char *target, const char *path) {
+    if (strlen(target) >= ASSOOFS_DEFAULT_BLOCK_SIZE) {
+        printf("Symlink target too long: %s\n", path);
         return -1;
     }
+    im->nodes[node].target = strdup(target);
+    im->nodes[node].size = strlen(target);
+    if (!im->nodes[node].target) {
+        perror("Error allocating the file tree");
+        return -1;
+    }
+    return 0;
+}
+
+struct hardlink {
+    dev_t dev;
+    ino_t ino;
+    uint32_t node;
+};
+
+static int hardlink_cmp(const void *a, const void *b) {
+    const struct hardlink *x = a, *y = b;
 
-    printf("root directory inode written succesfully.\n");
+    if (x->dev != y->dev)
+        return x->dev < y->dev ? -1 : 1;
+    if (x->ino != y->ino)
+        return x->ino < y->ino ? -1 : 1;
     return 0;
 }
 
-static int write_welcome_inode(int fd, const struct assoofs_inode_info *i) {
-    off_t nbytes;
-    ssize_t ret;
+static int name_cmp(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static int scan_dir(struct image *im, uint32_t dir, const char *path);
+
+static int scan_entry(struct image *im, uint32_t dir, const char *dirpath, const char *name) {
+    struct hardlink key, *link, **found;
+    char target[ASSOOFS_DEFAULT_BLOCK_SIZE];
+    struct stat st;
+    uint32_t node;
+    ssize_t len;
+    char *path;
+    int ret;
+
+    path = malloc(strlen(dirpath) + strlen(name) + 2);
+    if (!path) {
+        perror("Error allocating the file tree");
+        return -1;
+    }
+    sprintf(path, "%s/%s", dirpath, name);
+    if (lstat(path, &st)) {
+        printf("Error reading %s: %s\n", path, strerror(errno));
+        free(path);
+        return -1;
+    }
+    if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode) && !S_ISLNK(st.st_mode)) {
+        printf("Skipping %s: assoofs only has regular files, directories and symlinks.\n", path);
+        free(path);
+        return 0;
+    }
+    // Otro nombre de un fichero ya visto: una entrada más hacia el mismo inodo
+    key.dev = st.st_dev;
+    key.ino = st.st_ino;
+    if (S_ISREG(st.st_mode) && st.st_nlink > 1) {
+        found = tfind(&key, &im->hardlinks, hardlink_cmp);
+        if (found) {
+            im->nodes[(*found)->node].links++;
+            ret = add_child(im, dir, name, (*found)->node, path);
+            free(path);
+            return ret;
+        }
+    }
+    if (new_node(im, st.st_mode & (S_IFMT | 07777), &node)) {
+        free(path);
+        return -1;
+    }
+    ret = 0;
+    if (S_ISLNK(st.st_mode)) {
+        len = readlink(path, target, sizeof(target));
+        if (len < 0) {
+            printf("Error reading %s: %s\n", path, strerror(errno));
+            ret = -1;
+        } else if (len == sizeof(target)) {
+            printf("Symlink target too long: %s\n", path);
+            ret = -1;
+        } else {
+            target[len] = '\0';
+            ret = set_symlink(im, node, target, path);
+        }
+    } else if (S_ISREG(st.st_mode)) {
+        im->nodes[node].size = st.st_size;
+        im->nodes[node].src = path;
+        if (st.st_nlink > 1) {
+            link = malloc(sizeof(*link));
+            if (link) {
+                *link = key;
+                link->node = node;
+            }
+            if (!link || !tsearch(link, &im->hardlinks, hardlink_cmp)) {
+                perror("Error allocating the file tree");
+                ret = -1;
+            }
+        }
+    }
+    if (!ret)
+        ret = add_child(im, dir, name, node, path);
+    if (!ret && S_ISDIR(st.st_mode))
+        ret = scan_dir(im, node, path);
+    if (!S_ISREG(st.st_mode))
+        free(path);
+    return ret;
+}
+
+// Las entradas por orden de nombre, para que la misma fuente dé siempre la misma imagen
+static int scan_dir(struct image *im, uint32_t dir, const char *path) {
+    char **names = NULL, **grown;
+    size_t count = 0, cap = 0, i;
+    struct dirent *de;
+    int ret = 0;
+    DIR *d;
+
+    d = opendir(path);
+    if (!d) {
+        printf("Error reading %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    while ((de = readdir(d))) {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+            continue;
+        if (count == cap) {
+            cap = cap ? cap * 2 : 16;
+            grown = realloc(names, cap * sizeof(*names));
+            if (!grown) {
+                ret = -1;
+                break;
+            }
+            names = grown;
+        }
+        names[count] = strdup(de->d_name);
+        if (!names[count]) {
+            ret = -1;
+            break;
+        }
+        count++;
+    }
+    closedir(d);
+    if (ret)
+        perror("Error allocating the file tree");
+    qsort(names, count, sizeof(*names), name_cmp);
+    for (i = 0; i < count; i++) {
+        if (!ret)
+            ret = scan_entry(im, dir, path, names[i]);
+        free(names[i]);
+    }
+    free(names);
+    return ret;
+}
+
+/*
+ *  tar (ustar, con nombres largos de GNU y cabeceras pax) por la entrada estándar. Los datos
+ *  de cada fichero se colocan y se escriben según llegan.
+ */
+struct tar_header {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+};
+
+static uint64_t tar_number(const char *p, size_t len) {
+    char buf[16];
+    uint64_t val;
+    size_t i;
+
+    // Base 256 para los que no caben en octal
+    if ((unsigned char)p[0] & 0x80) {
+        for (val = p[0] & 0x3f, i = 1; i < len; i++)
+            val = val << 8 | (unsigned char)p[i];
+        return val;
+    }
+    memcpy(buf, p, len);
+    buf[len] = '\0';
+    return strtoull(buf, NULL, 8);
+}
+
+static bool tar_is_zero(const struct tar_header *h) {
+    const char *p = (const char *)h;
+    size_t i;
+
+    for (i = 0; i < sizeof(*h); i++) {
+        if (p[i])
+            return false;
+    }
+    return true;
+}
+
+static bool tar_checksum_ok(const struct tar_header *h) {
+    const unsigned char *p = (const unsigned char *)h;
+    uint64_t sum = 0;
+    size_t i;
+
+    for (i = 0; i < sizeof(*h); i++)
+        sum += (i >= offsetof(struct tar_header, chksum) && i < offsetof(struct tar_header, typeflag)) ? ' ' : p[i];
+    return sum == tar_number(h->chksum, sizeof(h->chksum));
+}
+
+static int tar_skip(uint64_t len, char *buf) {
+    size_t chunk;
+
+    while (len) {
+        chunk = len < COPY_CHUNK ? len : COPY_CHUNK;
+        if (read_full(STDIN_FILENO, buf, chunk) != (ssize_t)chunk) {
+            printf("Unexpected end of archive.\n");
+            return -1;
+        }
+        len -= chunk;
+    }
+    return 0;
+}
+
+// Los datos de una cabecera L, K o x, terminados en '\0'
+static char *tar_read_string(uint64_t len) {
+    char *s;
 
-    ret = write(fd, i, sizeof(*i));
-    if (ret != sizeof(*i)) {
-        printf("The welcomefile inode was not written properly.\n");
+    if (len > 1024 * 1024) {
+        printf("Extended tar header too long.\n");
+        return NULL;
+    }
+    s = malloc(DIV_ROUND_UP(len, 512) * 512 + 1);
+    if (!s) {
+        perror("Error reading the archive");
+        return NULL;
+    }
+    if (read_full(STDIN_FILENO, s, DIV_ROUND_UP(len, 512) * 512) != (ssize_t)(DIV_ROUND_UP(len, 512) * 512)) {
+        printf("Unexpected end of archive.\n");
+        free(s);
+        return NULL;
+    }
+    s[len] = '\0';
+    return s;
+}
+
+// Registros "longitud clave=valor\n" de una cabecera pax: solo interesan path, linkpath y size
+static void tar_parse_pax(char *data, uint64_t len, char **path, char **linkpath, uint64_t *size, bool *has_size) {
+    char *p = data, *end = data + len, *key, *val, *next;
+    unsigned long rec;
+
+    while (p < end) {
+        rec = strtoul(p, &key, 10);
+        if (!rec || key == p || *key != ' ' || p + rec > end)
+            break;
+        next = p + rec;
+        key++;
+        next[-1] = '\0';
+        val = strchr(key, '=');
+        if (val) {
+            *val++ = '\0';
+            if (!strcmp(key, "path")) {
+                free(*path);
+                *path = strdup(val);
+            } else if (!strcmp(key, "linkpath")) {
+                free(*linkpath);
+                *linkpath = strdup(val);
+            } else if (!strcmp(key, "size")) {
+                *size = strtoull(val, NULL, 10);
+                *has_size = true;
+            }
+        }
+        p = next;
+    }
+}
+
+static int tar_child(struct image *im, uint32_t dir, const char *name, uint32_t *out) {
+    struct node *d = &im->nodes[dir];
+    unsigned int i;
+
+    for (i = 0; i < d->nchild; i++) {
+        if (!strcmp(d->child[i].name, name)) {
+            *out = d->child[i].node;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*
+ *  Recorre path desde la raíz creando los directorios intermedios que falten (los tar no
+ *  siempre los traen). Deja en *name el último componente, o NULL si path es la raíz.
+ */
+static int tar_walk(struct image *im, char *path, bool create, uint32_t *dir, char **name) {
+    char *comp, *next;
+    uint32_t node;
+
+    *dir = 0;
+    *name = NULL;
+    for (comp = path; comp; comp = next) {
+        next = strchr(comp, '/');
+        if (next)
+            *next++ = '\0';
+        if (!*comp || !strcmp(comp, "."))
+            continue;
+        if (!strcmp(comp, "..")) {
+            printf("Refusing a path with '..' in the archive.\n");
+            return -1;
+        }
+        if (*name) {
+            if (tar_child(im, *dir, *name, &node)) {
+                if (!create) {
+                    printf("Link target not found in the archive: %s\n", *name);
+                    return -1;
+                }
+                if (new_node(im, S_IFDIR | 0755, &node) || add_child(im, *dir, *name, node, *name))
+                    return -1;
+            } else if (!S_ISDIR(im->nodes[node].mode)) {
+                printf("%s is not a directory in the archive.\n", *name);
+                return -1;
+            }
+            *dir = node;
+        }
+        *name = comp;
+    }
+    return 0;
+}
+
+static int tar_member(struct image *im, char type, char *path, char *linkpath, uint32_t mode, uint64_t size, char *buf) {
+    uint32_t dir, node, target;
+    char *name, *target_name;
+
+    if (tar_walk(im, path, true, &dir, &name))
+        return -1;
+    if (type == '5' && !name) {
+        im->nodes[0].mode = S_IFDIR | mode;
+        return 0;
+    }
+    if (!name) {
+        printf("Bad name in the archive.\n");
+        return -1;
+    }
+    if (!tar_child(im, dir, name, &node)) {
+        if (type == '5' && S_ISDIR(im->nodes[node].mode)) {
+            im->nodes[node].mode = S_IFDIR | mode;
+            return 0;
+        }
+        printf("Duplicate entry in the archive: %s\n", name);
         return -1;
     }
-    printf("welcomefile inode written succesfully.\n");
+    switch (type) {
+    case '5':
+        return new_node(im, S_IFDIR | mode, &node) || add_child(im, dir, name, node, name) ? -1 : 0;
+    case '2':
+        return new_node(im, S_IFLNK | 0777, &node) || set_symlink(im, node, linkpath, name) ||
+               add_child(im, dir, name, node, name) ? -1 : 0;
+    case '1':
+        if (tar_walk(im, linkpath, false, &target, &target_name) || !target_name || tar_child(im, target, target_name, &target) ||
+            S_ISDIR(im->nodes[target].mode)) {
+            printf("Bad hard link in the archive: %s\n", name);
+            return -1;
+        }
+        im->nodes[target].links++;
+        return add_child(im, dir, name, target, name);
+    default:
+        if (new_node(im, S_IFREG | mode, &node))
+            return -1;
+        im->nodes[node].size = size;
+        if (alloc_extents(im, &im->nodes[node], name) || copy_data(im->fd, STDIN_FILENO, name, &im->nodes[node], buf, true))
+            return -1;
+        im->bytes_copied += size;
+        return add_child(im, dir, name, node, name);
+    }
+}
+
+static int read_tar(struct image *im) {
+    struct tar_header h;
+    char *buf, *path = NULL, *linkpath = NULL, *data;
+    uint64_t size, pax_size = 0;
+    bool has_pax_size = false;
+    ssize_t got;
+    int ret = -1;
 
-    nbytes = ASSOOFS_DEFAULT_BLOCK_SIZE - (sizeof(*i) * 2);
-    ret = lseek(fd, nbytes, SEEK_CUR);
-    if (ret == (off_t)-1) {
-        printf("The padding bytes are not written properly.\n");
+    buf = malloc(COPY_CHUNK);
+    if (!buf) {
+        perror("Error reading the archive");
         return -1;
     }
+    for (;;) {
+        got = read_full(STDIN_FILENO, &h, sizeof(h));
+        if (got != sizeof(h)) {
+            printf("Unexpected end of archive.\n");
+            break;
+        }
+        // Un bloque a cero marca el final
+        if (tar_is_zero(&h)) {
+            ret = 0;
+            break;
+        }
+        if (!tar_checksum_ok(&h)) {
+            printf("Bad tar header checksum.\n");
+            break;
+        }
+        size = tar_number(h.size, sizeof(h.size));
+        if (h.typeflag == 'L' || h.typeflag == 'K' || h.typeflag == 'x' || h.typeflag == 'g') {
+            data = tar_read_string(size);
+            if (!data)
+                break;
+            if (h.typeflag == 'L') {
+                free(path);
+                path = data;
+            } else if (h.typeflag == 'K') {
+                free(linkpath);
+                linkpath = data;
+            } else {
+                if (h.typeflag == 'x')
+                    tar_parse_pax(data, size, &path, &linkpath, &pax_size, &has_pax_size);
+                free(data);
+            }
+            continue;
+        }
+        if (has_pax_size)
+            size = pax_size;
+        if (!path) {
+            path = malloc(sizeof(h.prefix) + sizeof(h.name) + 2);
+            if (!path)
+                break;
+            if (!memcmp(h.magic, "ustar", 5) && h.prefix[0])
+                sprintf(path, "%.*s/%.*s", (int)sizeof(h.prefix), h.prefix, (int)sizeof(h.name), h.name);
+            else
+                sprintf(path, "%.*s", (int)sizeof(h.name), h.name);
+        }
+        if (!linkpath) {
+            linkpath = strndup(h.linkname, sizeof(h.linkname));
+            if (!linkpath)
+                break;
+        }
+        if (h.typeflag == '0' || h.typeflag == '\0' || h.typeflag == '7' || h.typeflag == '1' || h.typeflag == '2' || h.typeflag == '5') {
+            if (tar_member(im, h.typeflag == '\0' || h.typeflag == '7' ? '0' : h.typeflag, path, linkpath,
+                           tar_number(h.mode, sizeof(h.mode)) & 07777, size, buf))
+                break;
+            // Solo los ficheros regulares consumen sus datos
+            if (h.typeflag != '0' && h.typeflag != '\0' && h.typeflag != '7' && tar_skip(size, buf))
+                break;
+        } else {
+            printf("Skipping %s: unsupported tar entry type '%c'.\n", path, h.typeflag);
+            if (tar_skip(size, buf))
+                break;
+        }
+        if (tar_skip((512 - size % 512) % 512, buf))
+            break;
+        free(path);
+        free(linkpath);
+        path = linkpath = NULL;
+        has_pax_size = false;
+    }
+    free(path);
+    free(linkpath);
+    free(buf);
+    return ret;
+}
 
-    printf("inode store padding bytes (after two inodes) written sucessfully.\n");
+/*
+ *  Reparto: inodos en el orden de un recorrido en anchura, así que los de cada directorio
+ *  quedan juntos en el almacén; después los bloques de directorios y enlaces, seguidos.
+ */
+static int walk_tree(struct image *im) {
+    uint32_t i, j, c;
+    struct node *n;
+
+    im->order = malloc(im->nnodes * sizeof(*im->order));
+    if (!im->order) {
+        perror("Error allocating the file tree");
+        return -1;
+    }
+    im->norder = 0;
+    im->order[im->norder++] = 0;
+    if (next_inode(im, im->nodes[0].mode, &im->nodes[0].ino))
+        return -1;
+    for (i = 0; i < im->norder; i++) {
+        n = &im->nodes[im->order[i]];
+        for (j = 0; j < n->nchild; j++) {
+            c = n->child[j].node;
+            if (im->nodes[c].ino)
+                continue;
+            if (next_inode(im, im->nodes[c].mode, &im->nodes[c].ino))
+                return -1;
+            im->order[im->norder++] = c;
+        }
+    }
+    im->inodes = calloc(im->ninodes, sizeof(*im->inodes));
+    if (!im->inodes) {
+        perror("Error allocating the inode table");
+        return -1;
+    }
     return 0;
 }
 
-int write_dirent(int fd, const struct assoofs_dir_record_entry *record) {
-    ssize_t nbytes = sizeof(*record), ret;
+static int layout_meta(struct image *im) {
+    struct node *n;
+    uint32_t i;
+
+    for (i = 0; i < im->norder; i++) {
+        n = &im->nodes[im->order[i]];
+        if (S_ISDIR(n->mode) || (S_ISLNK(n->mode) && n->size >= ASSOOFS_INLINE_SYMLINK_LEN)) {
+            if (alloc_block(im, &n->block))
+                return -1;
+        }
+    }
+    return 0;
+}
 
-    ret = write(fd, record, nbytes);
-    if (ret != nbytes) {
-        printf("Writing the rootdirectory datablock (name+inode_no pair for welcomefile) has failed.\n");
+static int dent_cmp(const void *a, const void *b) {
+    return strcmp(((const struct dent *)a)->name, ((const struct dent *)b)->name);
+}
+
+/*
+ *  Imagen sellada: tras el superbloque, la tabla de inodos, las entradas de cada directorio
+ *  ordenadas por nombre para buscarlas por bisección y los destinos de los enlaces largos.
+ *  Después, los datos de los ficheros regulares uno detrás de otro.
+ */
+static int layout_sealed(struct image *im) {
+    uint64_t off, data, blocks;
+    struct node *n;
+    uint32_t i;
+
+    off = im->ninodes * sizeof(struct assoofs_inode_info);
+    for (i = 0; i < im->norder; i++) {
+        n = &im->nodes[im->order[i]];
+        if (S_ISDIR(n->mode)) {
+            qsort(n->child, n->nchild, sizeof(*n->child), dent_cmp);
+            n->block = off;
+            off += (uint64_t)n->nchild * sizeof(struct assoofs_dir_record_entry);
+        } else if (S_ISLNK(n->mode) && n->size >= ASSOOFS_INLINE_SYMLINK_LEN) {
+            n->block = off;
+            off += n->size + 1;
+        }
+    }
+    im->meta_blocks = DIV_ROUND_UP(off, ASSOOFS_DEFAULT_BLOCK_SIZE);
+    data = (ASSOOFS_SEALED_META_BLOCK + im->meta_blocks) * ASSOOFS_DEFAULT_BLOCK_SIZE;
+    for (i = 0; i < im->norder; i++) {
+        n = &im->nodes[im->order[i]];
+        if (S_ISREG(n->mode)) {
+            n->offset = data;
+            data += DIV_ROUND_UP(n->size, ASSOOFS_SEALED_ALIGN) * ASSOOFS_SEALED_ALIGN;
+        }
+    }
+    blocks = DIV_ROUND_UP(data, ASSOOFS_DEFAULT_BLOCK_SIZE);
+    if (blocks > im->geo.blocks_count) {
+        printf("The device is too small: the sealed image needs %llu blocks.\n", (unsigned long long)blocks);
         return -1;
     }
-    printf("root directory datablocks (name+inode_no pair for welcomefile) written succesfully.\n");
+    im->geo.blocks_count = blocks;
+    return 0;
+}
+
+static int layout_data(struct image *im) {
+    struct node *n;
+    uint32_t i;
+
+    for (i = 0; i < im->norder; i++) {
+        n = &im->nodes[im->order[i]];
+        if (S_ISREG(n->mode) && alloc_extents(im, n, n->src))
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ *  Como copy_data pero para una imagen sellada: los datos van seguidos desde n->offset y solo se
+ *  rellena con ceros hasta el final del último sector
+ */
+static int copy_sealed(int fd, int src, const char *path, const struct node *n, char *buf) {
+    uint64_t left = n->size, off = n->offset;
+    size_t want, len;
+    ssize_t got;
+    bool shrunk = false;
 
-    nbytes = ASSOOFS_DEFAULT_BLOCK_SIZE - sizeof(*record);
-    ret = lseek(fd, nbytes, SEEK_CUR);
-    if (ret == (off_t)-1) {
-        printf("Writing the padding for rootdirectory children datablock has failed.\n");
+    while (left) {
+        want = left < COPY_CHUNK ? left : COPY_CHUNK;
+        got = shrunk ? 0 : read_full(src, buf, want);
+        if (got < 0) {
+            printf("Error reading %s: %s\n", path, strerror(errno));
+            return -1;
+        }
+        if ((size_t)got < want) {
+            if (!shrunk)
+                printf("%s changed size while copying, padding with zeros.\n", path);
+            shrunk = true;
+            memset(buf + got, 0, want - got);
+        }
+        len = DIV_ROUND_UP(want, ASSOOFS_SEALED_ALIGN) * ASSOOFS_SEALED_ALIGN;
+        memset(buf + want, 0, len - want);
+        if (pwrite(fd, buf, len, off) != (ssize_t)len) {
+            printf("Writing %s has failed.\n", path);
+            return -1;
+        }
+        off += len;
+        left -= want;
+    }
+    return 0;
+}
+
+// Cada hilo lee ficheros enteros de la fuente y los escribe en sus extents
+static void *copy_main(void *data) {
+    struct image *im = data;
+    struct node *n;
+    char *buf;
+    uint32_t i;
+    int src;
+
+    buf = malloc(COPY_CHUNK);
+    if (!buf) {
+        perror("Error allocating the copy buffer");
+        __atomic_store_n(&im->failed, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    while ((i = __atomic_fetch_add(&im->next_copy, 1, __ATOMIC_RELAXED)) < im->norder && !__atomic_load_n(&im->failed, __ATOMIC_RELAXED)) {
+        n = &im->nodes[im->order[i]];
+        if (!S_ISREG(n->mode) || !n->size)
+            continue;
+        src = open(n->src, O_RDONLY);
+        if (src < 0) {
+            printf("Error reading %s: %s\n", n->src, strerror(errno));
+            __atomic_store_n(&im->failed, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        posix_fadvise(src, 0, 0, POSIX_FADV_SEQUENTIAL);
+        if (im->sealed ? copy_sealed(im->fd, src, n->src, n, buf) : copy_data(im->fd, src, n->src, n, buf, false))
+            __atomic_store_n(&im->failed, 1, __ATOMIC_RELAXED);
+        else
+            __atomic_fetch_add(&im->bytes_copied, n->size, __ATOMIC_RELAXED);
+        close(src);
+    }
+    free(buf);
+    return NULL;
+}
+
+static int copy_files(struct image *im, long threads) {
+    pthread_t *tids;
+    long i, started;
+
+    tids = calloc(threads, sizeof(*tids));
+    if (!tids) {
+        perror("Error starting the copy threads");
+        return -1;
+    }
+    for (started = 0; started < threads; started++) {
+        if (pthread_create(&tids[started], NULL, copy_main, im))
+            break;
+    }
+    if (!started)
+        copy_main(im);
+    for (i = 0; i < started; i++)
+        pthread_join(tids[i], NULL);
+    free(tids);
+    return im->failed ? -1 : 0;
+}
+
+// Inodos del árbol, bloques de directorios y enlaces largos en orden y bloques de extents
+static int write_tree(struct image *im) {
+    struct assoofs_dir_record_entry *rec;
+    struct assoofs_inode_info *info;
+    char block[ASSOOFS_DEFAULT_BLOCK_SIZE];
+    struct wbuf wb = { .fd = im->fd };
+    struct node *n;
+    uint32_t i, j;
+    int ret = 0;
+
+    wb.buf = malloc(COPY_CHUNK);
+    if (!wb.buf) {
+        perror("Error allocating the write buffer");
+        return -1;
+    }
+    for (i = 0; i < im->norder && !ret; i++) {
+        n = &im->nodes[im->order[i]];
+        info = &im->inodes[n->ino - 1];
+        info->mode = n->mode;
+        info->inode_no = n->ino;
+        info->links_count = S_ISDIR(n->mode) ? 1 : n->links;
+        memset(block, 0, sizeof(block));
+        if (S_ISDIR(n->mode)) {
+            info->data_block_number = n->block;
+            info->dir_children_count = n->nchild;
+            rec = (struct assoofs_dir_record_entry *)block;
+            for (j = 0; j < n->nchild; j++) {
+                strcpy(rec[j].filename, n->child[j].name);
+                rec[j].inode_no = im->nodes[n->child[j].node].ino;
+            }
+            ret = wbuf_add(&wb, n->block, block);
+        } else if (S_ISLNK(n->mode)) {
+            info->file_size = n->size;
+            if (n->size < ASSOOFS_INLINE_SYMLINK_LEN) {
+                memcpy(info->inline_symlink, n->target, n->size + 1);
+            } else {
+                info->data_block_number = n->block;
+                memcpy(block, n->target, n->size);
+                ret = wbuf_add(&wb, n->block, block);
+            }
+        } else {
+            info->file_size = n->size;
+            info->extents_count = n->next;
+            memcpy(info->extents, n->ext, (n->next < ASSOOFS_INLINE_EXTENTS ? n->next : ASSOOFS_INLINE_EXTENTS) * sizeof(*n->ext));
+            if (n->extent_block) {
+                info->extent_block = n->extent_block;
+                memcpy(block, n->ext + ASSOOFS_INLINE_EXTENTS, (n->next - ASSOOFS_INLINE_EXTENTS) * sizeof(*n->ext));
+                ret = wbuf_add(&wb, n->extent_block, block);
+            }
+        }
+    }
+    if (!ret)
+        ret = wbuf_flush(&wb);
+    free(wb.buf);
+    if (!ret)
+        printf("%llu inodes and their directories written succesfully.\n", (unsigned long long)im->ninodes);
+    return ret;
+}
+
+// La zona de metadatos de la imagen sellada, montada en memoria y escrita de una vez
+static int write_sealed(struct image *im) {
+    struct assoofs_dir_record_entry *rec;
+    struct assoofs_inode_info *info;
+    struct node *n;
+    uint32_t i, j;
+    char *meta;
+    int ret;
+
+    meta = calloc(im->meta_blocks, ASSOOFS_DEFAULT_BLOCK_SIZE);
+    if (!meta) {
+        perror("Error allocating the sealed metadata");
+        return -1;
+    }
+    for (i = 0; i < im->norder; i++) {
+        n = &im->nodes[im->order[i]];
+        info = (struct assoofs_inode_info *)meta + n->ino - 1;
+        info->mode = n->mode;
+        info->inode_no = n->ino;
+        info->links_count = S_ISDIR(n->mode) ? 1 : n->links;
+        if (S_ISDIR(n->mode)) {
+            info->data_block_number = n->block;
+            info->dir_children_count = n->nchild;
+            rec = (struct assoofs_dir_record_entry *)(meta + n->block);
+            for (j = 0; j < n->nchild; j++) {
+                strcpy(rec[j].filename, n->child[j].name);
+                rec[j].inode_no = im->nodes[n->child[j].node].ino;
+            }
+        } else if (S_ISLNK(n->mode)) {
+            info->file_size = n->size;
+            if (n->size < ASSOOFS_INLINE_SYMLINK_LEN) {
+                memcpy(info->inline_symlink, n->target, n->size + 1);
+            } else {
+                info->data_block_number = n->block;
+                memcpy(meta + n->block, n->target, n->size + 1);
+            }
+        } else {
+            info->file_size = n->size;
+            info->sealed_offset = n->offset;
+        }
+    }
+    ret = write_block(im->fd, ASSOOFS_SEALED_META_BLOCK, meta, im->meta_blocks * ASSOOFS_DEFAULT_BLOCK_SIZE);
+    free(meta);
+    if (!ret)
+        printf("%llu inodes in %llu sealed metadata blocks written succesfully.\n", (unsigned long long)im->ninodes,
+               (unsigned long long)im->meta_blocks);
+    return ret;
+}
+
+static int populate(struct image *im, const char *srcdir, long threads) {
+    struct timespec t0, t1;
+    struct stat st;
+    uint32_t root;
+    double secs;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (srcdir && stat(srcdir, &st)) {
+        printf("Error reading %s: %s\n", srcdir, strerror(errno));
+        return -1;
+    }
+    if (srcdir && !S_ISDIR(st.st_mode)) {
+        printf("%s is not a directory.\n", srcdir);
+        return -1;
+    }
+    if (new_node(im, srcdir ? S_IFDIR | (st.st_mode & 07777) : S_IFDIR | 0755, &root))
         return -1;
+    if (im->sealed) {
+        if (scan_dir(im, root, srcdir) || walk_tree(im) || layout_sealed(im) || copy_files(im, threads) ||
+            write_sealed(im))
+            return -1;
+    } else if (srcdir) {
+        // Primero los directorios y después los datos, todos seguidos y leídos en paralelo
+        if (scan_dir(im, root, srcdir) || walk_tree(im) || layout_meta(im) || layout_data(im) || copy_files(im, threads))
+            return -1;
+    } else {
+        // Los datos se escriben según llegan y los directorios van detrás
+        if (read_tar(im) || walk_tree(im) || layout_meta(im))
+            return -1;
     }
-    printf("Padding after the rootdirectory children written succesfully.\n");
+    if (!im->sealed && write_tree(im))
+        return -1;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    printf("Copied %llu bytes in %.2f s (%.1f MB/s).\n", (unsigned long long)im->bytes_copied, secs,
+           secs > 0 ? im->bytes_copied / secs / 1e6 : 0.0);
     return 0;
 }
 
-int write_block(int fd, char *block, size_t len) {
-    ssize_t ret;
+/*
+ *  Grupos: mapas, contadores de referencias y almacén de inodos van seguidos al principio de
+ *  cada grupo y se escriben de una vez
+ */
+static int write_groups(struct image *im, struct assoofs_group_desc *gdt) {
+    const struct geometry *g = &im->geo;
+    uint64_t group, first, nblocks, meta = group_meta_blocks(g);
+    struct assoofs_group_desc *gd;
+    uint64_t *map;
+    char *region;
 
-    ret = write(fd, block, len);
-    if (ret != len) {
-        printf("Writing file body has failed.\n");
+    region = malloc(meta * ASSOOFS_DEFAULT_BLOCK_SIZE);
+    if (!region) {
+        perror("Error allocating the group metadata");
         return -1;
     }
+    for (group = 0; group < g->groups_count; group++) {
+        first = group_first_block(g, group);
+        nblocks = group_nblocks(g, group);
+        gd = &gdt[group];
+        gd->block_bitmap = first;
+        gd->inode_bitmap = first + 1;
+        gd->refcount_table = first + 2;
+        gd->inode_table = gd->refcount_table + group_refcount_blocks(g);
+        gd->free_blocks_count = nblocks - meta - im->data_used[group];
+        gd->free_inodes_count = g->inodes_per_group - im->inodes_used[group];
+        gd->dirs_count = im->dirs[group];
+        memset(region, 0, meta * ASSOOFS_DEFAULT_BLOCK_SIZE);
+
+        // Mapa de bloques: libres los de datos sin usar; los metadatos y lo que pasa del final, ocupados
+        map = (uint64_t *)region;
+        set_bits(map, meta + im->data_used[group], nblocks);
+        map = (uint64_t *)(region + ASSOOFS_DEFAULT_BLOCK_SIZE);
+        set_bits(map, im->inodes_used[group], g->inodes_per_group);
+        // Contadores de referencias a cero y los inodos usados al principio del almacén
+        memcpy(region + (gd->inode_table - first) * ASSOOFS_DEFAULT_BLOCK_SIZE, im->inodes + group * g->inodes_per_group,
+               im->inodes_used[group] * sizeof(*im->inodes));
+        if (write_block(im->fd, first, region, meta * ASSOOFS_DEFAULT_BLOCK_SIZE)) {
+            free(region);
+            return -1;
+        }
+    }
+    free(region);
+    printf("%llu allocation groups written succesfully.\n", (unsigned long long)g->groups_count);
+    return 0;
+}
+
+static int write_gdt(int fd, const struct geometry *g, const struct assoofs_group_desc *gdt) {
+    uint64_t i;
+
+    for (i = 0; i < g->first_group_block - ASSOOFS_GDT_BLOCK_NUMBER; i++) {
+        if (write_block(fd, ASSOOFS_GDT_BLOCK_NUMBER + i, gdt + i * DESCS_PER_BLOCK, ASSOOFS_DEFAULT_BLOCK_SIZE))
+            return -1;
+    }
+    printf("Group descriptor table written succesfully.\n");
+    return 0;
+}
+
+static int write_superblock(const struct image *im, const struct assoofs_group_desc *gdt, uint64_t volume_id) {
+    const struct geometry *g = &im->geo;
+    struct assoofs_super_block_info sb = {
+        .version = ASSOOFS_VERSION,
+        .magic = ASSOOFS_MAGIC,
+        .block_size = ASSOOFS_DEFAULT_BLOCK_SIZE,
+        .inodes_count = im->ninodes,
+        .blocks_count = g->blocks_count,
+        .groups_count = g->groups_count,
+        .blocks_per_group = g->blocks_per_group,
+        .inodes_per_group = g->inodes_per_group,
+        .first_group_block = g->first_group_block,
+        .devices_count = stripe.count > 1 ? stripe.count : 0,
+        .stripe_blocks = stripe.count > 1 ? stripe.stripe_blocks : 0,
+        .volume_id = volume_id,
+        .flags = im->sealed ? ASSOOFS_SB_SEALED : ASSOOFS_SB_CLEAN,
+        .meta_blocks = im->meta_blocks,
+    };
+    uint64_t i;
+
+    for (i = 0; i < g->groups_count; i++)
+        sb.free_blocks += gdt[i].free_blocks_count;
+    if (write_block(im->fd, ASSOOFS_SUPERBLOCK_BLOCK_NUMBER, &sb, sizeof(sb)))
+        return -1;
+
+    printf("Super block written succesfully.\n");
+    return 0;
+}
+
+static int write_dirent(int fd, uint64_t block, const struct assoofs_dir_record_entry *record) {
+    char buf[ASSOOFS_DEFAULT_BLOCK_SIZE] = { 0 };
+
+    memcpy(buf, record, sizeof(*record));
+    if (write_block(fd, block, buf, sizeof(buf)))
+        return -1;
+    printf("root directory datablocks (name+inode_no pair for welcomefile) written succesfully.\n");
+    return 0;
+}
+
+static int write_welcome_body(int fd, uint64_t block, const char *body, size_t len) {
+    char buf[ASSOOFS_DEFAULT_BLOCK_SIZE] = { 0 };
+
+    memcpy(buf, body, len);
+    if (write_block(fd, block, buf, sizeof(buf)))
+        return -1;
     printf("block has been written succesfully.\n");
     return 0;
 }
 
-int main(int argc, char *argv[]) {
-    int fd;
-    ssize_t ret;
+// Sin árbol de origen: la raíz y README.txt, en los dos primeros inodos y bloques del grupo 0
+static int write_welcome(struct image *im) {
     char welcomefile_body[] = "Hola mundo, os saludo desde un sistema de ficheros ASSOOFS.\n";
-    
+    uint64_t root_block;
+
+    struct assoofs_inode_info root_inode = {
+        .mode = S_IFDIR,
+        .links_count = 1,
+        .inode_no = ASSOOFS_ROOTDIR_INODE_NUMBER,
+        .dir_children_count = 1,
+    };
+
     struct assoofs_inode_info welcome = {
         .mode = S_IFREG,
+        .links_count = 1,
         .inode_no = WELCOMEFILE_INODE_NUMBER,
-        .data_block_number = WELCOMEFILE_DATABLOCK_NUMBER,
         .file_size = sizeof(welcomefile_body),
+        .extents_count = 1,
     };
-    
+
     struct assoofs_dir_record_entry record = {
         .filename = "README.txt",
         .inode_no = WELCOMEFILE_INODE_NUMBER,
     };
 
-    if (argc != 2) {
-        printf("Usage: mkassoofs <device>\n");
+    im->inodes = calloc(2, sizeof(*im->inodes));
+    if (!im->inodes) {
+        perror("Error allocating the inode table");
+        return -1;
+    }
+    root_block = take_blocks(im, 0, 2);
+    root_inode.data_block_number = root_block;
+    welcome.extents[0].len = 1;
+    welcome.extents[0].start = root_block + 1;
+    im->inodes[0] = root_inode;
+    im->inodes[1] = welcome;
+    im->ninodes = im->inodes_used[0] = 2;
+    im->dirs[0] = 1;
+
+    if (write_dirent(im->fd, root_block, &record))
+        return -1;
+    return write_welcome_body(im->fd, welcome.extents[0].start, welcomefile_body, welcome.file_size);
+}
+
+static void usage(void) {
+    printf("Usage: mkassoofs [-g blocks_per_group] [-d source_dir [-S] | -t] [-j threads] [-m device]... [-s stripe_kb] [-L [-z zone_kb]] <device>\n");
+    printf("  -d  fill the image with a copy of source_dir\n");
+    printf("  -S  seal it: a read-only image with no free space and metadata read in one go\n");
+    printf("  -t  fill the image with a tar archive read from stdin\n");
+    printf("  -m  add another member to the volume; file data is striped over all of them\n");
+    printf("  -s  stripe unit in KiB (default 64)\n");
+    printf("  -L  log-structured: append everything to zones, for zoned or append-only devices\n");
+    printf("  -z  zone size in KiB for -L on a device without zones of its own (default 4096)\n");
+}
+
+// Abre todos los miembros; el volumen se mide por el más pequeño
+static int open_members(uint64_t *blocks) {
+    uint64_t member;
+    unsigned int i;
+
+    for (i = 0; i < stripe.count; i++) {
+        stripe.fds[i] = open(stripe.paths[i], O_RDWR);
+        if (stripe.fds[i] == -1) {
+            printf("Error opening %s: %s\n", stripe.paths[i], strerror(errno));
+            return -1;
+        }
+        if (device_blocks(stripe.fds[i], &member))
+            return -1;
+        if (!i || member < *blocks)
+            *blocks = member;
+    }
+    return 0;
+}
+
+static void close_members(void) {
+    unsigned int i;
+
+    for (i = 0; i < stripe.count; i++) {
+        if (stripe.fds[i] > 0)
+            close(stripe.fds[i]);
+    }
+}
+
+static int sync_members(void) {
+    unsigned int i;
+
+    for (i = 0; i < stripe.count; i++) {
+        if (fsync(stripe.fds[i])) {
+            perror("Error flushing the device");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ *  Sin grupos ni tabla de descriptores: metadatos, datos y superbloque. Si el destino es un
+ *  fichero se recorta a lo que ocupa la imagen.
+ */
+static int make_sealed(struct image *im, const char *srcdir, long threads, uint64_t blocks) {
+    struct stat st;
+
+    im->sealed = true;
+    im->geo.blocks_count = blocks;
+    if (populate(im, srcdir, threads) || write_superblock(im, NULL, 0))
+        return 1;
+    if (!fstat(im->fd, &st) && S_ISREG(st.st_mode) &&
+        ftruncate(im->fd, im->geo.blocks_count * ASSOOFS_DEFAULT_BLOCK_SIZE)) {
+        perror("Error trimming the image");
+        return 1;
+    }
+    if (sync_members())
+        return 1;
+    printf("Sealed image of %llu blocks.\n", (unsigned long long)im->geo.blocks_count);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int fd, opt;
+    int ret;
+    uint64_t blocks = 0, bpg = 0, stripe_kb = 64, volume_id = 0;
+    struct image im;
+    struct assoofs_group_desc *gdt;
+    const char *srcdir = NULL;
+    bool tar = false, sealed = false, log = false;
+    uint64_t zone_kb = 4096;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    while ((opt = getopt(argc, argv, "g:d:Stj:m:s:Lz:")) != -1) {
+        switch (opt) {
+        case 'g':
+            bpg = strtoull(optarg, NULL, 0);
+            break;
+        case 'd':
+            srcdir = optarg;
+            break;
+        case 'S':
+            sealed = true;
+            break;
+        case 't':
+            tar = true;
+            break;
+        case 'j':
+            threads = strtol(optarg, NULL, 0);
+            break;
+        case 'm':
+            if (stripe.count == ASSOOFS_MAX_DEVICES) {
+                printf("A volume can have at most %d devices.\n", ASSOOFS_MAX_DEVICES);
+                return -1;
+            }
+            stripe.paths[stripe.count++] = optarg;
+            break;
+        case 's':
+            stripe_kb = strtoull(optarg, NULL, 0);
+            break;
+        case 'L':
+            log = true;
+            break;
+        case 'z':
+            zone_kb = strtoull(optarg, NULL, 0);
+            break;
+        default:
+            usage();
+            return -1;
+        }
+    }
+    if (optind != argc - 1 || (srcdir && tar) || (sealed && !srcdir)) {
+        usage();
+        return -1;
+    }
+    if (sealed && stripe.count > 1) {
+        printf("A sealed image lives on a single device.\n");
+        return -1;
+    }
+    if (log && (sealed || stripe.count > 1)) {
+        printf("A log-structured volume lives on a single device and is not sealed.\n");
+        return -1;
+    }
+    logdev.zone_blocks = zone_kb * 1024 / ASSOOFS_DEFAULT_BLOCK_SIZE;
+    if (log && (!logdev.zone_blocks || zone_kb * 1024 % ASSOOFS_DEFAULT_BLOCK_SIZE)) {
+        printf("The zone size must be a multiple of %d KiB.\n", ASSOOFS_DEFAULT_BLOCK_SIZE / 1024);
+        return -1;
+    }
+    if (threads < 1)
+        threads = 1;
+    stripe.stripe_blocks = stripe_kb * 1024 / ASSOOFS_DEFAULT_BLOCK_SIZE;
+    if (!stripe.stripe_blocks || stripe.stripe_blocks > ASSOOFS_MAX_BLOCKS_PER_GROUP ||
+        stripe_kb * 1024 % ASSOOFS_DEFAULT_BLOCK_SIZE) {
+        printf("The stripe unit must be a multiple of %d KiB.\n", ASSOOFS_DEFAULT_BLOCK_SIZE / 1024);
         return -1;
     }
 
-    fd = open(argv[1], O_RDWR);
-    if (fd == -1) {
-        perror("Error opening the device");
+    stripe.paths[0] = argv[optind];
+    if (open_members(&blocks)) {
+        close_members();
+        return -1;
+    }
+    fd = stripe.fds[0];
+    memset(&im, 0, sizeof(im));
+    im.fd = fd;
+    if (sealed) {
+        ret = make_sealed(&im, srcdir, threads, blocks);
+        close_members();
+        return ret;
+    }
+    if (log && log_setup(fd, blocks, &blocks)) {
+        close_members();
+        return -1;
+    }
+    if (stripe.count == 1 ? compute_geometry(blocks, bpg, &im.geo) : stripe_geometry(blocks, bpg, &im.geo)) {
+        close_members();
+        return -1;
+    }
+    if (stripe.count > 1 && getrandom(&volume_id, sizeof(volume_id), 0) != sizeof(volume_id))
+        volume_id = (uint64_t)time(NULL) << 32 ^ getpid();
+    gdt = calloc(im.geo.first_group_block - ASSOOFS_GDT_BLOCK_NUMBER, ASSOOFS_DEFAULT_BLOCK_SIZE);
+    im.data_used = calloc(im.geo.groups_count, sizeof(uint64_t));
+    im.inodes_used = calloc(im.geo.groups_count, sizeof(uint64_t));
+    im.dirs = calloc(im.geo.groups_count, sizeof(uint64_t));
+    if (!gdt || !im.data_used || !im.inodes_used || !im.dirs) {
+        perror("Error allocating the group descriptor table");
+        close_members();
         return -1;
     }
 
     ret = 1;
     do {
-        if (write_superblock(fd))
+        if (srcdir || tar ? populate(&im, srcdir, threads) : write_welcome(&im))
             break;
 
-        if (write_root_inode(fd))
+        if (write_groups(&im, gdt))
             break;
-        
-        if (write_welcome_inode(fd, &welcome))
+
+        if (write_gdt(fd, &im.geo, gdt))
+            break;
+
+        if (stripe.count > 1 && write_labels(volume_id))
             break;
 
-        if (write_dirent(fd, &record))
+        if (write_superblock(&im, gdt, volume_id))
             break;
-        
-        if (write_block(fd, welcomefile_body, welcome.file_size))
+
+        if (log && log_finish(fd))
+            break;
+
+        if (sync_members())
             break;
 
         ret = 0;
     } while (0);
 
-    close(fd);
+    free(gdt);
+    close_members();
     return ret;
 }